@@ -0,0 +1,417 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+// for the cpu affinity calls
+#define _GNU_SOURCE
+
+#include "affinity.h"
+#include "machine.h"
+#include "pool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef FILTER_NUMA
+#include <numaif.h>
+#endif
+
+#define CPU_DIR "/sys/devices/system/cpu"
+#define NODE_DIR "/sys/devices/system/node"
+
+/* node_bandwidth reads a buffer of BANDWIDTH_BYTES, BANDWIDTH_REPEATS
+ * times, and keeps the fastest
+ */
+#define BANDWIDTH_BYTES (64 << 20)
+#define BANDWIDTH_REPEATS 5
+
+/* Where a cpu is in the machine */
+typedef struct cpu_info_t
+{
+    int32_t cpu;
+    int32_t node;
+    int32_t package;
+    int32_t core;
+    int32_t core_rank;    // among the cores of its node
+    int32_t sibling_rank; // among the hardware threads of its core
+} cpu_info;
+
+/* What a worker does to pin itself */
+typedef struct pin_work_t
+{
+    int32_t cpu;
+    int32_t err;
+} pin_work;
+
+/* What a worker does to place its band of rows */
+typedef struct place_work_t
+{
+    const char *source; // NULL for zeros
+    char *target;
+    size_t row_size;
+    int32_t height;
+    int32_t id;
+    int32_t num_workers;
+    placement how;
+} place_work;
+
+/* A bandwidth trial: touch or read buffer */
+typedef struct bandwidth_work_t
+{
+    uint64_t *buffer;
+    size_t words;
+    int32_t node;
+    double best;
+    uint64_t sum;
+} bandwidth_work;
+
+/* Parses a list of cpus or nodes such as "0,2,8-11" into values, in that
+ * order. Returns how many there are, -1 if the list is invalid or longer
+ * than max.
+ */
+static int32_t parse_list(const char *list, int32_t *values, int32_t max)
+{
+    int32_t count = 0;
+    while (*list != '\0' && *list != '\n') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) return -1;
+        }
+        for (long value = first; value <= last; value ++) {
+            if (count == max) return -1;
+            values[count ++] = value;
+        }
+        if (*end == ',') end ++;
+        else if (*end != '\0' && *end != '\n') return -1;
+        list = end;
+    }
+    return count;
+}
+
+/* Reads the first line of path into line. Returns 0 on success. */
+static int read_line(const char *path, char *line, int size)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+    int ok = fgets(line, size, file) != NULL;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+int32_t num_nodes(void)
+{
+    char line[256];
+    int32_t nodes[MAX_AFFINITY_CPUS];
+    if (read_line(NODE_DIR "/online", line, sizeof(line)) != 0) return 1;
+    int32_t count = parse_list(line, nodes, MAX_AFFINITY_CPUS);
+    int32_t highest = 0;
+    for (int32_t i = 0; i < count; i ++) {
+        if (nodes[i] > highest) highest = nodes[i];
+    }
+    return highest + 1;
+}
+
+/* The node of cpu, 0 if sysfs does not say */
+static int32_t cpu_node(int32_t cpu)
+{
+    int32_t nodes = num_nodes();
+    for (int32_t node = 0; node < nodes; node ++) {
+        char path[128];
+        snprintf(path, sizeof(path), CPU_DIR "/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) return node;
+    }
+    return 0;
+}
+
+/* A field of the topology of cpu, -1 if sysfs does not say */
+static int32_t topology_id(int32_t cpu, const char *name)
+{
+    char path[128], line[32];
+    snprintf(path, sizeof(path), CPU_DIR "/cpu%d/topology/%s", cpu, name);
+    if (read_line(path, line, sizeof(line)) != 0) return -1;
+    return atoi(line);
+}
+
+static int compare_compact(const void *a, const void *b)
+{
+    const cpu_info *x = (const cpu_info *) a;
+    const cpu_info *y = (const cpu_info *) b;
+    if (x->node != y->node) return x->node - y->node;
+    if (x->package != y->package) return x->package - y->package;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static int compare_scatter(const void *a, const void *b)
+{
+    const cpu_info *x = (const cpu_info *) a;
+    const cpu_info *y = (const cpu_info *) b;
+    if (x->sibling_rank != y->sibling_rank) {
+        return x->sibling_rank - y->sibling_rank;
+    }
+    if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+    if (x->node != y->node) return x->node - y->node;
+    return x->cpu - y->cpu;
+}
+
+/* The cpus the process may run on, in compact order. Returns how many
+ * there are.
+ */
+static int32_t read_topology(cpu_info *cpus)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 0;
+    int32_t count = 0;
+    for (int32_t cpu = 0; cpu < CPU_SETSIZE && count < MAX_AFFINITY_CPUS;
+            cpu ++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        cpus[count].cpu = cpu;
+        cpus[count].node = cpu_node(cpu);
+        cpus[count].package = topology_id(cpu, "physical_package_id");
+        cpus[count].core = topology_id(cpu, "core_id");
+        count ++;
+    }
+    qsort(cpus, count, sizeof(cpu_info), compare_compact);
+
+    // the hardware threads of a core are next to each other now
+    for (int32_t i = 0; i < count; i ++) {
+        cpu_info *info = &cpus[i];
+        const cpu_info *previous = i > 0 ? &cpus[i - 1] : NULL;
+        if (previous == NULL || previous->node != info->node) {
+            info->core_rank = 0;
+            info->sibling_rank = 0;
+        } else if (previous->package == info->package &&
+                previous->core == info->core) {
+            info->core_rank = previous->core_rank;
+            info->sibling_rank = previous->sibling_rank + 1;
+        } else {
+            info->core_rank = previous->core_rank + 1;
+            info->sibling_rank = 0;
+        }
+    }
+    return count;
+}
+
+int32_t parse_affinity(const char *spec, affinity *a)
+{
+    cpu_info cpus[MAX_AFFINITY_CPUS];
+    int32_t count = read_topology(cpus);
+    if (strcmp(spec, "compact") == 0 || strcmp(spec, "scatter") == 0) {
+        a->policy = spec[0] == 'c' ? AFFINITY_COMPACT : AFFINITY_SCATTER;
+        if (a->policy == AFFINITY_SCATTER) {
+            qsort(cpus, count, sizeof(cpu_info), compare_scatter);
+        }
+        for (int32_t i = 0; i < count; i ++) a->cpus[i] = cpus[i].cpu;
+        a->num_cpus = count;
+        return count > 0 ? 0 : -1;
+    }
+
+    a->policy = AFFINITY_LIST;
+    a->num_cpus = parse_list(spec, a->cpus, MAX_AFFINITY_CPUS);
+    if (a->num_cpus <= 0) return -1;
+    for (int32_t i = 0; i < a->num_cpus; i ++) {
+        int32_t allowed = 0;
+        for (int32_t j = 0; j < count && !allowed; j ++) {
+            allowed = cpus[j].cpu == a->cpus[i];
+        }
+        if (!allowed) return -1;
+    }
+    return 0;
+}
+
+static void *pin_worker(void *param)
+{
+    pin_work *w = (pin_work *) param;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    w->err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return NULL;
+}
+
+int32_t pin_filter_pool(filter_pool *pool, const affinity *a)
+{
+    if (a->policy == AFFINITY_NONE || a->num_cpus == 0) return 0;
+    int32_t num_workers = filter_pool_size(pool);
+    pin_work work[num_workers];
+    void *params[num_workers];
+    for (int32_t i = 0; i < num_workers; i ++) {
+        work[i].cpu = a->cpus[i % a->num_cpus];
+        params[i] = &work[i];
+    }
+    filter_pool_run(pool, pin_worker, params);
+    for (int32_t i = 0; i < num_workers; i ++) {
+        if (work[i].err != 0) return -1;
+    }
+    return 0;
+}
+
+int32_t can_bind(void)
+{
+#ifdef FILTER_NUMA
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef FILTER_NUMA
+/* Binds the pages of [start, end) of buffer, a page aligned buffer padded
+ * to whole pages, to node. A page shared with the previous range goes
+ * with that range.
+ */
+static void bind_range(char *buffer, size_t start, size_t end, int32_t node)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    start = (start + page - 1) / page * page;
+    end = (end + page - 1) / page * page;
+    if (end <= start) return;
+    unsigned long nodes[MAX_AFFINITY_CPUS / (8 * sizeof(unsigned long))];
+    memset(nodes, 0, sizeof(nodes));
+    nodes[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    // best effort: the pages are first touched by the same worker anyway
+    mbind(buffer + start, end - start, MPOL_BIND, nodes,
+            8 * sizeof(nodes), MPOL_MF_MOVE);
+}
+#endif
+
+/* Places the band of rows of worker id: an even split of the rows, the
+ * last band taking the remainder, which is about the rows of tiles
+ * SHARDED_ROWS gives it
+ */
+static void *place_rows(void *param)
+{
+    place_work *w = (place_work *) param;
+    int32_t rows = w->height / w->num_workers;
+    int32_t start_row = w->id * rows;
+    int32_t end_row = w->id == w->num_workers - 1 ? w->height
+                                                  : start_row + rows;
+    size_t start = start_row * w->row_size;
+    size_t end = end_row * w->row_size;
+#ifdef FILTER_NUMA
+    if (w->how == PLACE_BIND) {
+        bind_range(w->target, start, end, cpu_node(sched_getcpu()));
+    }
+#endif
+    if (w->source != NULL) memcpy(w->target + start, w->source + start,
+            end - start);
+    else memset(w->target + start, 0, end - start);
+    return NULL;
+}
+
+/* Page aligned memory padded to whole pages, not touched yet */
+static void *allocate_pages(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *buffer = NULL;
+    size = (size + page - 1) / page * page;
+    if (posix_memalign(&buffer, page, size > 0 ? size : page) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+void *place_buffer(filter_pool *pool, const void *buffer, size_t row_size,
+        int32_t height, placement how)
+{
+    char *target = (char *) allocate_pages(row_size * height);
+    if (target == NULL) return NULL;
+    int32_t num_workers = filter_pool_size(pool);
+    place_work work[num_workers];
+    void *params[num_workers];
+    for (int32_t i = 0; i < num_workers; i ++) {
+        place_work w = {(const char *) buffer, target, row_size, height, i,
+            num_workers, how};
+        work[i] = w;
+        params[i] = &work[i];
+    }
+    filter_pool_run(pool, place_rows, params);
+    return target;
+}
+
+/* The first cpu of node the process may run on, -1 if none */
+static int32_t node_cpu(int32_t node)
+{
+    cpu_info cpus[MAX_AFFINITY_CPUS];
+    int32_t count = read_topology(cpus);
+    for (int32_t i = 0; i < count; i ++) {
+        if (cpus[i].node == node) return cpus[i].cpu;
+    }
+    return -1;
+}
+
+/* Runs routine(param) on a thread of its own pinned to cpu, and waits */
+static int32_t run_pinned(int32_t cpu, void *(*routine)(void *), void *param)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    int err = pthread_create(&thread, &attr, routine, param);
+    pthread_attr_destroy(&attr);
+    if (err != 0) return -1;
+    pthread_join(thread, NULL);
+    return 0;
+}
+
+/* Puts the buffer on w->node: bound there if possible, first touched by
+ * a thread there anyway
+ */
+static void *touch_buffer(void *param)
+{
+    bandwidth_work *w = (bandwidth_work *) param;
+#ifdef FILTER_NUMA
+    bind_range((char *) w->buffer, 0, w->words * sizeof(uint64_t), w->node);
+#endif
+    for (size_t i = 0; i < w->words; i ++) w->buffer[i] = i;
+    return NULL;
+}
+
+static void *read_buffer(void *param)
+{
+    bandwidth_work *w = (bandwidth_work *) param;
+    for (int32_t r = 0; r < BANDWIDTH_REPEATS; r ++) {
+        double start = now_ns();
+        uint64_t sum = 0;
+        for (size_t i = 0; i < w->words; i ++) sum += w->buffer[i];
+        double time = now_ns() - start;
+        w->sum += sum; // keeps the loop
+        if (r == 0 || time < w->best) w->best = time;
+    }
+    return NULL;
+}
+
+double node_bandwidth(int32_t cpu_node, int32_t memory_node)
+{
+    int32_t reader = node_cpu(cpu_node);
+    int32_t owner = node_cpu(memory_node);
+    if (reader < 0 || owner < 0) return -1;
+    bandwidth_work w = {(uint64_t *) allocate_pages(BANDWIDTH_BYTES),
+        BANDWIDTH_BYTES / sizeof(uint64_t), memory_node, 0, 0};
+    if (w.buffer == NULL) return -1;
+    int32_t err = run_pinned(owner, touch_buffer, &w);
+    if (err == 0) err = run_pinned(reader, read_buffer, &w);
+    free(w.buffer);
+    return err == 0 && w.best > 0 ? BANDWIDTH_BYTES / w.best : -1;
+}
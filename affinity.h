@@ -0,0 +1,95 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+
+#ifndef __AFFINITY__H
+#define __AFFINITY__H
+
+#include "filters.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**************THREAD AFFINITY AND NUMA PLACEMENT*****************/
+/* Pool workers can be pinned to cpus, worker i to the i-th cpu of an
+ * affinity (wrapping around when there are more workers than cpus):
+ * - compact: the cpus in topology order, so that workers fill a core,
+ *   then a socket, then a NUMA node before using the next one;
+ * - scatter: one cpu per node in turn, and one per core before the
+ *   second hardware thread of any core;
+ * - a list of cpus, e.g. "0,2,8-11", taken in that order.
+ * Only the cpus the process may run on are used.
+ *
+ * With pinned workers, place_buffer lays an image out so that about the
+ * rows worker i filters under SHARDED_ROWS live on worker i's node: worker
+ * i first touches (or, with libnuma, binds) an even band of the rows. The other
+ * methods share their rows among all the workers, and get the same bands,
+ * which spreads the pages evenly over the nodes.
+ *
+ * Built with FILTER_NUMA defined (make main NUMA=1, which links libnuma),
+ * PLACE_BIND is available: pages are bound with mbind to the node of the
+ * worker that filters them, whoever touches them first.
+ */
+
+#define MAX_AFFINITY_CPUS 1024
+
+typedef enum
+{
+    AFFINITY_NONE,
+    AFFINITY_COMPACT,
+    AFFINITY_SCATTER,
+    AFFINITY_LIST
+} affinity_policy;
+
+typedef struct affinity_t
+{
+    affinity_policy policy;
+    int32_t num_cpus;
+    int32_t cpus[MAX_AFFINITY_CPUS]; // in the order the workers take them
+} affinity;
+
+typedef enum
+{
+    PLACE_FIRST_TOUCH,
+    PLACE_BIND
+} placement;
+
+/* Fills a from spec: "compact", "scatter", or a list of cpus. Returns 0 on
+ * success, -1 if spec is invalid or names no cpu the process may use.
+ */
+int32_t parse_affinity(const char *spec, affinity *a);
+
+/* Pins worker i of pool to a->cpus[i % a->num_cpus], for the lifetime of
+ * the pool. Returns 0 on success.
+ */
+int32_t pin_filter_pool(filter_pool *pool, const affinity *a);
+
+/* Whether PLACE_BIND is compiled in */
+int32_t can_bind(void);
+
+/* A new buffer of height rows of row_size bytes, laid out for the workers
+ * of pool (see above), holding a copy of buffer, or zeros if buffer is
+ * NULL. Free it with free. Returns NULL on failure.
+ */
+void *place_buffer(filter_pool *pool, const void *buffer, size_t row_size,
+        int32_t height, placement how);
+
+/* Number of NUMA nodes, at least 1 */
+int32_t num_nodes(void);
+
+/* Read bandwidth in GB/s of a thread on a cpu of cpu_node from memory on
+ * memory_node, or a negative value if either node has no cpu the process
+ * may use.
+ */
+double node_bandwidth(int32_t cpu_node, int32_t memory_node);
+#endif
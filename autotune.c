@@ -0,0 +1,333 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+
+#include "autotune.h"
+#include "machine.h"
+#include "tiles.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+/* A trial is a warm-up run, then TRIAL_REPEATS timed runs of which the
+ * fastest counts. A warm-up longer than LONG_TRIAL ns counts by itself, so
+ * big images keep the search short.
+ */
+#define TRIAL_REPEATS 3
+#define LONG_TRIAL 50e6
+
+/* The search starts from every thread, TUNING_CHUNK and the default
+ * tiles, then tries each setting in turn with the others fixed at the best
+ * so far, for at most SEARCH_ROUNDS rounds.
+ */
+#define TUNING_CHUNK 32
+#define SEARCH_ROUNDS 2
+
+/* Pixel formats a class tells apart */
+#define FORMAT_IN_PLACE 0
+#define FORMAT_RECOMPUTE 1
+#define FORMAT_8BIT 2
+
+/* One line of the profile: a method and class, and its winner */
+typedef struct profile_entry_t
+{
+    int32_t method;
+    int32_t dimension;
+    int32_t width_class;
+    int32_t height_class;
+    int32_t format;
+    tuned_settings settings;
+} profile_entry;
+
+typedef struct profile_t
+{
+    profile_entry *entries;
+    int32_t count;
+} profile;
+
+/* Everything a trial needs, with the pool of each thread count tried,
+ * created the first time it is needed and kept warm.
+ */
+typedef struct trial_context_t
+{
+    const filter *f;
+    const pgm_image *source;
+    pgm_image *target;
+    parallel_method method;
+    normalization_mode normalization;
+    filter_pool **pools; // indexed by number of threads
+} trial_context;
+
+/* log2 of size, rounded down */
+static int32_t size_class(int32_t size)
+{
+    int32_t size_log = 0;
+    while (((int64_t) 2 << size_log) <= size) size_log ++;
+    return size_log;
+}
+
+/* The class of a width x height image filtered with f */
+static void init_entry(profile_entry *entry, const filter *f, int32_t width,
+        int32_t height, int32_t u8, parallel_method method,
+        normalization_mode normalization)
+{
+    entry->method = method;
+    entry->dimension = f->dimension;
+    entry->width_class = size_class(width);
+    entry->height_class = size_class(height);
+    entry->format = u8 ? FORMAT_8BIT
+        : normalization == NORMALIZE_RECOMPUTE ? FORMAT_RECOMPUTE
+                                               : FORMAT_IN_PLACE;
+}
+
+static int same_class(const profile_entry *a, const profile_entry *b)
+{
+    return a->method == b->method && a->dimension == b->dimension &&
+        a->width_class == b->width_class &&
+        a->height_class == b->height_class && a->format == b->format;
+}
+
+/* Reads the entries of the profile at path, none if it is missing or was
+ * made on another machine. Returns -1 if out of memory.
+ */
+static int read_profile(const char *path, profile *p)
+{
+    p->entries = NULL;
+    p->count = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return 0;
+    if (read_machine_header(file, PROFILE_VERSION) != 0) {
+        fclose(file);
+        return 0;
+    }
+
+    profile_entry entry;
+    while (fscanf(file, " method %d dimension %d width %d height %d "
+                "format %d threads %d chunk %d aspect %d time %lf",
+                &entry.method, &entry.dimension, &entry.width_class,
+                &entry.height_class, &entry.format,
+                &entry.settings.num_threads, &entry.settings.work_chunk,
+                &entry.settings.tile_aspect, &entry.settings.time) == 9) {
+        profile_entry *entries = (profile_entry *) realloc(p->entries,
+                (p->count + 1) * sizeof(profile_entry));
+        if (entries == NULL) {
+            fclose(file);
+            return -1;
+        }
+        p->entries = entries;
+        p->entries[p->count ++] = entry;
+    }
+    fclose(file);
+    return 0;
+}
+
+/* Best effort, like the model cache */
+static void write_profile(const char *path, const profile *p)
+{
+    char temporary[4096];
+    FILE *file = begin_machine_file(path, PROFILE_VERSION, temporary,
+            sizeof(temporary));
+    if (file == NULL) return;
+    for (int32_t i = 0; i < p->count; i ++) {
+        const profile_entry *entry = &p->entries[i];
+        fprintf(file, "method %d dimension %d width %d height %d format %d "
+                "threads %d chunk %d aspect %d time %.0f\n", entry->method,
+                entry->dimension, entry->width_class, entry->height_class,
+                entry->format, entry->settings.num_threads,
+                entry->settings.work_chunk, entry->settings.tile_aspect,
+                entry->settings.time);
+    }
+    end_machine_file(file, temporary, path);
+}
+
+/* Keeps entry in the profile at path, replacing the one of its class */
+static void update_profile(const char *path, const profile_entry *entry)
+{
+    profile p;
+    if (read_profile(path, &p) != 0) {
+        free(p.entries);
+        return;
+    }
+    int32_t i = 0;
+    while (i < p.count && !same_class(&p.entries[i], entry)) i ++;
+    if (i == p.count) {
+        profile_entry *entries = (profile_entry *) realloc(p.entries,
+                (p.count + 1) * sizeof(profile_entry));
+        if (entries == NULL) {
+            free(p.entries);
+            return;
+        }
+        p.entries = entries;
+        p.count ++;
+    }
+    p.entries[i] = *entry;
+    write_profile(path, &p);
+    free(p.entries);
+}
+
+/* update_profile for runs that may autotune at once: they take turns
+ * through an flock on path.lock, a file that (unlike the profile, which is
+ * replaced) stays the same, so none of them drops an entry another one
+ * stored meanwhile. Without the lock file, the update still goes ahead.
+ */
+static void store_entry(const char *path, const profile_entry *entry)
+{
+    char lock_path[4096];
+    int length = snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock = length >= 0 && length < (int) sizeof(lock_path)
+        ? open(lock_path, O_RDWR | O_CREAT, 0644) : -1;
+    if (lock >= 0) flock(lock, LOCK_EX);
+    update_profile(path, entry);
+    // closing releases the lock
+    if (lock >= 0) close(lock);
+}
+
+int32_t find_tuned(const filter *f, int32_t width, int32_t height,
+        int32_t u8, parallel_method method, normalization_mode normalization,
+        tuned_settings *settings)
+{
+    char buffer[4096];
+    const char *path = machine_file_path(PROFILE_ENV, PROFILE_NAME, buffer,
+            sizeof(buffer));
+    profile p;
+    if (path == NULL || read_profile(path, &p) != 0) return -1;
+
+    profile_entry wanted;
+    init_entry(&wanted, f, width, height, u8, method, normalization);
+    int32_t found = -1;
+    for (int32_t i = 0; i < p.count && found != 0; i ++) {
+        if (same_class(&p.entries[i], &wanted)) {
+            *settings = p.entries[i].settings;
+            found = 0;
+        }
+    }
+    free(p.entries);
+    return found;
+}
+
+/* One run of the method with settings */
+static double run_trial(trial_context *t, filter_pool *pool,
+        const tuned_settings *settings)
+{
+    const pgm_image *source = t->source;
+    double start = now_ns();
+    if (source->pixels != NULL) {
+        apply_filter2d_pool_u8(pool, t->f, source->pixels, t->target->pixels,
+                source->width, source->height, t->method,
+                settings->work_chunk);
+    } else {
+        apply_filter2d_pool(pool, t->f, source->matrix, t->target->matrix,
+                source->width, source->height, t->method,
+                settings->work_chunk, t->normalization);
+    }
+    return now_ns() - start;
+}
+
+/* Times settings, see TRIAL_REPEATS */
+static double trial(trial_context *t, const tuned_settings *settings)
+{
+    filter_pool **pool = &t->pools[settings->num_threads];
+    if (*pool == NULL) *pool = create_filter_pool(settings->num_threads);
+    if (*pool == NULL) exit(-1);
+    filter_pool_set_tile_aspect(*pool, settings->tile_aspect);
+
+    double best = run_trial(t, *pool, settings);
+    if (best >= LONG_TRIAL) return best;
+    for (int32_t i = 0; i < TRIAL_REPEATS; i ++) {
+        double time = run_trial(t, *pool, settings);
+        if (i == 0 || time < best) best = time;
+    }
+    return best;
+}
+
+static int same_settings(const tuned_settings *a, const tuned_settings *b)
+{
+    return a->num_threads == b->num_threads &&
+        a->work_chunk == b->work_chunk && a->tile_aspect == b->tile_aspect;
+}
+
+/* Keeps candidate in best if it is faster */
+static void try_settings(trial_context *t, tuned_settings *best,
+        tuned_settings candidate)
+{
+    if (same_settings(&candidate, best)) return;
+    candidate.time = trial(t, &candidate);
+    if (candidate.time < best->time) *best = candidate;
+}
+
+tuned_settings autotune(const filter *f, const pgm_image *source,
+        pgm_image *target, parallel_method method,
+        normalization_mode normalization, int32_t max_threads)
+{
+    if (max_threads < 1) max_threads = 1;
+    trial_context t = {f, source, target, method, normalization,
+        (filter_pool **) calloc(max_threads + 1, sizeof(filter_pool *))};
+    if (t.pools == NULL) exit(-1);
+
+    int32_t takes_chunk = method == WORK_QUEUE || method == WORK_STEALING;
+    tuned_settings best = {max_threads, takes_chunk ? TUNING_CHUNK : 0, 0, 0};
+    best.time = trial(&t, &best);
+    for (int32_t round = 0; round < SEARCH_ROUNDS; round ++) {
+        tuned_settings start = best;
+
+        // powers of two, and every thread
+        for (int32_t n = 1; n < max_threads; n *= 2) {
+            tuned_settings candidate = best;
+            candidate.num_threads = n;
+            try_settings(&t, &best, candidate);
+        }
+        tuned_settings every_thread = best;
+        every_thread.num_threads = max_threads;
+        try_settings(&t, &best, every_thread);
+
+        // chunks up to the first that covers the whole image
+        for (int32_t i = 0; takes_chunk && i < NUM_WORK_CHUNKS; i ++) {
+            if (i > 0 && work_chunks[i - 1] >= source->width &&
+                    work_chunks[i - 1] >= source->height) {
+                break;
+            }
+            tuned_settings candidate = best;
+            candidate.work_chunk = work_chunks[i];
+            try_settings(&t, &best, candidate);
+        }
+
+        for (int32_t aspect = -MAX_TILE_ASPECT; aspect <= MAX_TILE_ASPECT;
+                aspect ++) {
+            tuned_settings candidate = best;
+            candidate.tile_aspect = aspect;
+            try_settings(&t, &best, candidate);
+        }
+
+        if (same_settings(&best, &start)) break;
+    }
+
+    for (int32_t n = 1; n <= max_threads; n ++) {
+        if (t.pools[n] != NULL) destroy_filter_pool(t.pools[n]);
+    }
+    free(t.pools);
+
+    char buffer[4096];
+    const char *path = machine_file_path(PROFILE_ENV, PROFILE_NAME, buffer,
+            sizeof(buffer));
+    if (path != NULL) {
+        profile_entry entry;
+        init_entry(&entry, f, source->width, source->height,
+                source->pixels != NULL, method, normalization);
+        entry.settings = best;
+        store_entry(path, &entry);
+    }
+    return best;
+}
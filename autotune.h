@@ -0,0 +1,68 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+
+#ifndef __AUTOTUNE__H
+#define __AUTOTUNE__H
+
+#include "pgm.h"
+#include "filters.h"
+#include <stdint.h>
+
+/**************AUTOTUNING*****************/
+/* autotune finds, for one threaded method and one class of images, the
+ * number of threads, chunk size and tile aspect (see
+ * filter_pool_set_tile_aspect) that filter fastest, from short timed
+ * trials on the image itself. The winners are kept in a profile file, one
+ * line per method and class, where later runs look them up with
+ * find_tuned instead of running trials again.
+ * A class is the filter dimension, the pixel format and normalization, and
+ * the width and height rounded down to a power of two.
+ */
+
+/* The profile is the file this environment variable names (no profile if
+ * it is empty), otherwise PROFILE_NAME in the home directory. A profile
+ * made on a cpu with another instruction set, core count or cache sizes
+ * is ignored, and replaced by the next autotune. Runs that autotune at
+ * once take turns updating it, through an flock on the same path with
+ * .lock appended.
+ */
+#define PROFILE_ENV "FILTER_PROFILE"
+#define PROFILE_NAME ".filter_profile"
+#define PROFILE_VERSION 1
+
+typedef struct tuned_settings_t
+{
+    int32_t num_threads;
+    int32_t work_chunk;  // 0 for the methods without chunks
+    int32_t tile_aspect;
+    double time;         // ns of the fastest trial
+} tuned_settings;
+
+/* Searches the settings of method for filtering source (its 8-bit pixels
+ * if it has them) into target with f, on at most max_threads threads, and
+ * keeps the winner in the profile. Overwrites target. Takes a few dozen
+ * runs of the method.
+ */
+tuned_settings autotune(const filter *f, const pgm_image *source,
+        pgm_image *target, parallel_method method,
+        normalization_mode normalization, int32_t max_threads);
+
+/* Looks up the settings autotune kept for method on the class of a
+ * width x height image filtered with f. Returns 0 if there are some.
+ */
+int32_t find_tuned(const filter *f, int32_t width, int32_t height,
+        int32_t u8, parallel_method method, normalization_mode normalization,
+        tuned_settings *settings);
+#endif
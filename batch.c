@@ -0,0 +1,394 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "batch.h"
+#include "pgm.h"
+#include "pool.h"
+#include <dirent.h>
+#include <glob.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* The paths of a batch */
+typedef struct batch_list_t
+{
+    char **paths;
+    int32_t count;
+    int32_t capacity;
+} batch_list;
+
+/* Pixel buffers kept by a thread from one image to the next, only ever
+ * grown.
+ */
+typedef struct batch_buffers_t
+{
+    uint8_t *source;
+    uint8_t *target;
+    size_t capacity;
+} batch_buffers;
+
+/* Everything the threads of a batch share */
+typedef struct batch_t
+{
+    const filter *f;
+    const char *target_dir;
+    batch_list *list;
+    int32_t use_pool; // whether large images are left for the whole pool
+    char *deferred;   // per image: left for the whole pool
+    _Alignas(64) atomic_int next_image;
+    _Alignas(64) atomic_int failures;
+} batch;
+
+typedef struct batch_work_t
+{
+    batch *b;
+    batch_buffers buffers;
+} batch_work;
+
+static int32_t add_path(batch_list *list, const char *path)
+{
+    if (list->count == list->capacity)
+    {
+        int32_t capacity = list->capacity ? 2 * list->capacity : 64;
+        char **paths = (char **) realloc(list->paths,
+                capacity * sizeof(char *));
+        if (paths == NULL)
+        {
+            return 0;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strdup(path);
+    return list->paths[list->count++] != NULL;
+}
+
+static void free_list(batch_list *list)
+{
+    for (int32_t i = 0; i < list->count; i++)
+    {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* The file name a path is saved under in the target directory */
+static const char *output_name(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    return name != NULL ? name + 1 : path;
+}
+
+static int compare_output_names(const void *a, const void *b)
+{
+    return strcmp(output_name(*(char * const *) a),
+            output_name(*(char * const *) b));
+}
+
+/* Checks that no two paths of list share a file name, since they would be
+ * saved to the same target file (possibly by two threads at once). Returns
+ * 0 and reports the first clash if they do.
+ */
+static int32_t check_output_names(const batch_list *list)
+{
+    char **names = (char **) malloc((list->count > 0 ? list->count : 1)
+            * sizeof(char *));
+    if (names == NULL)
+    {
+        return 0;
+    }
+    memcpy(names, list->paths, list->count * sizeof(char *));
+    qsort(names, list->count, sizeof(char *), compare_output_names);
+    int32_t ok = 1;
+    for (int32_t i = 1; ok && i < list->count; i++)
+    {
+        if (compare_output_names(&names[i - 1], &names[i]) == 0)
+        {
+            printf("error: %s and %s would both be saved as %s\n",
+                    names[i - 1], names[i], output_name(names[i]));
+            ok = 0;
+        }
+    }
+    free(names);
+    return ok;
+}
+
+static int32_t list_directory(const char *dir, batch_list *list)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        return 0;
+    }
+    struct dirent *entry;
+    char path[4096];
+    int32_t ok = 1;
+    while (ok && (entry = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            ok = add_path(list, path);
+        }
+    }
+    closedir(d);
+    qsort(list->paths, list->count, sizeof(char *), compare_paths);
+    return ok;
+}
+
+static int32_t list_glob(const char *pattern, batch_list *list)
+{
+    glob_t g;
+    int err = glob(pattern, 0, NULL, &g);
+    if (err == GLOB_NOMATCH)
+    {
+        return 1;
+    }
+    int32_t ok = err == 0;
+    for (size_t i = 0; ok && i < g.gl_pathc; i++)
+    {
+        ok = add_path(list, g.gl_pathv[i]);
+    }
+    globfree(&g);
+    return ok;
+}
+
+static int32_t list_manifest(const char *manifest, batch_list *list)
+{
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int32_t ok = 1;
+    while (ok && (len = getline(&line, &size, file)) != -1)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        {
+            line[--len] = '\0';
+        }
+        if (len > 0 && line[0] != '#')
+        {
+            ok = add_path(list, line);
+        }
+    }
+    free(line);
+    fclose(file);
+    return ok;
+}
+
+/* Lists the images of source, see run_batch */
+static int32_t list_images(const char *source, batch_list *list)
+{
+    struct stat st;
+    int32_t ok;
+    if (stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        ok = list_directory(source, list);
+    }
+    else if (strpbrk(source, "*?[") != NULL)
+    {
+        ok = list_glob(source, list);
+    }
+    else
+    {
+        ok = list_manifest(source, list);
+    }
+    return ok && check_output_names(list);
+}
+
+/* Makes buffers hold at least size pixels */
+static int32_t reserve_buffers(batch_buffers *buffers, size_t size)
+{
+    if (size <= buffers->capacity)
+    {
+        return 1;
+    }
+    free(buffers->source);
+    free(buffers->target);
+    buffers->source = (uint8_t *) malloc(size > 0 ? size : 1);
+    buffers->target = (uint8_t *) malloc(size > 0 ? size : 1);
+    buffers->capacity = buffers->source && buffers->target ? size : 0;
+    return buffers->capacity == size;
+}
+
+/* Filters image i of the batch into its target file using buffers. On the
+ * pool (pool != NULL), the image is filtered by all its workers; otherwise
+ * by the calling thread, which leaves large images for the pool when
+ * b->use_pool is set. Returns 0 on failure.
+ */
+static int32_t filter_image(batch *b, int32_t i, batch_buffers *buffers,
+        filter_pool *pool, parallel_method method, int32_t work_chunk)
+{
+    const char *path = b->list->paths[i];
+    pgm_image image;
+    pgm_file file;
+    init_pgm_image(&image);
+    int err = open_pgm_rows(path, &image, &file);
+    if (err != NO_ERR)
+    {
+        printf("error loading %s (%d)\n", path, err);
+        return 0;
+    }
+
+    size_t size = (size_t) image.width * image.height;
+    if (pool == NULL && b->use_pool && size >= BATCH_LARGE_IMAGE)
+    {
+        b->deferred[i] = 1;
+        close_pgm_rows(&file);
+        return 1;
+    }
+    if (!reserve_buffers(buffers, size))
+    {
+        close_pgm_rows(&file);
+        printf("error loading %s (%d)\n", path, ERR_MALLOC);
+        return 0;
+    }
+    err = read_pgm_rows(&file, 0, image.height, buffers->source);
+    close_pgm_rows(&file);
+    if (err != NO_ERR)
+    {
+        printf("error loading %s (%d)\n", path, err);
+        return 0;
+    }
+
+    if (pool != NULL)
+    {
+        apply_filter2d_pool_u8(pool, b->f, buffers->source, buffers->target,
+                image.width, image.height, method, work_chunk);
+    }
+    else
+    {
+        apply_filter2d_u8(b->f, buffers->source, buffers->target,
+                image.width, image.height);
+    }
+
+    char target_path[4096];
+    snprintf(target_path, sizeof(target_path), "%s/%s", b->target_dir,
+            output_name(path));
+    image.pixels = buffers->target;
+    err = save_pgm8_to_file(target_path, &image);
+    if (err != NO_ERR)
+    {
+        printf("error saving %s (%d)\n", target_path, err);
+        return 0;
+    }
+    return 1;
+}
+
+/* Image-level parallelism: each worker filters whole images, taking the
+ * next one from a shared counter.
+ */
+static void *batch_worker(void *param)
+{
+    batch_work *w = (batch_work *) param;
+    batch *b = w->b;
+    int32_t i;
+    while ((i = atomic_fetch_add_explicit(&b->next_image, 1,
+                    memory_order_relaxed)) < b->list->count)
+    {
+        if (!filter_image(b, i, &w->buffers, NULL, 0, 0))
+        {
+            atomic_fetch_add(&b->failures, 1);
+        }
+    }
+    return NULL;
+}
+
+int32_t run_batch(const filter *f, const char *source, const char *target_dir,
+        int32_t num_threads, parallel_method method, int32_t work_chunk,
+        int32_t *images)
+{
+    batch_list list = {NULL, 0, 0};
+    *images = 0;
+    if (!list_images(source, &list))
+    {
+        free_list(&list);
+        return -1;
+    }
+    *images = list.count;
+
+    batch b;
+    b.f = f;
+    b.target_dir = target_dir;
+    b.list = &list;
+    b.use_pool = num_threads > 1;
+    b.deferred = (char *) calloc(list.count > 0 ? list.count : 1, 1);
+    filter_pool *pool = create_filter_pool(num_threads);
+    if (pool == NULL || b.deferred == NULL)
+    {
+        if (pool != NULL) destroy_filter_pool(pool);
+        free(b.deferred);
+        free_list(&list);
+        return -1;
+    }
+    atomic_init(&b.next_image, 0);
+    atomic_init(&b.failures, 0);
+
+    // small images first, one per worker
+    batch_work work[num_threads];
+    void *params[num_threads];
+    for (int32_t i = 0; i < num_threads; i++)
+    {
+        work[i].b = &b;
+        work[i].buffers = (batch_buffers) {NULL, NULL, 0};
+        params[i] = &work[i];
+    }
+    filter_pool_run(pool, batch_worker, params);
+
+    // then the large ones, each on the whole pool, reusing the largest
+    // buffers the workers grew
+    int32_t largest = 0;
+    for (int32_t i = 1; i < num_threads; i++)
+    {
+        if (work[i].buffers.capacity > work[largest].buffers.capacity)
+        {
+            largest = i;
+        }
+    }
+    for (int32_t i = 0; i < list.count; i++)
+    {
+        if (b.deferred[i] && !filter_image(&b, i, &work[largest].buffers,
+                    pool, method, work_chunk))
+        {
+            atomic_fetch_add(&b.failures, 1);
+        }
+    }
+
+    destroy_filter_pool(pool);
+    for (int32_t i = 0; i < num_threads; i++)
+    {
+        free(work[i].buffers.source);
+        free(work[i].buffers.target);
+    }
+    free_list(&list);
+    free(b.deferred);
+    return atomic_load(&b.failures);
+}
@@ -0,0 +1,46 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __BATCH__H
+#define __BATCH__H
+
+#include "filters.h"
+#include <stdint.h>
+
+/**************BATCH MODE*****************/
+/* Images with at least this many pixels are filtered one at a time on all
+ * the threads; smaller ones are spread over the threads, one image per
+ * thread, since splitting them costs more than it saves.
+ */
+#define BATCH_LARGE_IMAGE (512 * 512)
+
+/* Filters every image of source into target_dir, under the same file name,
+ * keeping a single pool of num_threads workers and reusing the pixel
+ * buffers of each thread across images. source is either a directory (its
+ * files are taken in name order), a glob pattern, or a manifest file
+ * listing one path per line (empty lines and lines starting with # are
+ * skipped). Since every image keeps its file name, two sources with the
+ * same file name (from different directories of a glob or a manifest, or
+ * the same path listed twice) are rejected as a listing error rather than
+ * saved over each other.
+ * Large images are filtered with method and work_chunk, like
+ * apply_filter2d_pool_u8.
+ * Returns the number of images that could not be filtered, or -1 if
+ * source could not be listed. images is set to the number of images
+ * found.
+ */
+int32_t run_batch(const filter *f, const char *source, const char *target_dir,
+        int32_t num_threads, parallel_method method, int32_t work_chunk,
+        int32_t *images);
+#endif
@@ -0,0 +1,408 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+/* Sweeps filters x methods x threads x chunk sizes x image shapes in one
+ * process, instead of one main.out per sample: every image is loaded once,
+ * the pools are created once per thread count and kept warm, and each
+ * configuration gets warm-up runs before the timed ones. Writes one CSV
+ * line per configuration (see plotter.read_bench) with the median and p99
+ * time, the throughput in MPix/s, and 95% confidence intervals of the
+ * median.
+ *
+ * The shapes are the pgmWidthSize<width>.txt images of the Makefile, each
+ * width x (TOTAL_SIZE / width); an image whose file is missing is made up
+ * with random pixels instead. Methods are numbered as for main.out.
+ *
+ * With -N, the read bandwidth between every pair of NUMA nodes (a thread
+ * on one node reading memory on the other) is written to a second CSV
+ * first, to compare the sweep against.
+ *
+ * usage: ./bench.out [-f filters] [-m methods] [-n threads] [-c chunks]
+ *                    [-w widths] [-W warmups] [-R repetitions]
+ *                    [-r normalization] [-A affinity] [-P placement]
+ *                    [-o output.csv] [-N nodes.csv]
+ * where the lists are comma separated, and -r, -A and -P are as for
+ * main.out.
+ */
+
+#include "pgm.h"
+#include "filters.h"
+#include "affinity.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TOTAL_SIZE 1048576
+#define MAX_LIST 32
+
+#define SEQUENTIAL_METHOD 1
+#define NUM_METHODS 6
+
+/* The parallel_method of methods 2 to 6 */
+static const parallel_method parallel_methods[NUM_METHODS + 1] = {
+    0, 0, SHARDED_ROWS, SHARDED_COLUMNS_COLUMN_MAJOR,
+    SHARDED_COLUMNS_ROW_MAJOR, WORK_QUEUE, WORK_STEALING
+};
+
+/* Only these methods take a chunk size */
+#define TAKES_CHUNK(method) ((method) >= 5)
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (double) t.tv_nsec / 1000000000;
+}
+
+/* Parses a comma separated list of positive numbers into values. Returns
+ * how many there are, 0 if the list is invalid.
+ */
+static int32_t parse_list(const char *list, int32_t *values)
+{
+    int32_t count = 0;
+    while (count < MAX_LIST)
+    {
+        char *end;
+        long value = strtol(list, &end, 10);
+        if (end == list || value <= 0)
+        {
+            return 0;
+        }
+        values[count++] = value;
+        if (*end == '\0')
+        {
+            return count;
+        }
+        if (*end != ',')
+        {
+            return 0;
+        }
+        list = end + 1;
+    }
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* The sample of rank (1-based) rank in sorted samples, clamped */
+static double ranked(const double *sorted, int32_t count, int32_t rank)
+{
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+/* One configuration of the sweep */
+typedef struct config_t
+{
+    int32_t filter;
+    int32_t method;
+    int32_t threads;
+    int32_t chunk;
+} config;
+
+/* Runs c on source once */
+static void run_config(const config *c, filter_pool *pool,
+        const pgm_image *source, pgm_image *target,
+        normalization_mode normalization)
+{
+    const filter *f = builtin_filters[c->filter - 1];
+    if (c->method == SEQUENTIAL_METHOD)
+    {
+        apply_filter2d_mode(f, source->matrix, target->matrix,
+                source->width, source->height, normalization);
+        return;
+    }
+    apply_filter2d_pool(pool, f, source->matrix, target->matrix,
+            source->width, source->height, parallel_methods[c->method],
+            c->chunk, normalization);
+}
+
+/* Times c on source and writes its line */
+static void bench_config(FILE *out, const config *c, filter_pool *pool,
+        const pgm_image *source, pgm_image *target,
+        normalization_mode normalization, int32_t warmups,
+        int32_t repetitions)
+{
+    for (int32_t i = 0; i < warmups; i++)
+    {
+        run_config(c, pool, source, target, normalization);
+    }
+    double samples[repetitions];
+    for (int32_t i = 0; i < repetitions; i++)
+    {
+        double start = now();
+        run_config(c, pool, source, target, normalization);
+        samples[i] = now() - start;
+    }
+    qsort(samples, repetitions, sizeof(double), compare_doubles);
+
+    // the median, and the ranks around it that hold the true median with
+    // 95% confidence (normal approximation of the binomial distribution)
+    double median = repetitions % 2 ? samples[repetitions / 2]
+        : (samples[repetitions / 2 - 1] + samples[repetitions / 2]) / 2;
+    double spread = 1.96 * sqrt(repetitions) / 2;
+    double low = ranked(samples, repetitions,
+            (int32_t) floor(repetitions / 2.0 - spread));
+    double high = ranked(samples, repetitions,
+            (int32_t) ceil(1 + repetitions / 2.0 + spread));
+    double p99 = ranked(samples, repetitions,
+            (int32_t) ceil(0.99 * repetitions));
+    double mpix = (double) source->width * source->height / 1e6;
+
+    fprintf(out, "%d,%d,%d,%d,%d,%d,%d,%.6f,%.6f,%.6f,%.6f,%.2f,%.2f,%.2f\n",
+            c->filter, c->method, c->threads, c->chunk, source->width,
+            source->height, repetitions, median * 1e3, p99 * 1e3, low * 1e3,
+            high * 1e3, mpix / median, mpix / high, mpix / low);
+    fflush(out);
+}
+
+/* Loads pgmWidthSize<width>.txt, or makes up an image of its shape */
+static void load_shape(int32_t width, pgm_image *image)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "pgmWidthSize%d.txt", width);
+    init_pgm_image(image);
+    if (load_pgm_from_file(name, image) == NO_ERR)
+    {
+        return;
+    }
+    if (create_random_pgm_image(image, width, TOTAL_SIZE / width) != NO_ERR)
+    {
+        printf("error allocating %dx%d image\n", width, TOTAL_SIZE / width);
+        exit(1);
+    }
+}
+
+/* Lays source and target out for the workers of pool, see place_buffer */
+static void place_shape(filter_pool *pool, pgm_image *source,
+        pgm_image *target, placement how)
+{
+    size_t row_size = source->width * sizeof(int32_t);
+    int32_t *placed_source = (int32_t *) place_buffer(pool, source->matrix,
+            row_size, source->height, how);
+    int32_t *placed_target = (int32_t *) place_buffer(pool, NULL, row_size,
+            target->height, how);
+    if (placed_source == NULL || placed_target == NULL)
+    {
+        printf("error placing the images\n");
+        exit(1);
+    }
+    free(source->matrix);
+    free(target->matrix);
+    source->matrix = placed_source;
+    target->matrix = placed_target;
+}
+
+/* Writes the read bandwidth from every node to every node */
+static void bench_nodes(FILE *out)
+{
+    int32_t nodes = num_nodes();
+    fprintf(out, "cpu_node,memory_node,gb_s\n");
+    for (int32_t c = 0; c < nodes; c++)
+    {
+        for (int32_t m = 0; m < nodes; m++)
+        {
+            // nodes without memory or without cpus we may use are skipped
+            double bandwidth = node_bandwidth(c, m);
+            if (bandwidth >= 0)
+            {
+                fprintf(out, "%d,%d,%.2f\n", c, m, bandwidth);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int32_t filters[MAX_LIST] = {1, 2, 3, 4};
+    int32_t num_filters = 4;
+    int32_t methods[MAX_LIST] = {1, 2, 3, 4, 5, 6};
+    int32_t num_methods = 6;
+    int32_t threads[MAX_LIST] = {1, 2, 4, 8};
+    int32_t num_threads = 4;
+    int32_t chunks[MAX_LIST] = {1, 2, 4, 8, 16, 32};
+    int32_t num_chunks = 6;
+    int32_t widths[MAX_LIST] = {1, 8, 16, 64, 512, 1024, 4096, 32768};
+    int32_t num_widths = 8;
+    int32_t warmups = 2;
+    int32_t repetitions = 10;
+    normalization_mode normalization = NORMALIZE_IN_PLACE;
+    affinity pinning = {AFFINITY_NONE, 0, {0}};
+    int32_t place = 0;
+    placement how = PLACE_FIRST_TOUCH;
+    FILE *out = stdout;
+    FILE *nodes_out = NULL;
+
+    int32_t option;
+    int valid = 1;
+    while ((option = getopt(argc, argv, "f:m:n:c:w:W:R:r:A:P:o:N:")) != -1)
+    {
+        switch (option)
+        {
+            case 'f':
+                num_filters = parse_list(optarg, filters);
+                break;
+            case 'm':
+                num_methods = parse_list(optarg, methods);
+                break;
+            case 'n':
+                num_threads = parse_list(optarg, threads);
+                break;
+            case 'c':
+                num_chunks = parse_list(optarg, chunks);
+                break;
+            case 'w':
+                num_widths = parse_list(optarg, widths);
+                break;
+            case 'W':
+                warmups = atoi(optarg);
+                break;
+            case 'R':
+                repetitions = atoi(optarg);
+                break;
+            case 'r':
+                normalization = atoi(optarg) ? NORMALIZE_RECOMPUTE
+                                             : NORMALIZE_IN_PLACE;
+                break;
+            case 'A':
+                valid = valid && parse_affinity(optarg, &pinning) == 0;
+                break;
+            case 'P':
+                place = 1;
+                if (strcmp(optarg, "bind") == 0 && can_bind())
+                {
+                    how = PLACE_BIND;
+                }
+                else
+                {
+                    valid = valid && strcmp(optarg, "touch") == 0;
+                }
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                valid = out != NULL;
+                break;
+            case 'N':
+                nodes_out = fopen(optarg, "w");
+                valid = nodes_out != NULL;
+                break;
+            default:
+                valid = 0;
+        }
+    }
+    for (int32_t i = 0; i < num_filters; i++)
+    {
+        valid = valid && filters[i] <= NUM_FILTERS;
+    }
+    for (int32_t i = 0; i < num_methods; i++)
+    {
+        valid = valid && methods[i] <= NUM_METHODS;
+    }
+    for (int32_t i = 0; i < num_widths; i++)
+    {
+        valid = valid && TOTAL_SIZE % widths[i] == 0;
+    }
+    if (!valid || num_filters == 0 || num_methods == 0 || num_threads == 0
+            || num_chunks == 0 || num_widths == 0 || warmups < 0
+            || repetitions <= 0 || (place && pinning.policy == AFFINITY_NONE))
+    {
+        printf("usage: %s [-f filters] [-m methods] [-n threads] "
+                "[-c chunks] [-w widths] [-W warmups] [-R repetitions] "
+                "[-r normalization] [-A affinity] [-P placement] "
+                "[-o output.csv] [-N nodes.csv]\n", argv[0]);
+        return 1;
+    }
+
+    // one warm pool per thread count, for the whole sweep
+    filter_pool *pools[MAX_LIST];
+    for (int32_t t = 0; t < num_threads; t++)
+    {
+        pools[t] = create_filter_pool(threads[t]);
+        if (pools[t] == NULL || pin_filter_pool(pools[t], &pinning) != 0)
+        {
+            printf("error creating %d threads\n", threads[t]);
+            return 1;
+        }
+    }
+
+    if (nodes_out != NULL)
+    {
+        bench_nodes(nodes_out);
+        fclose(nodes_out);
+    }
+
+    fprintf(out, "filter,method,threads,chunk,width,height,repetitions,"
+            "median_ms,p99_ms,median_low_ms,median_high_ms,"
+            "mpix_s,mpix_s_low,mpix_s_high\n");
+    for (int32_t w = 0; w < num_widths; w++)
+    {
+        pgm_image source, target;
+        load_shape(widths[w], &source);
+        if (copy_pgm_image_size(&source, &target) != NO_ERR)
+        {
+            printf("error allocating the target image\n");
+            return 1;
+        }
+        int32_t placed = -1; // the pool the images are laid out for
+        for (int32_t fi = 0; fi < num_filters; fi++)
+        {
+            for (int32_t m = 0; m < num_methods; m++)
+            {
+                // the sequential method runs once, with no threads
+                int32_t thread_runs = methods[m] == SEQUENTIAL_METHOD
+                    ? 1 : num_threads;
+                int32_t chunk_runs = TAKES_CHUNK(methods[m]) ? num_chunks : 1;
+                for (int32_t t = 0; t < thread_runs; t++)
+                {
+                    if (place && methods[m] != SEQUENTIAL_METHOD
+                            && placed != t)
+                    {
+                        place_shape(pools[t], &source, &target, how);
+                        placed = t;
+                    }
+                    for (int32_t ci = 0; ci < chunk_runs; ci++)
+                    {
+                        config c = {filters[fi], methods[m],
+                            methods[m] == SEQUENTIAL_METHOD ? 1 : threads[t],
+                            TAKES_CHUNK(methods[m]) ? chunks[ci] : 0};
+                        bench_config(out, &c, pools[t], &source, &target,
+                                normalization, warmups, repetitions);
+                    }
+                }
+            }
+        }
+        destroy_pgm_image(&source);
+        destroy_pgm_image(&target);
+    }
+
+    for (int32_t t = 0; t < num_threads; t++)
+    {
+        destroy_filter_pool(pools[t]);
+    }
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
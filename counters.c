@@ -0,0 +1,276 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "counters.h"
+#include "machine.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_EVENT(cache, result) (PERF_COUNT_HW_CACHE_##cache | \
+        PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_##result << 16)
+
+typedef struct counter_event_t
+{
+    const char *name; // as perf stat names it
+    uint32_t type;
+    uint64_t config;
+} counter_event;
+
+static const counter_event events[] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"L1-dcache-loads", PERF_TYPE_HW_CACHE, CACHE_EVENT(L1D, ACCESS)},
+    {"L1-dcache-load-misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(L1D, MISS)},
+    {"LLC-loads", PERF_TYPE_HW_CACHE, CACHE_EVENT(LL, ACCESS)},
+    {"LLC-load-misses", PERF_TYPE_HW_CACHE, CACHE_EVENT(LL, MISS)},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+#define NUM_EVENTS (int32_t) (sizeof(events) / sizeof(events[0]))
+
+static const char *phase_names[NUM_PHASES] = {
+    "convolve", "reduce", "barrier", "normalize"
+};
+
+/* What one phase of one thread added up to */
+typedef struct phase_totals_t
+{
+    double ns;
+    double counts[NUM_EVENTS];
+} phase_totals;
+
+/* The counters of one thread. Only that thread touches it until
+ * write_counters.
+ */
+typedef struct thread_counters_t
+{
+    int32_t worker;
+    int fds[NUM_EVENTS];      // -1 for the events that could not be opened
+    int32_t phase;            // current phase, -1 between filter calls
+    double phase_start;       // ns
+    double last[NUM_EVENTS];  // counts when the current phase started
+    phase_totals totals[NUM_PHASES];
+    struct thread_counters_t *next;
+} thread_counters;
+
+int32_t counters_on = 0;
+
+// every thread's counters, under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_counters *threads = NULL;
+static int32_t num_threads = 0;
+static uint64_t generation = 0;
+
+// the calling thread's counters, if they belong to the current session
+static __thread thread_counters *own = NULL;
+static __thread uint64_t own_generation = 0;
+
+/* Counts the calling thread only, in user space, from now on. Software
+ * events are counted by the kernel itself, so they keep it.
+ */
+static int open_event(const counter_event *event)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.exclude_kernel = event->type != PERF_TYPE_SOFTWARE;
+    attr.exclude_hv = 1;
+    // the cpu counts fewer events at once than we ask for: scale them
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Current counts of the calling thread, scaled for multiplexing */
+static void read_events(const thread_counters *tc, double *counts)
+{
+    for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+        uint64_t values[3]; // value, time enabled, time running
+        counts[e] = 0;
+        if (tc->fds[e] < 0 ||
+                read(tc->fds[e], values, sizeof(values)) != sizeof(values)) {
+            continue;
+        }
+        counts[e] = values[2] == 0 ? 0
+            : (double) values[0] * values[1] / values[2];
+    }
+}
+
+/* Adds what happened since the current phase started to its totals */
+static void close_phase(thread_counters *tc, const double *counts,
+        double now)
+{
+    if (tc->phase < 0) return;
+    phase_totals *totals = &tc->totals[tc->phase];
+    totals->ns += now - tc->phase_start;
+    for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+        totals->counts[e] += counts[e] - tc->last[e];
+    }
+}
+
+void start_counters(void)
+{
+    pthread_mutex_lock(&lock);
+    generation ++;
+    counters_on = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+void begin_counted_work(int32_t worker)
+{
+    if (own == NULL || own_generation != generation) {
+        thread_counters *tc = (thread_counters *) calloc(1, sizeof(*tc));
+        if (tc == NULL) return;
+        tc->worker = worker;
+        tc->phase = -1;
+        for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+            tc->fds[e] = open_event(&events[e]);
+        }
+        pthread_mutex_lock(&lock);
+        tc->next = threads;
+        threads = tc;
+        num_threads ++;
+        pthread_mutex_unlock(&lock);
+        own = tc;
+        own_generation = generation;
+    }
+    read_events(own, own->last);
+    own->phase = PHASE_CONVOLVE;
+    own->phase_start = now_ns();
+}
+
+void mark_counted_phase(counter_phase phase)
+{
+    if (own == NULL || own_generation != generation || own->phase < 0) {
+        return;
+    }
+    double counts[NUM_EVENTS];
+    read_events(own, counts);
+    double now = now_ns();
+    close_phase(own, counts, now);
+    own->phase = phase;
+    own->phase_start = now;
+    memcpy(own->last, counts, sizeof(counts));
+}
+
+void end_counted_work(void)
+{
+    if (own == NULL || own_generation != generation || own->phase < 0) {
+        return;
+    }
+    double counts[NUM_EVENTS];
+    read_events(own, counts);
+    close_phase(own, counts, now_ns());
+    own->phase = -1;
+}
+
+static void write_csv(FILE *file, thread_counters **order)
+{
+    fprintf(file, "thread,worker,phase,ns");
+    for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+        fprintf(file, ",%s", events[e].name);
+    }
+    fprintf(file, "\n");
+    for (int32_t t = 0; t < num_threads; t ++) {
+        for (int32_t p = 0; p < NUM_PHASES; p ++) {
+            const phase_totals *totals = &order[t]->totals[p];
+            fprintf(file, "%d,%d,%s,%.0f", t, order[t]->worker,
+                    phase_names[p], totals->ns);
+            for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+                // an empty field for the events that are missing
+                if (order[t]->fds[e] < 0) fprintf(file, ",");
+                else fprintf(file, ",%.0f", totals->counts[e]);
+            }
+            fprintf(file, "\n");
+        }
+    }
+}
+
+static void write_json(FILE *file, thread_counters **order)
+{
+    fprintf(file, "{\"events\": [");
+    for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+        fprintf(file, "%s\"%s\"", e > 0 ? ", " : "", events[e].name);
+    }
+    fprintf(file, "],\n \"threads\": [");
+    for (int32_t t = 0; t < num_threads; t ++) {
+        fprintf(file, "%s\n  {\"thread\": %d, \"worker\": %d, \"phases\": {",
+                t > 0 ? "," : "", t, order[t]->worker);
+        for (int32_t p = 0; p < NUM_PHASES; p ++) {
+            const phase_totals *totals = &order[t]->totals[p];
+            fprintf(file, "%s\n    \"%s\": {\"ns\": %.0f", p > 0 ? "," : "",
+                    phase_names[p], totals->ns);
+            for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+                // null for the events that are missing
+                if (order[t]->fds[e] < 0) {
+                    fprintf(file, ", \"%s\": null", events[e].name);
+                } else {
+                    fprintf(file, ", \"%s\": %.0f", events[e].name,
+                            totals->counts[e]);
+                }
+            }
+            fprintf(file, "}");
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n ]}\n");
+}
+
+int32_t write_counters(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    counters_on = 0;
+
+    // threads in the order they started counting
+    thread_counters **order = (thread_counters **) malloc(
+            (num_threads > 0 ? num_threads : 1) * sizeof(*order));
+    int32_t t = num_threads;
+    for (thread_counters *tc = threads; tc != NULL && order != NULL;
+            tc = tc->next) {
+        order[-- t] = tc;
+    }
+
+    FILE *file = order != NULL ? fopen(path, "w") : NULL;
+    if (file != NULL) {
+        size_t length = strlen(path);
+        if (length >= 4 && strcmp(path + length - 4, ".csv") == 0) {
+            write_csv(file, order);
+        } else {
+            write_json(file, order);
+        }
+    }
+    int32_t err = file == NULL || fclose(file) != 0 ? -1 : 0;
+
+    while (threads != NULL) {
+        thread_counters *tc = threads;
+        threads = tc->next;
+        for (int32_t e = 0; e < NUM_EVENTS; e ++) {
+            if (tc->fds[e] >= 0) close(tc->fds[e]);
+        }
+        free(tc);
+    }
+    num_threads = 0;
+    generation ++;
+    free(order);
+    pthread_mutex_unlock(&lock);
+    return err;
+}
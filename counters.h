@@ -0,0 +1,77 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __COUNTERS__H
+#define __COUNTERS__H
+
+#include <stdint.h>
+
+/**************HARDWARE COUNTERS*****************/
+/* Between start_counters and write_counters, every thread that filters
+ * opens its own counters through perf_event_open (the events
+ * perfs_student.py asks perf for, in user space, plus a few software ones)
+ * and keeps them for its lifetime. The filters mark the phases of each
+ * thread, and the counts and wall time of each phase are added up per
+ * thread, so only the filtering itself is measured: not loading or saving
+ * the images, nor creating the threads.
+ * Events the kernel or the cpu does not offer (e.g. hardware events in a
+ * virtual machine) are reported as missing.
+ * When counting is off, marking a phase costs a single test.
+ */
+
+typedef enum
+{
+    PHASE_CONVOLVE,  // the filter phase, or the scan for min and max
+    PHASE_REDUCE,    // publishing and folding the per-thread min and max
+    PHASE_BARRIER,   // waiting for the other threads
+    PHASE_NORMALIZE, // the second phase
+    NUM_PHASES
+} counter_phase;
+
+/* Whether counting is on, for the inline functions below */
+extern int32_t counters_on;
+
+/* Turns counting on. */
+void start_counters(void);
+
+/* Writes what was counted to path, as CSV if its name ends in .csv, as
+ * JSON otherwise, then turns counting off. Returns 0 on success.
+ */
+int32_t write_counters(const char *path);
+
+/* Used through the inline functions below */
+void begin_counted_work(int32_t worker);
+void mark_counted_phase(counter_phase phase);
+void end_counted_work(void);
+
+/* Called by a thread when it starts filtering, with its worker number
+ * (0 when it works alone): starts its PHASE_CONVOLVE.
+ */
+static inline void counters_begin(int32_t worker)
+{
+    if (counters_on) begin_counted_work(worker);
+}
+
+/* Ends the calling thread's current phase and starts the given one */
+static inline void counters_phase(counter_phase phase)
+{
+    if (counters_on) mark_counted_phase(phase);
+}
+
+/* Ends the calling thread's current phase when it is done filtering */
+static inline void counters_end(void)
+{
+    if (counters_on) end_counted_work();
+}
+#endif
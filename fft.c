@@ -0,0 +1,438 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "fft.h"
+#include "kernels.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Cost model of fft_preferred, in nanoseconds, per instruction set
+ * (calibrated with fft_bench on a Xeon): one multiply-add of a row kernel
+ * for one pixel, the same on the clipped borders, one radix-2 stage over
+ * one element of a block, and the fixed cost of a block.
+ */
+static const double tap_cost[ISA_AVX2 + 1] = {1.0, 0.43, 0.2};
+#define BORDER_TAP_COST 2.5
+static const double stage_cost[ISA_AVX2 + 1] = {1.75, 1.75, 1.1};
+#define BLOCK_COST 600.0
+
+/* The FFT result is exact when its rounding error stays below this */
+#define FFT_MAX_ERROR 0.25
+
+static fft_use current_use = FFT_AUTO;
+
+__attribute__((constructor))
+static void read_fft_use(void)
+{
+    const char *forced = getenv("FILTER_FFT");
+    if (forced == NULL) return;
+    if (strcmp(forced, "never") == 0) current_use = FFT_NEVER;
+    else if (strcmp(forced, "always") == 0) current_use = FFT_ALWAYS;
+    else if (strcmp(forced, "auto") == 0) current_use = FFT_AUTO;
+}
+
+void set_fft_use(fft_use use)
+{
+    current_use = use;
+}
+
+/**************BLOCK TRANSFORMS*****************/
+/* Everything needed to transform n x n blocks. The blocks are kept as
+ * separate real and imaginary planes, so that the butterflies, which
+ * combine two whole rows of a block with one twiddle factor, run on
+ * contiguous doubles.
+ */
+typedef struct fft_setup_t
+{
+    int32_t n;
+    double *cos_table; // cos and sin of 2 pi k / n, k < n / 2
+    double *sin_table;
+    int32_t *reverse;  // bit reversal of the row numbers
+    // conjugated spectrum of the filter divided by n * n, transposed
+    double *kernel_re;
+    double *kernel_im;
+    // the block being transformed
+    double *re;
+    double *im;
+} fft_setup;
+
+typedef double fft_vec __attribute__((vector_size(32), aligned(32)));
+
+/* One stage of butterflies between rows a and b of a block, with the
+ * twiddle factor w: a, b = a + w b, a - w b. n is a multiple of 4.
+ */
+#define DEFINE_BUTTERFLIES(suffix, target) \
+    target \
+    static void butterflies_##suffix(double *restrict ar, \
+            double *restrict ai, double *restrict br, double *restrict bi, \
+            double wr, double wi, int32_t n) \
+    { \
+        for (int32_t c = 0; c < n; c += 4) { \
+            fft_vec xr = *(fft_vec *) (ar + c); \
+            fft_vec xi = *(fft_vec *) (ai + c); \
+            fft_vec yr = *(fft_vec *) (br + c); \
+            fft_vec yi = *(fft_vec *) (bi + c); \
+            fft_vec tr = wr * yr - wi * yi; \
+            fft_vec ti = wr * yi + wi * yr; \
+            *(fft_vec *) (ar + c) = xr + tr; \
+            *(fft_vec *) (ai + c) = xi + ti; \
+            *(fft_vec *) (br + c) = xr - tr; \
+            *(fft_vec *) (bi + c) = xi - ti; \
+        } \
+    }
+
+typedef void (*butterfly_fn)(double *restrict ar, double *restrict ai,
+        double *restrict br, double *restrict bi, double wr, double wi,
+        int32_t n);
+
+DEFINE_BUTTERFLIES(default, )
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_BUTTERFLIES(avx2, __attribute__((target("avx2"))))
+#else
+#define butterflies_avx2 butterflies_default
+#endif
+
+/* Transforms every column of the n x n block (re, im), in place: the
+ * decimation in time radix-2 FFT, with whole rows as elements. Inverse
+ * transforms are not scaled.
+ */
+static void transform_columns(const fft_setup *s, double *re, double *im,
+        int inverse)
+{
+    int32_t n = s->n;
+    butterfly_fn butterflies = detected_isa() == ISA_AVX2 ?
+        butterflies_avx2 : butterflies_default;
+
+    for (int32_t i = 0; i < n; i ++) {
+        int32_t j = s->reverse[i];
+        if (j <= i) continue;
+        for (int32_t c = 0; c < n; c ++) {
+            double t = re[i * n + c];
+            re[i * n + c] = re[j * n + c];
+            re[j * n + c] = t;
+            t = im[i * n + c];
+            im[i * n + c] = im[j * n + c];
+            im[j * n + c] = t;
+        }
+    }
+
+    double sign = inverse ? 1 : -1;
+    for (int32_t len = 2; len <= n; len *= 2) {
+        int32_t half = len / 2;
+        int32_t step = n / len;
+        for (int32_t start = 0; start < n; start += len) {
+            for (int32_t j = 0; j < half; j ++) {
+                int32_t a = (start + j) * n;
+                int32_t b = (start + j + half) * n;
+                butterflies(re + a, im + a, re + b, im + b,
+                        s->cos_table[j * step], sign * s->sin_table[j * step],
+                        n);
+            }
+        }
+    }
+}
+
+/* Side of the square blocks transpose swaps at once */
+#define TRANSPOSE_BLOCK 16
+
+static void transpose(double *m, int32_t n)
+{
+    for (int32_t i0 = 0; i0 < n; i0 += TRANSPOSE_BLOCK) {
+        for (int32_t j0 = i0; j0 < n; j0 += TRANSPOSE_BLOCK) {
+            for (int32_t i = i0; i < i0 + TRANSPOSE_BLOCK; i ++) {
+                for (int32_t j = (j0 == i0 ? i + 1 : j0);
+                        j < j0 + TRANSPOSE_BLOCK; j ++) {
+                    double t = m[i * n + j];
+                    m[i * n + j] = m[j * n + i];
+                    m[j * n + i] = t;
+                }
+            }
+        }
+    }
+}
+
+/* 2D transform of the block (re, im). The forward transform leaves the
+ * spectrum transposed, and the inverse one expects it transposed, which
+ * saves transposing back and forth: the filter's spectrum is transposed
+ * the same way.
+ */
+static void transform_block(const fft_setup *s, double *re, double *im,
+        int inverse)
+{
+    transform_columns(s, re, im, inverse);
+    transpose(re, s->n);
+    transpose(im, s->n);
+    transform_columns(s, re, im, inverse);
+}
+
+static void destroy_fft_setup(fft_setup *s)
+{
+    free(s->cos_table);
+    free(s->reverse);
+    free(s->kernel_re);
+    free(s->re);
+}
+
+/* Allocates the tables and buffers of n x n blocks and works out the
+ * spectrum of f. Returns 0 on success, -1 if out of memory.
+ */
+static int32_t create_fft_setup(fft_setup *s, const filter *f, int32_t n)
+{
+    size_t plane = (size_t) n * n * sizeof(double);
+    memset(s, 0, sizeof(*s));
+    s->n = n;
+    s->cos_table = (double *) malloc(n * sizeof(double));
+    s->reverse = (int32_t *) malloc(n * sizeof(int32_t));
+    s->kernel_re = (double *) aligned_alloc(64, 2 * plane);
+    s->re = (double *) aligned_alloc(64, 2 * plane);
+    if (s->cos_table == NULL || s->reverse == NULL || s->kernel_re == NULL ||
+            s->re == NULL) {
+        destroy_fft_setup(s);
+        return -1;
+    }
+    s->sin_table = s->cos_table + n / 2;
+    s->kernel_im = s->kernel_re + (size_t) n * n;
+    s->im = s->re + (size_t) n * n;
+
+    for (int32_t k = 0; k < n / 2; k ++) {
+        s->cos_table[k] = cos(2 * M_PI * k / n);
+        s->sin_table[k] = sin(2 * M_PI * k / n);
+    }
+    int32_t bits = __builtin_ctz(n);
+    for (int32_t i = 0; i < n; i ++) {
+        int32_t r = 0;
+        for (int32_t b = 0; b < bits; b ++) r |= ((i >> b) & 1) << (bits - 1 - b);
+        s->reverse[i] = r;
+    }
+
+    // filtering is a correlation, which multiplies by the conjugate of the
+    // filter's spectrum; n * n is a power of two, so dividing is exact
+    int32_t dimension = f->dimension;
+    memset(s->kernel_re, 0, 2 * plane);
+    for (int32_t r = 0; r < dimension; r ++) {
+        for (int32_t c = 0; c < dimension; c ++) {
+            s->kernel_re[r * n + c] = f->matrix[r * dimension + c];
+        }
+    }
+    transform_block(s, s->kernel_re, s->kernel_im, 0);
+    double scale = 1.0 / ((double) n * n);
+    for (size_t i = 0; i < (size_t) n * n; i ++) {
+        s->kernel_re[i] *= scale;
+        s->kernel_im[i] *= -scale;
+    }
+    return 0;
+}
+
+/**************FILTERING*****************/
+/* Modeled time of filtering a width x height image with a filter of the
+ * given dimension through n x n blocks.
+ */
+static double block_cost(int32_t dimension, int32_t width, int32_t height,
+        int32_t n)
+{
+    int32_t side = n - dimension + 1;
+    int64_t tiles = (int64_t) ((width + side - 1) / side) *
+        ((height + side - 1) / side);
+    int64_t blocks = (tiles + 1) / 2;
+    // a forward and an inverse transform per block, each along both axes
+    int32_t stages = 4 * __builtin_ctz(n);
+    return blocks * (BLOCK_COST +
+            (double) n * n * stages * stage_cost[detected_isa()]);
+}
+
+/* The cheapest block side for this filter and image, 0 if none fits */
+static int32_t best_block_size(int32_t dimension, int32_t width,
+        int32_t height)
+{
+    int32_t best = 0;
+    double best_cost = 0;
+    for (int32_t n = FFT_MIN_SIZE; n <= FFT_MAX_SIZE; n *= 2) {
+        if (n < dimension + 1) continue;
+        double cost = block_cost(dimension, width, height, n);
+        if (best == 0 || cost < best_cost) {
+            best = n;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+double fft_speedup(const filter *f, int32_t width, int32_t height)
+{
+    int32_t n = best_block_size(f->dimension, width, height);
+    if (n == 0) return 0;
+
+    // the row kernels only run on the interior, the borders are clipped
+    // one pixel at a time
+    int32_t halo = f->dimension - 1;
+    double interior = (double) (width > halo ? width - halo : 0) *
+        (height > halo ? height - halo : 0);
+    double border = (double) width * height - interior;
+    double direct = row_kernel_cost(f) *
+        (interior * tap_cost[detected_isa()] + border * BORDER_TAP_COST);
+    return direct / block_cost(f->dimension, width, height, n);
+}
+
+int32_t fft_preferred(const filter *f, int32_t width, int32_t height)
+{
+    if (current_use == FFT_NEVER) return 0;
+    double speedup = fft_speedup(f, width, height);
+    if (speedup == 0) return 0;
+    return current_use == FFT_ALWAYS || speedup > 1;
+}
+
+/* Reads the n x n block whose top left corner is the source pixel (row,
+ * col) into dst, with zeros outside the image. One of original and
+ * pixels is the source.
+ */
+static void load_block(const int32_t *original, const uint8_t *pixels,
+        int32_t width, int32_t height, int32_t row, int32_t col, int32_t n,
+        double *dst)
+{
+    int32_t first = col < 0 ? -col : 0;
+    int32_t last = col + n > width ? width - col : n;
+    for (int32_t i = 0; i < n; i ++, dst += n) {
+        int32_t r = row + i;
+        if (r < 0 || r >= height || first >= last) {
+            memset(dst, 0, n * sizeof(double));
+            continue;
+        }
+        memset(dst, 0, first * sizeof(double));
+        size_t at = (size_t) r * width + col;
+        if (original != NULL) {
+            for (int32_t c = first; c < last; c ++) dst[c] = original[at + c];
+        } else {
+            for (int32_t c = first; c < last; c ++) dst[c] = pixels[at + c];
+        }
+        memset(dst + last, 0, (n - last) * sizeof(double));
+    }
+}
+
+/* Rounds the side x side output tile at the top left of src to target's
+ * pixel (row, col), clipped to the image.
+ */
+static void store_tile(const double *src, int32_t n, int32_t side,
+        int32_t *target, int32_t width, int32_t height, int32_t row,
+        int32_t col, int32_t *min, int32_t *max)
+{
+    int32_t rows = height - row < side ? height - row : side;
+    int32_t cols = width - col < side ? width - col : side;
+    int32_t lo = *min;
+    int32_t hi = *max;
+    for (int32_t i = 0; i < rows; i ++) {
+        int32_t *out = target + (size_t) (row + i) * width + col;
+        for (int32_t c = 0; c < cols; c ++) {
+            double v = src[i * n + c];
+            int32_t pixel = (int32_t) (v < 0 ? v - 0.5 : v + 0.5);
+            out[c] = pixel;
+            if (pixel < lo) lo = pixel;
+            if (pixel > hi) hi = pixel;
+        }
+    }
+    *min = lo;
+    *max = hi;
+}
+
+/* Shared body of fft_filter and fft_filter_u8, largest the largest
+ * magnitude of a source pixel.
+ */
+static int32_t filter_blocks(const filter *f, const int32_t *original,
+        const uint8_t *pixels, int64_t largest, int32_t *target,
+        int32_t width, int32_t height, int32_t *min, int32_t *max)
+{
+    int32_t dimension = f->dimension;
+    int32_t n = best_block_size(dimension, width, height);
+    if (n == 0) return -1;
+
+    // the results must fit an int32_t like the row kernels' sums, and the
+    // rounding error of the transforms (a few units in the last place per
+    // stage, over the norms of a block pair and of the filter) must not
+    // reach the next integer
+    int64_t taps = 0;
+    for (int32_t i = 0; i < dimension * dimension; i ++) {
+        taps += abs(f->matrix[i]);
+    }
+    if ((double) largest * taps > INT32_MAX) return -1;
+    double block_norm = 1.5 * n * (double) largest;
+    double error = 8.0 * (2 * __builtin_ctz(n) + 1) * DBL_EPSILON *
+        block_norm * taps;
+    if (error > FFT_MAX_ERROR) return -1;
+
+    fft_setup s;
+    if (create_fft_setup(&s, f, n) != 0) return -1;
+
+    int32_t half = dimension / 2;
+    int32_t side = n - dimension + 1;
+    int32_t tiles_per_row = (width + side - 1) / side;
+    int32_t num_tiles = tiles_per_row * ((height + side - 1) / side);
+    size_t elements = (size_t) n * n;
+    for (int32_t t = 0; t < num_tiles; t += 2) {
+        // tile t in the real plane, tile t + 1 in the imaginary one
+        int32_t row0 = t / tiles_per_row * side;
+        int32_t col0 = t % tiles_per_row * side;
+        load_block(original, pixels, width, height, row0 - half, col0 - half,
+                n, s.re);
+        int32_t row1 = 0;
+        int32_t col1 = 0;
+        if (t + 1 < num_tiles) {
+            row1 = (t + 1) / tiles_per_row * side;
+            col1 = (t + 1) % tiles_per_row * side;
+            load_block(original, pixels, width, height, row1 - half,
+                    col1 - half, n, s.im);
+        } else {
+            memset(s.im, 0, elements * sizeof(double));
+        }
+
+        transform_block(&s, s.re, s.im, 0);
+        for (size_t i = 0; i < elements; i += 4) {
+            fft_vec zr = *(fft_vec *) (s.re + i);
+            fft_vec zi = *(fft_vec *) (s.im + i);
+            fft_vec kr = *(fft_vec *) (s.kernel_re + i);
+            fft_vec ki = *(fft_vec *) (s.kernel_im + i);
+            *(fft_vec *) (s.re + i) = zr * kr - zi * ki;
+            *(fft_vec *) (s.im + i) = zr * ki + zi * kr;
+        }
+        transform_block(&s, s.re, s.im, 1);
+
+        store_tile(s.re, n, side, target, width, height, row0, col0, min, max);
+        if (t + 1 < num_tiles) {
+            store_tile(s.im, n, side, target, width, height, row1, col1,
+                    min, max);
+        }
+    }
+    destroy_fft_setup(&s);
+    return 0;
+}
+
+int32_t fft_filter(const filter *f, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height, int32_t *min, int32_t *max)
+{
+    int64_t largest = 0;
+    for (size_t i = 0; i < (size_t) width * height; i ++) {
+        int64_t magnitude = llabs((int64_t) original[i]);
+        if (magnitude > largest) largest = magnitude;
+    }
+    return filter_blocks(f, original, NULL, largest, target, width, height,
+            min, max);
+}
+
+int32_t fft_filter_u8(const filter *f, const uint8_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t *min, int32_t *max)
+{
+    return filter_blocks(f, NULL, original, 255, target, width, height,
+            min, max);
+}
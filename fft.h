@@ -0,0 +1,79 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __FFT__H
+#define __FFT__H
+
+#include "filters.h"
+#include <stdint.h>
+
+/**************FFT CONVOLUTION*****************/
+/* Large filters are applied through the FFT (overlap-save): the image is
+ * cut into square output tiles, each tile is read with its halo into an
+ * n x n block (zero outside the image, which is exactly how apply2d clips
+ * the borders), two blocks are transformed at once as the real and
+ * imaginary parts of one complex block, multiplied by the spectrum of the
+ * filter and transformed back. The result is rounded to integers, and is
+ * the same as the direct form's whenever the rounding error bound of the
+ * FFT stays below half a unit, which is checked before every call.
+ */
+
+/* Smallest and largest side of the FFT blocks. The real and imaginary
+ * planes of the largest block and of the filter's spectrum take 2 MiB,
+ * about what L2 holds.
+ */
+#define FFT_MIN_SIZE 16
+#define FFT_MAX_SIZE 256
+
+/* When apply_filter2d and apply_filter2d_u8 use the FFT */
+typedef enum
+{
+    FFT_AUTO,   // when fft_preferred says it is faster (the default)
+    FFT_NEVER,
+    FFT_ALWAYS  // whenever the filter fits in a block
+} fft_use;
+
+/* Overrides the FILTER_FFT environment variable (auto, never or always),
+ * which sets the starting value.
+ */
+void set_fft_use(fft_use use);
+
+/* Whether the FFT is expected to filter a width x height image with f
+ * faster than the row kernels, from a cost model of both: the multiply-adds
+ * per pixel of the row kernel select_row_kernel picks (and of the clipped
+ * borders), against the butterflies of the cheapest block size for this
+ * filter and image.
+ */
+int32_t fft_preferred(const filter *f, int32_t width, int32_t height);
+
+/* How many times faster than the row kernels the same model expects the
+ * FFT to be, 0 if f does not fit in a block.
+ */
+double fft_speedup(const filter *f, int32_t width, int32_t height);
+
+/* Filters original with f through the FFT, storing the unnormalized values
+ * in target and folding their min and max into min and max, like the row
+ * kernels do. Returns 0 on success, or -1 (target untouched) if f does not
+ * fit in a block, if the result could not be guaranteed exact in double
+ * precision, or if out of memory.
+ * precondition: target should be as big as original.
+ */
+int32_t fft_filter(const filter *f, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height, int32_t *min, int32_t *max);
+
+/* Same as fft_filter, reading 8-bit source pixels */
+int32_t fft_filter_u8(const filter *f, const uint8_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t *min, int32_t *max);
+#endif
@@ -0,0 +1,128 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+/* Sweeps the filter dimension and the image size, timing apply_filter2d
+ * through the row kernels and through the FFT, to find where the FFT
+ * starts to win and to check the choice fft_preferred makes. The filters
+ * are dense random ones, with no plan, which is the worst case for the
+ * row kernels. Both results are compared pixel by pixel.
+ *
+ * usage: ./fft_bench.out [largest_dimension] [image_side ...]
+ */
+
+#include "pgm.h"
+#include "filters.h"
+#include "fft.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (double) t.tv_nsec / 1000000000;
+}
+
+/* Seconds per call of apply_filter2d with the given use of the FFT, over
+ * at least a tenth of a second
+ */
+static double time_filter(const filter *f, fft_use use, pgm_image *source,
+        pgm_image *target)
+{
+    set_fft_use(use);
+    int32_t iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        apply_filter2d(f, source->matrix, target->matrix,
+                source->width, source->height);
+        iterations ++;
+        elapsed = now() - start;
+    } while (elapsed < 0.1);
+    return elapsed / iterations;
+}
+
+static void bench_size(int32_t side, int32_t largest_dimension)
+{
+    pgm_image source, direct, fft;
+    if (create_random_pgm_image(&source, side, side) != NO_ERR ||
+            copy_pgm_image_size(&source, &direct) != NO_ERR ||
+            copy_pgm_image_size(&source, &fft) != NO_ERR)
+    {
+        printf("error allocating %dx%d image\n", side, side);
+        exit(1);
+    }
+
+    printf("%dx%d\n", side, side);
+    printf("%6s %12s %12s %8s %8s %6s\n", "dim", "direct(ms)", "fft(ms)",
+            "faster", "auto", "same");
+    int32_t crossover = 0;
+    for (int32_t dimension = 3; dimension <= largest_dimension;
+            dimension += 2)
+    {
+        int8_t *matrix = (int8_t *) malloc(dimension * dimension);
+        for (int32_t i = 0; i < dimension * dimension; i++)
+        {
+            matrix[i] = rand() % 255 - 127;
+        }
+        filter f = {dimension, matrix, NULL};
+
+        double direct_time = time_filter(&f, FFT_NEVER, &source, &direct);
+        double fft_time = time_filter(&f, FFT_ALWAYS, &source, &fft);
+        set_fft_use(FFT_AUTO);
+        int32_t chosen = fft_preferred(&f, side, side);
+        int32_t same = memcmp(direct.matrix, fft.matrix,
+                (size_t) side * side * sizeof(int32_t)) == 0;
+        if (crossover == 0 && fft_time < direct_time)
+        {
+            crossover = dimension;
+        }
+
+        printf("%6d %12.3lf %12.3lf %8s %8s %6s\n", dimension,
+                direct_time * 1e3, fft_time * 1e3,
+                fft_time < direct_time ? "fft" : "direct",
+                chosen ? "fft" : "direct", same ? "yes" : "NO");
+        free(matrix);
+    }
+    printf("fft faster from %dx%d\n\n", crossover, crossover);
+
+    destroy_pgm_image(&source);
+    destroy_pgm_image(&direct);
+    destroy_pgm_image(&fft);
+}
+
+int main(int argc, char **argv)
+{
+    int32_t largest_dimension = argc > 1 ? atoi(argv[1]) : 63;
+    if (largest_dimension < 3)
+    {
+        printf("usage: %s [largest_dimension] [image_side ...]\n", argv[0]);
+        return 1;
+    }
+
+    srand(367);
+    if (argc > 2)
+    {
+        for (int i = 2; i < argc; i++) bench_size(atoi(argv[i]),
+                largest_dimension);
+        return 0;
+    }
+    bench_size(256, largest_dimension);
+    bench_size(1024, largest_dimension);
+    bench_size(2048, largest_dimension);
+    return 0;
+}
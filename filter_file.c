@@ -0,0 +1,154 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "filter_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Stores matrix (dimension^2 taps, now owned by f) in f and registers it */
+static int32_t set_filter(filter *f, int8_t *matrix, int32_t dimension)
+{
+    f->dimension = dimension;
+    f->matrix = matrix;
+    f->plan = NULL;
+    if (register_filter(f) != 0) {
+        free(matrix);
+        f->matrix = NULL;
+        return ERR_MALLOC;
+    }
+    return NO_ERR;
+}
+
+/* The odd dimension whose square is taps, 0 if there is none */
+static int32_t dimension_of(int32_t taps)
+{
+    int32_t dimension = 1;
+    while (dimension * dimension < taps) dimension += 2;
+    return dimension * dimension == taps && dimension <= MAX_FILTER_DIMENSION
+        ? dimension : 0;
+}
+
+int32_t parse_filter(const char *spec, filter *f)
+{
+    int32_t capacity = MAX_FILTER_DIMENSION * MAX_FILTER_DIMENSION;
+    int8_t *matrix = NULL;
+    int32_t size = 0;
+    int32_t taps = 0;
+    const char *p = spec;
+    while (*p != '\0') {
+        if (*p == '#') {
+            while (*p != '\0' && *p != '\n') p ++;
+            continue;
+        }
+        if (strchr(" \t\r\n,;", *p) != NULL) {
+            p ++;
+            continue;
+        }
+        char *end;
+        long tap = strtol(p, &end, 10);
+        if (end == p || tap < INT8_MIN || tap > INT8_MAX || taps == capacity ||
+                strchr(" \t\r\n,;#", *end) == NULL) {
+            free(matrix);
+            return ERR_INVALID_FILTER;
+        }
+        // grow by doubling, up to the largest filter
+        if (taps == size) {
+            size = size == 0 ? 16 : 2 * size;
+            if (size > capacity) size = capacity;
+            int8_t *grown = (int8_t *) realloc(matrix, size);
+            if (grown == NULL) {
+                free(matrix);
+                return ERR_MALLOC;
+            }
+            matrix = grown;
+        }
+        matrix[taps ++] = tap;
+        p = end;
+    }
+
+    int32_t dimension = dimension_of(taps);
+    if (dimension == 0) {
+        free(matrix);
+        return ERR_INVALID_FILTER;
+    }
+    return set_filter(f, matrix, dimension);
+}
+
+/* Reads the binary form, after its magic bytes */
+static int32_t read_binary_filter(FILE *file, filter *f)
+{
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, file) != 4) return ERR_INVALID_FILTER;
+    uint32_t dimension = bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+        (uint32_t) bytes[3] << 24;
+    if (dimension % 2 == 0 || dimension > MAX_FILTER_DIMENSION) {
+        return ERR_INVALID_FILTER;
+    }
+
+    size_t taps = dimension * dimension;
+    int8_t *matrix = (int8_t *) malloc(taps);
+    if (matrix == NULL) return ERR_MALLOC;
+    if (fread(matrix, 1, taps, file) != taps || fgetc(file) != EOF) {
+        free(matrix);
+        return ERR_INVALID_FILTER;
+    }
+    return set_filter(f, matrix, dimension);
+}
+
+int32_t load_filter_from_file(const char *filename, filter *f)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) return ERR_NO_FILE;
+
+    char magic[4];
+    size_t magic_size = strlen(FILTER_MAGIC);
+    if (fread(magic, 1, magic_size, file) == magic_size &&
+            memcmp(magic, FILTER_MAGIC, magic_size) == 0) {
+        int32_t err = read_binary_filter(file, f);
+        fclose(file);
+        return err;
+    }
+
+    // the text form, read whole
+    if (fseek(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return ERR_NO_FILE;
+    }
+    long size = ftell(file);
+    rewind(file);
+    char *text = size < 0 ? NULL : (char *) malloc(size + 1);
+    if (text == NULL) {
+        fclose(file);
+        return ERR_MALLOC;
+    }
+    if (fread(text, 1, size, file) != (size_t) size) {
+        free(text);
+        fclose(file);
+        return ERR_NO_FILE;
+    }
+    fclose(file);
+    text[size] = '\0';
+    int32_t err = strlen(text) == (size_t) size ? parse_filter(text, f)
+                                                 : ERR_INVALID_FILTER;
+    free(text);
+    return err;
+}
+
+void destroy_filter(filter *f)
+{
+    unregister_filter(f);
+    free(f->matrix);
+    f->matrix = NULL;
+}
@@ -0,0 +1,56 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __FILTER_FILE__H
+#define __FILTER_FILE__H
+
+#include "filters.h"
+#include "pgm.h"
+#include <stdint.h>
+
+/**************CUSTOM FILTERS*****************/
+/* Filters can be given at runtime instead of being compiled in, either as
+ * text or in a binary file.
+ *
+ * Text: the taps, row after row, separated by spaces, commas, semicolons
+ * or newlines; everything from a # to the end of the line is a comment.
+ * The dimension is the square root of the number of taps, which must be
+ * an odd square. Each tap must fit an int8_t. e.g. "0,1,0; 1,-4,1; 0,1,0"
+ *
+ * Binary: the magic bytes FILTER_MAGIC, the dimension as a 4-byte little
+ * endian integer, then the dimension^2 taps as bytes, row after row.
+ */
+#define FILTER_MAGIC "FLT8"
+
+/* Largest dimension of a custom filter */
+#define MAX_FILTER_DIMENSION 255
+
+/* Error codes, next to the ones of pgm.h */
+#define ERR_INVALID_FILTER 8
+
+/* Parses the text form of a filter into f, allocating its matrix, and
+ * registers it (see register_filter). Returns NO_ERR on success,
+ * ERR_INVALID_FILTER if spec is not a valid filter, ERR_MALLOC if out of
+ * memory.
+ */
+int32_t parse_filter(const char *spec, filter *f);
+
+/* Same as parse_filter, reading the text or binary form from a file.
+ * Returns ERR_NO_FILE if the file cannot be read.
+ */
+int32_t load_filter_from_file(const char *filename, filter *f);
+
+/* Unregisters f and frees its matrix */
+void destroy_filter(filter *f);
+#endif
@@ -13,100 +13,150 @@
 */
 
 #include "filters.h"
+#include "fft.h"
+#include "kernels.h"
+#include "pool.h"
+#include "tiles.h"
+#include "counters.h"
+#include "trace.h"
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************** FILTER CONSTANTS*****************/
-/* laplacian */
-int8_t lp3_m[] =
+/* The coefficients live in filters.def, which is shared with kernels.c */
+#define BUILTIN_FILTER(name, dim, ...) \
+    int8_t name##_m[] = {__VA_ARGS__}; \
+    filter name##_f = {dim, name##_m};
+#include "filters.def"
+#undef BUILTIN_FILTER
+
+filter *builtin_filters[NUM_FILTERS] =
     {
-        0, 1, 0,
-        1, -4, 1,
-        0, 1, 0,
+#define BUILTIN_FILTER(name, dim, ...) &name##_f,
+#include "filters.def"
+#undef BUILTIN_FILTER
     };
-filter lp3_f = {3, lp3_m};
 
-int8_t lp5_m[] =
-    {
-        -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1,
-        -1, -1, 24, -1, -1,
-        -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1,
-    };
-filter lp5_f = {5, lp5_m};
+int32_t register_filter(filter *f)
+{
+    filter_plan *plan = create_filter_plan(f);
+    if (plan == NULL) return -1;
+    destroy_filter_plan((filter_plan *) f->plan);
+    f->plan = plan;
+    return 0;
+}
 
-/* Laplacian of gaussian */
-int8_t log_m[] =
-    {
-        0, 1, 1, 2, 2, 2, 1, 1, 0,
-        1, 2, 4, 5, 5, 5, 4, 2, 1,
-        1, 4, 5, 3, 0, 3, 5, 4, 1,
-        2, 5, 3, -12, -24, -12, 3, 5, 2,
-        2, 5, 0, -24, -40, -24, 0, 5, 2,
-        2, 5, 3, -12, -24, -12, 3, 5, 2,
-        1, 4, 5, 3, 0, 3, 5, 4, 1,
-        1, 2, 4, 5, 5, 5, 4, 2, 1,
-        0, 1, 1, 2, 2, 2, 1, 1, 0,
-    };
-filter log_f = {9, log_m};
+void unregister_filter(filter *f)
+{
+    destroy_filter_plan((filter_plan *) f->plan);
+    f->plan = NULL;
+}
 
-/* Identity */
-int8_t identity_m[] = {1};
-filter identity_f = {1, identity_m};
+/* The builtin filters are registered before main */
+__attribute__((constructor))
+static void register_builtin_filters(void)
+{
+    for (int i = 0; i < NUM_FILTERS; i ++) {
+        register_filter(builtin_filters[i]);
+    }
+}
 
-filter *builtin_filters[NUM_FILTERS] = {&lp3_f, &lp5_f, &log_f, &identity_f};
+/* One thread's partial min and max. Each slot has a cache line of its own,
+ * so threads publishing their results never write to the same line.
+ */
+typedef struct min_max_slot_t
+{
+    int32_t min;
+    int32_t max;
+} __attribute__((aligned(64))) min_max_slot;
+
+/* A WORK_STEALING thread's deque of chunks: the contiguous range of chunk
+ * numbers [front, back), packed into one word (front in the high half) so
+ * that the owner taking from the front and thieves taking from the back
+ * both move it with a single compare-and-swap. Chunk ranges are never
+ * handed out twice, so a stale value can never come back (no ABA).
+ */
+typedef struct steal_deque_t
+{
+    _Alignas(64) _Atomic uint64_t range;
+} steal_deque;
 
+/* Everything a call shares between its threads. Nothing lives in globals,
+ * so several filter calls can run in the same process at once.
+ */
 typedef struct common_work_t
 {
     const filter *f;
+    row_kernel kernel;
     const int32_t *original_image;
     int32_t *output_image;
+    // 8-bit images: when original_pixels is set, the int32 images are unused
+    // and the normalization is always NORMALIZE_RECOMPUTE
+    row_kernel_u8 kernel_u8;
+    const uint8_t *original_pixels;
+    uint8_t *output_pixels;
     int32_t width;
     int32_t height;
+    tile_shape tile; // see choose_tile_shape
     int32_t max_threads;
+    normalization_mode normalization;
     pthread_barrier_t barrier;
+    min_max_slot *min_max; // one slot per thread
+
+    // chunks of the WORK_QUEUE and WORK_STEALING methods, numbered
+    // row-major over the image
+    int32_t work_chunk;
+    int32_t chunks_per_row;
+    int32_t num_chunks;
+
+    // WORK_QUEUE: threads claim chunks by bumping the counters, one per
+    // phase, each on a cache line of its own. Each thread bumps them once
+    // more after the last chunk, so they are wider than the chunk numbers.
+    int32_t claim_batch; // chunks claimed at once
+    _Alignas(64) _Atomic int64_t next_chunk;
+    _Alignas(64) _Atomic int64_t next_normalization_chunk;
+
+    // WORK_STEALING: one deque per thread and per phase
+    steal_deque *deques;
+    steal_deque *normalization_deques;
 } common_work;
 
+/* Chunk size of WORK_STEALING when the caller does not give one */
+#define DEFAULT_STEALING_CHUNK 32
+/* A WORK_STEALING owner takes this fraction of its deque at a time */
+#define STEAL_RUN_SPLIT 8
+
 typedef struct work_t
 {
     common_work *common;
     int32_t id;
 } work;
 
-typedef struct queue_node_t {
-    struct queue_node_t *next;
-    int32_t row_start;
-    int32_t row_end;
-    int32_t col_start;
-    int32_t col_end;
-} queue_node;
-
-
-pthread_mutex_t global_min_max_mutex;
-pthread_mutex_t queue_mutex;
-
-int32_t global_min = INT_MAX;
-int32_t global_max = INT_MIN;
 
-queue_node* q;
-queue_node* q_normalization;
-queue_node* q_cleanup;
-
-
-/* Normalizes a pixel given the smallest and largest integer values
+/* Normalizes a pixel value given the smallest and largest integer values
  * in the image */
-void normalize_pixel(int32_t *target, int32_t pixel_idx, int32_t smallest,
+static inline int32_t normalize_value(int32_t pixel, int32_t smallest,
         int32_t largest)
 {
     if (smallest == largest)
     {
-        return;
+        return pixel;
     }
 
-    target[pixel_idx] = ((target[pixel_idx] - smallest) * 255) / (largest - smallest);
+    return ((pixel - smallest) * 255) / (largest - smallest);
+}
+
+/* Normalizes a pixel given the smallest and largest integer values
+ * in the image */
+void normalize_pixel(int32_t *target, int32_t pixel_idx, int32_t smallest,
+        int32_t largest)
+{
+    target[pixel_idx] = normalize_value(target[pixel_idx], smallest, largest);
 }
 /*************** COMMON WORK ***********************/
 /* Process a single pixel and returns the value of processed pixel
@@ -138,6 +188,253 @@ int32_t apply2d(const filter *f, const int32_t *original, int32_t *target,
     return pixel;
 }
 
+/* Same as apply2d, reading 8-bit pixels */
+static int32_t apply2d_u8(const filter *f, const uint8_t *original,
+        int32_t width, int32_t height, int row, int column)
+{
+    int32_t pixel = 0;
+    int32_t upper_left_row = row - f->dimension/2;
+    int32_t upper_left_column = column - f->dimension/2;
+    for (int r = 0; r < f->dimension; r ++) {
+        for (int c = 0; c < f->dimension; c ++) {
+            int32_t curr_row = upper_left_row + r;
+            int32_t curr_col = upper_left_column + c;
+            if (curr_row >= 0 && curr_col >= 0 && curr_row < height && curr_col < width) {
+                pixel += original[curr_row * width + curr_col] * f->matrix[r * f->dimension + c];
+            }
+        }
+    }
+    return pixel;
+}
+
+/* Stores a processed pixel and folds it into the running min and max */
+static inline void store_pixel(int32_t *out, int32_t pixel,
+        int32_t *min, int32_t *max)
+{
+    *out = pixel;
+    if (pixel < *min) *min = pixel;
+    if (pixel > *max) *max = pixel;
+}
+
+/* Filters columns [col_start, col_end) of row r into out, where out[0] is
+ * column col_start. Only the frame of dimension/2 pixels along the image
+ * edges goes through the clipped apply2d; the interior of the row is handed
+ * to the row kernel.
+ */
+static void filter_row_span(const filter *f, row_kernel kernel,
+        const int32_t *original, int32_t *out, int32_t width, int32_t height,
+        int32_t r, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    int32_t half = f->dimension / 2;
+    out -= col_start; // so that out[c] is column c
+
+    if (r < half || r >= height - half) { // top and bottom border band
+        for (int c = col_start; c < col_end; c ++) {
+            store_pixel(&out[c], apply2d(f, original, NULL, width, height, r, c),
+                    min, max);
+        }
+        return;
+    }
+
+    // interior columns of the row, clamped to this span
+    int32_t in_start = col_start > half ? col_start : half;
+    int32_t in_end = col_end < width - half ? col_end : width - half;
+    if (in_end < in_start) in_start = in_end = col_start;
+
+    for (int c = col_start; c < in_start; c ++) { // left border
+        store_pixel(&out[c], apply2d(f, original, NULL, width, height, r, c),
+                min, max);
+    }
+    // interior
+    kernel(f, original + (r - half) * width + (in_start - half), width,
+            out + in_start, in_end - in_start, min, max);
+    for (int c = in_end; c < col_end; c ++) { // right border
+        store_pixel(&out[c], apply2d(f, original, NULL, width, height, r, c),
+                min, max);
+    }
+}
+
+/* Filters rows [row_start, row_end) x columns [col_start, col_end) of the
+ * image into target, row by row.
+ */
+static void filter_block_row_major(const filter *f, row_kernel kernel,
+        const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    for (int r = row_start; r < row_end; r ++) {
+        filter_row_span(f, kernel, original, target + r * width + col_start,
+                width, height, r, col_start, col_end, min, max);
+    }
+}
+
+/* Same as filter_block_row_major, but only looks for the min and max: every
+ * row goes to the same one-row scratch buffer, so target is never touched.
+ * scratch must hold col_end - col_start pixels.
+ */
+static void scan_block_row_major(const filter *f, row_kernel kernel,
+        const int32_t *original, int32_t *scratch,
+        int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    for (int r = row_start; r < row_end; r ++) {
+        filter_row_span(f, kernel, original, scratch,
+                width, height, r, col_start, col_end, min, max);
+    }
+}
+
+/* Filters the block again once the min and max are known, normalizing each
+ * row while it is still in cache, so target is written exactly once.
+ */
+static void finalize_block_row_major(const filter *f, row_kernel kernel,
+        const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t smallest, int32_t largest)
+{
+    int32_t unused_min = INT_MAX;
+    int32_t unused_max = INT_MIN;
+    for (int r = row_start; r < row_end; r ++) {
+        filter_row_span(f, kernel, original, target + r * width + col_start,
+                width, height, r, col_start, col_end, &unused_min, &unused_max);
+        for (int c = col_start; c < col_end; c ++) {
+            normalize_pixel(target, r * width + c, smallest, largest);
+        }
+    }
+}
+
+/* Same as filter_row_span, reading 8-bit pixels through an 8-bit kernel.
+ * The filtered values still need 32 bits, so out stays int32_t.
+ */
+static void filter_row_span_u8(const filter *f, row_kernel_u8 kernel,
+        const uint8_t *original, int32_t *out, int32_t width, int32_t height,
+        int32_t r, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    int32_t half = f->dimension / 2;
+    out -= col_start; // so that out[c] is column c
+
+    if (r < half || r >= height - half) { // top and bottom border band
+        for (int c = col_start; c < col_end; c ++) {
+            store_pixel(&out[c], apply2d_u8(f, original, width, height, r, c),
+                    min, max);
+        }
+        return;
+    }
+
+    int32_t in_start = col_start > half ? col_start : half;
+    int32_t in_end = col_end < width - half ? col_end : width - half;
+    if (in_end < in_start) in_start = in_end = col_start;
+
+    for (int c = col_start; c < in_start; c ++) { // left border
+        store_pixel(&out[c], apply2d_u8(f, original, width, height, r, c),
+                min, max);
+    }
+    kernel(f, original + (r - half) * width + (in_start - half), width,
+            out + in_start, in_end - in_start, min, max);
+    for (int c = in_end; c < col_end; c ++) { // right border
+        store_pixel(&out[c], apply2d_u8(f, original, width, height, r, c),
+                min, max);
+    }
+}
+
+/* Same as scan_block_row_major, reading 8-bit pixels */
+static void scan_block_row_major_u8(const filter *f, row_kernel_u8 kernel,
+        const uint8_t *original, int32_t *scratch,
+        int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    for (int r = row_start; r < row_end; r ++) {
+        filter_row_span_u8(f, kernel, original, scratch,
+                width, height, r, col_start, col_end, min, max);
+    }
+}
+
+/* Same as finalize_block_row_major, reading and writing 8-bit pixels: each
+ * row is filtered into scratch, then normalized straight into target.
+ * Narrowing truncates like save_pgm_to_file does, so the bytes are the
+ * same as filtering the int32_t image and saving it.
+ */
+static void finalize_block_row_major_u8(const filter *f, row_kernel_u8 kernel,
+        const uint8_t *original, int32_t *scratch,
+        uint8_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t smallest, int32_t largest)
+{
+    int32_t unused_min = INT_MAX;
+    int32_t unused_max = INT_MIN;
+    for (int r = row_start; r < row_end; r ++) {
+        filter_row_span_u8(f, kernel, original, scratch,
+                width, height, r, col_start, col_end, &unused_min, &unused_max);
+        uint8_t *out = target + r * width + col_start;
+        for (int c = 0; c < col_end - col_start; c ++) {
+            out[c] = (uint8_t) normalize_value(scratch[c], smallest, largest);
+        }
+    }
+}
+
+/* Phase marks of the calling thread, for the counters and the trace */
+static inline void begin_work(int32_t worker)
+{
+    counters_begin(worker);
+    TRACE_WORK_BEGIN(worker);
+}
+
+static inline void enter_phase(counter_phase phase)
+{
+    counters_phase(phase);
+    TRACE_PHASE(phase);
+}
+
+static inline void end_work(void)
+{
+    counters_end();
+    TRACE_WORK_END();
+}
+
+/* Order in which a worker visits the tiles of its block */
+typedef enum
+{
+    TILES_ROW_MAJOR,
+    TILES_COLUMN_MAJOR
+} tile_order;
+
+/* Sets up the parts of cw that describe the call: one of the int32_t and
+ * the 8-bit image pairs is NULL. 8-bit images always use
+ * NORMALIZE_RECOMPUTE.
+ */
+static void init_common_work(common_work *cw, const filter *f,
+        const int32_t *original, int32_t *target,
+        const uint8_t *original_pixels, uint8_t *output_pixels,
+        int32_t width, int32_t height, normalization_mode normalization)
+{
+    cw->f = f;
+    cw->original_image = original;
+    cw->output_image = target;
+    cw->original_pixels = original_pixels;
+    cw->output_pixels = output_pixels;
+    cw->kernel = original != NULL ? select_row_kernel(f) : NULL;
+    cw->kernel_u8 = original_pixels != NULL ? select_row_kernel_u8(f) : NULL;
+    cw->width = width;
+    cw->height = height;
+    cw->tile = choose_tile_shape(f->dimension, width, height,
+            original != NULL ? sizeof(int32_t) : sizeof(uint8_t));
+    cw->normalization = original_pixels != NULL ? NORMALIZE_RECOMPUTE
+                                                : normalization;
+}
+
+// defined with the phases of the threaded methods
+static void filter_tiles(const common_work *cw, int32_t *scratch,
+        tile_order order, int32_t row_start, int32_t row_end,
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max);
+static void normalize_tiles(const common_work *cw, int32_t *scratch,
+        tile_order order, int32_t row_start, int32_t row_end,
+        int32_t col_start, int32_t col_end, int32_t smallest, int32_t largest);
+
 /*********SEQUENTIAL IMPLEMENTATIONS ***************/
 /* TODO: your sequential implementation goes here.
  * IMPORTANT: you must test this thoroughly with lots of corner cases and
@@ -150,290 +447,913 @@ void apply_filter2d(const filter *f,
         const int32_t *original, int32_t *target,
         int32_t width, int32_t height)
 {
+    apply_filter2d_mode(f, original, target, width, height, NORMALIZE_IN_PLACE);
+}
+
+void apply_filter2d_mode(const filter *f,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height, normalization_mode normalization)
+{
+    common_work cw;
+    init_common_work(&cw, f, original, target, NULL, NULL, width, height,
+            normalization);
+
     // min and max pixel values for normalization
     int32_t min = INT_MAX;
     int32_t max = INT_MIN;
+    begin_work(0);
 
-    // loop through each pixel of the image and process it
-    for(int r = 0; r < height; r ++) { // for each row
-        for (int c = 0; c < width; c ++) { // for each col
-            // process this pixel
-            target[r * width + c] = apply2d(f, original, target, width, height, r, c);
-            // look for min pixel value
-            if (target[r * width + c] < min) min = target[r * width + c];
-            // look for max pixel value
-            if (target[r * width + c] > max) max = target[r * width + c];
-        }
+    // large filters: the FFT writes every pixel to target, whatever the
+    // normalization mode, and it is normalized in place below
+    int fft = fft_preferred(f, width, height) &&
+        fft_filter(f, original, target, width, height, &min, &max) == 0;
+
+    // without a scratch row, fall back to normalizing target in place
+    int32_t *scratch = NULL;
+    if (!fft && normalization == NORMALIZE_RECOMPUTE) {
+        scratch = (int32_t *) malloc(width * sizeof(int32_t));
+    }
+    if (scratch != NULL) {
+        // look for min and max without writing target, then write each
+        // pixel once, already normalized
+        filter_tiles(&cw, scratch, TILES_ROW_MAJOR, 0, height, 0, width,
+                &min, &max);
+        enter_phase(PHASE_NORMALIZE);
+        normalize_tiles(&cw, scratch, TILES_ROW_MAJOR, 0, height, 0, width,
+                min, max);
+        end_work();
+        free(scratch);
+        return;
+    }
+
+    // loop through each tile of the image and process it
+    cw.normalization = NORMALIZE_IN_PLACE;
+    if (!fft) {
+        filter_tiles(&cw, NULL, TILES_ROW_MAJOR, 0, height, 0, width,
+                &min, &max);
     }
 
     // normalization
+    enter_phase(PHASE_NORMALIZE);
     for (int r = 0; r < height; r ++) {
         for (int c = 0; c < width; c ++) {
             normalize_pixel(target, r * width + c, min, max);
         }
     }
+    end_work();
 }
 
-void update_global_min_max(int min, int max) {
-    // update global min and global max for normalization
-    pthread_mutex_lock(&global_min_max_mutex);
-    if (min < global_min) global_min = min;
-    if (max > global_max) global_max = max;
-    pthread_mutex_unlock(&global_min_max_mutex);
-}
+void apply_filter2d_u8(const filter *f,
+        const uint8_t *original, uint8_t *target,
+        int32_t width, int32_t height)
+{
+    int32_t min = INT_MAX;
+    int32_t max = INT_MIN;
+    begin_work(0);
+
+    // large filters: the FFT needs the unnormalized values of the whole
+    // image, which target cannot hold
+    if (fft_preferred(f, width, height)) {
+        int32_t *values = (int32_t *) malloc(
+                (size_t) width * height * sizeof(int32_t));
+        if (values != NULL && fft_filter_u8(f, original, values, width,
+                    height, &min, &max) == 0) {
+            enter_phase(PHASE_NORMALIZE);
+            for (size_t i = 0; i < (size_t) width * height; i ++) {
+                target[i] = (uint8_t) normalize_value(values[i], min, max);
+            }
+            end_work();
+            free(values);
+            return;
+        }
+        free(values);
+    }
 
-void* horizontal_sharding(void *param) {
-    work w = *(work*) param;
+    // target cannot hold the unnormalized values, so always recompute
+    common_work cw;
+    init_common_work(&cw, f, NULL, NULL, original, target, width, height,
+            NORMALIZE_RECOMPUTE);
+    int32_t *scratch = (int32_t *) malloc(width * sizeof(int32_t));
+    if (scratch == NULL) exit(-1);
+    filter_tiles(&cw, scratch, TILES_ROW_MAJOR, 0, height, 0, width,
+            &min, &max);
+    enter_phase(PHASE_NORMALIZE);
+    normalize_tiles(&cw, scratch, TILES_ROW_MAJOR, 0, height, 0, width,
+            min, max);
+    end_work();
+    free(scratch);
+}
 
-    // make a copy of the data on local stack
-    int height = w.common->height;
-    int width = w.common->width;
-    int max_threads = w.common->max_threads;
-    const filter *f = w.common->f;
-    const int32_t *original = w.common->original_image;
-    int32_t *target = w.common->output_image;
+/* Side of the output tiles of apply_filter2d_chain. With the halos of a
+ * few stages, every stage's tile of int32_t values stays within L2.
+ */
+#define CHAIN_TILE 64
 
-    // determine start row and end row
-    int start_row = w.id * (height / max_threads); // inclusive
-    int end_row = (w.id + 1) * (height / max_threads); // exclusive
-    if (w.id == max_threads - 1) end_row = height;
+/* Everything apply_filter2d_chain needs for one tile */
+typedef struct chain_t
+{
+    const filter **filters;
+    row_kernel *kernels;
+    int32_t **buffers; // buffers[s]: stage s's input, buffers[0] the image
+    const int32_t *smallest; // min and max of the stages normalized so far
+    const int32_t *largest;
+    const int32_t *original;
+    int32_t width;
+    int32_t height;
+} chain;
+
+/* Runs stages [0, count) of the chain on one tile, through the scratch
+ * buffers: stage s reads its input padded by the halos of stages s to
+ * count - 1, and every stage but the last is normalized with its known
+ * min and max. The raw values of the last stage go to out, one row of
+ * tile_width after the other, and its min and max are folded into min and
+ * max. Values outside the image are zero at every stage, which filters
+ * them exactly like apply2d clips them.
+ */
+static void chain_tile(const chain *ch, int32_t count,
+        int32_t row, int32_t col, int32_t tile_height, int32_t tile_width,
+        int32_t *out, int32_t *min, int32_t *max)
+{
+    // stage 0's input: the image around the tile
+    int32_t halo = 0;
+    for (int32_t s = 0; s < count; s ++) {
+        halo += ch->filters[s]->dimension / 2;
+    }
+    int32_t rows = tile_height + 2 * halo;
+    int32_t cols = tile_width + 2 * halo;
+    int32_t *in = ch->buffers[0];
+    for (int32_t r = 0; r < rows; r ++) {
+        int32_t image_row = row - halo + r;
+        for (int32_t c = 0; c < cols; c ++) {
+            int32_t image_col = col - halo + c;
+            in[r * cols + c] = image_row >= 0 && image_row < ch->height &&
+                image_col >= 0 && image_col < ch->width
+                ? ch->original[image_row * ch->width + image_col] : 0;
+        }
+    }
 
-    // min and max pixel values for normalization
-    int32_t min = INT_MAX;
-    int32_t max = INT_MIN;
+    for (int32_t s = 0; s < count; s ++) {
+        int32_t dimension = ch->filters[s]->dimension;
+        int32_t out_halo = halo - dimension / 2;
+        int32_t out_rows = tile_height + 2 * out_halo;
+        int32_t out_cols = tile_width + 2 * out_halo;
+        int last = s == count - 1;
+        int32_t *dst = last ? out : ch->buffers[s + 1];
+        int32_t unused_min = INT_MAX;
+        int32_t unused_max = INT_MIN;
+
+        // the input is padded, so every row is interior to the kernel
+        for (int32_t r = 0; r < out_rows; r ++) {
+            ch->kernels[s](ch->filters[s], in + r * cols, cols,
+                    dst + r * out_cols, out_cols,
+                    last ? min : &unused_min, last ? max : &unused_max);
+        }
+        if (!last) {
+            // normalize for the next stage, keeping the outside at zero
+            for (int32_t r = 0; r < out_rows; r ++) {
+                int32_t image_row = row - out_halo + r;
+                for (int32_t c = 0; c < out_cols; c ++) {
+                    int32_t image_col = col - out_halo + c;
+                    int32_t *v = &dst[r * out_cols + c];
+                    *v = image_row >= 0 && image_row < ch->height &&
+                        image_col >= 0 && image_col < ch->width
+                        ? normalize_value(*v, ch->smallest[s], ch->largest[s])
+                        : 0;
+                }
+            }
+        }
+        in = dst;
+        halo = out_halo;
+        rows = out_rows;
+        cols = out_cols;
+    }
+}
 
-    // horizontal sharding, row major
-    for (int r = start_row; r < end_row; r ++) { // iterate through each row
-        for (int c = 0; c < width; c ++) { // iterate through each column
-            // process each pixel
-            target[r * width + c] = apply2d(f, original, target, width, height, r, c);
-            // look for min pixel value
-            if (target[r * width + c] < min) min = target[r * width + c];
-            // look for max pixel value
-            if (target[r * width + c] > max) max = target[r * width + c];
+void apply_filter2d_chain(const filter **filters, int32_t num_filters,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height)
+{
+    row_kernel kernels[num_filters];
+    int32_t halos[num_filters];
+    int32_t *buffers[num_filters];
+    int32_t smallest[num_filters];
+    int32_t largest[num_filters];
+
+    // stage s's input needs the halos of every stage from s on, at most
+    int32_t halo = 0;
+    for (int32_t s = num_filters - 1; s >= 0; s --) {
+        halo += filters[s]->dimension / 2;
+        halos[s] = halo;
+        kernels[s] = select_row_kernel(filters[s]);
+    }
+    for (int32_t s = 0; s < num_filters; s ++) {
+        int32_t side = CHAIN_TILE + 2 * halos[s];
+        buffers[s] = (int32_t *) malloc((size_t) side * side * sizeof(int32_t));
+        if (buffers[s] == NULL) exit(-1);
+    }
+    int32_t *out = (int32_t *) malloc(CHAIN_TILE * CHAIN_TILE * sizeof(int32_t));
+    if (out == NULL) exit(-1);
+
+    chain ch = {filters, kernels, buffers, smallest, largest,
+        original, width, height};
+
+    // stage s's min and max depend on the normalized output of the stages
+    // before it, so find them one stage at a time: pre-pass s runs the
+    // chain up to stage s and only keeps its min and max. The last pass
+    // runs the whole chain and stores the last stage, normalized in place
+    // like apply_filter2d.
+    for (int32_t pass = 0; pass < num_filters; pass ++) {
+        int last = pass == num_filters - 1;
+        int32_t min = INT_MAX;
+        int32_t max = INT_MIN;
+        for (int32_t row = 0; row < height; row += CHAIN_TILE) {
+            int32_t tile_height = height - row < CHAIN_TILE
+                ? height - row : CHAIN_TILE;
+            for (int32_t col = 0; col < width; col += CHAIN_TILE) {
+                int32_t tile_width = width - col < CHAIN_TILE
+                    ? width - col : CHAIN_TILE;
+                chain_tile(&ch, pass + 1, row, col, tile_height, tile_width,
+                        out, &min, &max);
+                if (!last) continue;
+                for (int32_t r = 0; r < tile_height; r ++) {
+                    memcpy(target + (row + r) * width + col,
+                            out + r * tile_width,
+                            tile_width * sizeof(int32_t));
+                }
+            }
         }
+        smallest[pass] = min;
+        largest[pass] = max;
     }
 
+    for (int32_t r = 0; r < height; r ++) {
+        for (int32_t c = 0; c < width; c ++) {
+            normalize_pixel(target, r * width + c,
+                    smallest[num_filters - 1], largest[num_filters - 1]);
+        }
+    }
 
-    // update global min and global max for normalization
-    update_global_min_max(min, max);
+    for (int32_t s = 0; s < num_filters; s ++) {
+        free(buffers[s]);
+    }
+    free(out);
+}
 
-    // wait for all threads to be done with their work
-    pthread_barrier_wait(&(w.common->barrier));
+/* Reads the next rows of a stream into band, so that it holds the
+ * buffer_rows source rows starting at first_row - half. band held the
+ * source rows [*band_top, *band_end) so far: the ones still needed (the
+ * halo) are moved up instead of read again. Rows outside the image are
+ * zero, which filters them exactly like apply2d clips them. Returns 0 on
+ * success.
+ */
+static int32_t read_stream_band(stream_reader read, void *read_context,
+        uint8_t *band, int32_t width, int32_t height, int32_t half,
+        int32_t first_row, int32_t buffer_rows,
+        int32_t *band_top, int32_t *band_end)
+{
+    int32_t top = first_row - half;
+    int32_t kept = *band_end - top; // rows already in the buffer
+    if (kept > 0) {
+        memmove(band, band + (size_t) (top - *band_top) * width,
+                (size_t) kept * width);
+    } else {
+        kept = 0;
+    }
+    for (int32_t r = kept; r < buffer_rows; r ++) {
+        int32_t row = top + r;
+        if (row < 0 || row >= height) {
+            memset(band + (size_t) r * width, 0, width);
+            continue;
+        }
+        // read every remaining image row of the band at once
+        int32_t count = height - row < buffer_rows - r
+            ? height - row : buffer_rows - r;
+        if (read(read_context, row, count, band + (size_t) r * width) != 0) {
+            return -1;
+        }
+        r += count - 1;
+    }
+    *band_top = top;
+    *band_end = top + buffer_rows;
+    return 0;
+}
 
-    // normalization
-    for (int r = start_row; r < end_row; r ++) { // iterate through each row
-        for (int c = 0; c < width; c ++) { // iterate through each column
-            normalize_pixel(target, r * width + c, global_min, global_max);
+/* Filters the rows of a band loaded by read_stream_band (rows of them,
+ * after the halo) and normalizes them into out.
+ */
+static void finalize_stream_band(const filter *f, row_kernel_u8 kernel,
+        const uint8_t *band, int32_t *scratch, uint8_t *out,
+        int32_t width, int32_t rows, int32_t smallest, int32_t largest)
+{
+    int32_t half = f->dimension / 2;
+    int32_t unused_min = INT_MAX;
+    int32_t unused_max = INT_MIN;
+    for (int32_t r = 0; r < rows; r ++) {
+        // within the band buffer, the band's rows are interior
+        filter_row_span_u8(f, kernel, band, scratch, width, rows + 2 * half,
+                half + r, 0, width, &unused_min, &unused_max);
+        uint8_t *out_row = out + (size_t) r * width;
+        for (int c = 0; c < width; c ++) {
+            out_row[c] = (uint8_t) normalize_value(scratch[c],
+                    smallest, largest);
         }
     }
+}
 
-    return NULL;
+int32_t apply_filter2d_stream(const filter *f, int32_t width, int32_t height,
+        int32_t band_height, stream_reader read, void *read_context,
+        stream_writer write, void *write_context)
+{
+    row_kernel_u8 kernel = select_row_kernel_u8(f);
+    int32_t half = f->dimension / 2;
+    if (band_height > height) band_height = height;
+    if (band_height < 1) band_height = 1;
+    int32_t buffer_rows = band_height + 2 * half;
+
+    // the only allocations: one band with its halo, one output band and one
+    // row of filtered values
+    uint8_t *band = (uint8_t *) malloc((size_t) buffer_rows * width);
+    uint8_t *out = (uint8_t *) malloc((size_t) band_height * width);
+    int32_t *scratch = (int32_t *) malloc(width * sizeof(int32_t));
+    int32_t err = band == NULL || out == NULL || scratch == NULL ? -1 : 0;
 
-}
+    int32_t min = INT_MAX;
+    int32_t max = INT_MIN;
 
-void* vertical_sharding_column_major(void *param) {
-    work w = *(work*) param;
+    // first pass: the min and max of the whole image; second pass: filter
+    // again and write every band normalized
+    for (int pass = 0; pass < 2 && err == 0; pass ++) {
+        int32_t band_top = -half;
+        int32_t band_end = -half; // nothing loaded yet
+        for (int32_t row = 0; row < height && err == 0; row += band_height) {
+            int32_t rows = height - row < band_height
+                ? height - row : band_height;
+            err = read_stream_band(read, read_context, band, width, height,
+                    half, row, rows + 2 * half, &band_top, &band_end);
+            if (err != 0) break;
+            if (pass == 0) {
+                // within the band buffer, the band's rows are interior
+                scan_block_row_major_u8(f, kernel, band, scratch,
+                        width, rows + 2 * half, half, half + rows, 0, width,
+                        &min, &max);
+                continue;
+            }
+            finalize_stream_band(f, kernel, band, scratch, out, width, rows,
+                    min, max);
+            err = write(write_context, out, rows);
+        }
+    }
 
-    // make a copy of the data on local stack
-    int height = w.common->height;
-    int width = w.common->width;
-    int max_threads = w.common->max_threads;
-    const filter *f = w.common->f;
-    const int32_t *original = w.common->original_image;
-    int32_t *target = w.common->output_image;
+    free(band);
+    free(out);
+    free(scratch);
+    return err != 0 ? -1 : 0;
+}
 
-    // determine start column and end column
-    int start_col = w.id * (width / max_threads); // inclusive
-    int end_col = (w.id + 1) * (width / max_threads); // exclusive
-    if (w.id == max_threads - 1) end_col = width;
+/* Publishes a thread's min and max in its own slot. Must happen before the
+ * barrier that separates filtering from normalization, whose wait is
+ * counted from here.
+ */
+static void publish_min_max(common_work *cw, int32_t id, int32_t min,
+        int32_t max)
+{
+    enter_phase(PHASE_REDUCE);
+    cw->min_max[id].min = min;
+    cw->min_max[id].max = max;
+    enter_phase(PHASE_BARRIER);
+}
 
-    // min and max pixel values for normalization
+/* Folds every thread's slot into the global min and max. Must happen after
+ * the barrier; every thread does it on its own instead of taking a lock.
+ */
+static void reduce_min_max(const common_work *cw, int32_t *global_min,
+        int32_t *global_max)
+{
+    enter_phase(PHASE_REDUCE);
     int32_t min = INT_MAX;
     int32_t max = INT_MIN;
+    for (int i = 0; i < cw->max_threads; i ++) {
+        if (cw->min_max[i].min < min) min = cw->min_max[i].min;
+        if (cw->min_max[i].max > max) max = cw->min_max[i].max;
+    }
+    *global_min = min;
+    *global_max = max;
+    enter_phase(PHASE_NORMALIZE);
+}
 
-    // vertical sharding column major
-    for (int c = start_col; c < end_col; c ++) { // iterate through each column
-        for (int r = 0; r < height; r ++) { // iterate through each row
-            // process each pixel
-            target[r * width + c] = apply2d(f, original, target, width, height, r, c);
-            // look for min pixel value
-            if (target[r * width + c] < min) min = target[r * width + c];
-            // look for max pixel value
-            if (target[r * width + c] > max) max = target[r * width + c];
-        }
+/* Row scratch buffer a worker needs in NORMALIZE_RECOMPUTE mode (always
+ * the case for 8-bit images) */
+static int32_t *alloc_scratch(const common_work *cw)
+{
+    if (cw->normalization != NORMALIZE_RECOMPUTE) return NULL;
+    // the other workers recompute too, so there is no fallback
+    int32_t *scratch = (int32_t *) malloc(cw->width * sizeof(int32_t));
+    if (scratch == NULL) exit(-1);
+    return scratch;
+}
+
+/* First phase of a worker on a block, visited row by row: filter it into
+ * target, or in NORMALIZE_RECOMPUTE mode only look for its min and max.
+ */
+static void filter_phase(const common_work *cw, int32_t *scratch,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    if (cw->original_pixels != NULL) {
+        scan_block_row_major_u8(cw->f, cw->kernel_u8, cw->original_pixels,
+                scratch, cw->width, cw->height,
+                row_start, row_end, col_start, col_end, min, max);
+    } else if (cw->normalization == NORMALIZE_RECOMPUTE) {
+        scan_block_row_major(cw->f, cw->kernel, cw->original_image, scratch,
+                cw->width, cw->height, row_start, row_end, col_start, col_end,
+                min, max);
+    } else {
+        filter_block_row_major(cw->f, cw->kernel, cw->original_image,
+                cw->output_image, cw->width, cw->height,
+                row_start, row_end, col_start, col_end, min, max);
     }
-    // update global min and global max for normalization
-    update_global_min_max(min, max);
+}
 
-    // wait for all threads to be done with their work
-    pthread_barrier_wait(&(w.common->barrier));
+/* Second phase of a worker on a block, visited row by row, once the global
+ * min and max are known.
+ */
+static void normalize_phase(const common_work *cw, int32_t *scratch,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t smallest, int32_t largest)
+{
+    if (cw->original_pixels != NULL) {
+        finalize_block_row_major_u8(cw->f, cw->kernel_u8, cw->original_pixels,
+                scratch, cw->output_pixels, cw->width, cw->height,
+                row_start, row_end, col_start, col_end, smallest, largest);
+        return;
+    }
+    if (cw->normalization == NORMALIZE_RECOMPUTE) {
+        finalize_block_row_major(cw->f, cw->kernel, cw->original_image,
+                cw->output_image, cw->width, cw->height,
+                row_start, row_end, col_start, col_end, smallest, largest);
+        return;
+    }
+    for (int r = row_start; r < row_end; r ++) { // iterate through each row
+        for (int c = col_start; c < col_end; c ++) { // iterate through each column
+            normalize_pixel(cw->output_image, r * cw->width + c,
+                    smallest, largest);
+        }
+    }
+}
 
-    // normalization
-    for (int c = start_col; c < end_col; c ++) { // iterate through each column
-        for (int r = 0; r < height; r ++) { // iterate through each row
-            normalize_pixel(target, r * width + c, global_min, global_max);
+/* Runs the first phase, or the second one if normalize, on every tile of
+ * the block [row_start, row_end) x [col_start, col_end), in order. The
+ * tiles start at the block's top left corner.
+ */
+static void visit_tiles(const common_work *cw, int32_t *scratch,
+        tile_order order, int normalize,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t smallest, int32_t largest, int32_t *min, int32_t *max)
+{
+    int32_t tile_height = cw->tile.height;
+    int32_t tile_width = cw->tile.width;
+    int32_t rows = (row_end - row_start + tile_height - 1) / tile_height;
+    int32_t cols = (col_end - col_start + tile_width - 1) / tile_width;
+    for (int32_t i = 0; i < rows * cols; i ++) {
+        int32_t tile_row = order == TILES_ROW_MAJOR ? i / cols : i % rows;
+        int32_t tile_col = order == TILES_ROW_MAJOR ? i % cols : i / rows;
+        int32_t rs = row_start + tile_row * tile_height;
+        int32_t re = rs + tile_height < row_end ? rs + tile_height : row_end;
+        int32_t cs = col_start + tile_col * tile_width;
+        int32_t ce = cs + tile_width < col_end ? cs + tile_width : col_end;
+        TRACE_BEGIN(TRACE_TILE, i);
+        if (normalize) {
+            normalize_phase(cw, scratch, rs, re, cs, ce, smallest, largest);
+        } else {
+            filter_phase(cw, scratch, rs, re, cs, ce, min, max);
         }
+        TRACE_END();
     }
+}
 
+static void filter_tiles(const common_work *cw, int32_t *scratch,
+        tile_order order, int32_t row_start, int32_t row_end,
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)
+{
+    visit_tiles(cw, scratch, order, 0, row_start, row_end, col_start, col_end,
+            0, 0, min, max);
+}
 
-    return NULL;
+static void normalize_tiles(const common_work *cw, int32_t *scratch,
+        tile_order order, int32_t row_start, int32_t row_end,
+        int32_t col_start, int32_t col_end, int32_t smallest, int32_t largest)
+{
+    visit_tiles(cw, scratch, order, 1, row_start, row_end, col_start, col_end,
+            smallest, largest, NULL, NULL);
 }
 
-void* vertical_sharding_row_major(void *param) {
-    work w = *(work*) param;
+/* The sharding methods split the tiles of the whole image between the
+ * workers, one contiguous range each: SHARDED_ROWS numbers them row-major,
+ * so a share is whole rows of tiles (and maybe part of two), the column
+ * methods number them column-major. A worker visits its share in either
+ * order.
+ */
 
-    // make a copy of the data on local stack
-    int height = w.common->height;
-    int width = w.common->width;
-    int max_threads = w.common->max_threads;
-    const filter *f = w.common->f;
-    const int32_t *original = w.common->original_image;
-    int32_t *target = w.common->output_image;
+/* Number of rows and columns of tiles of the image */
+static void tile_grid(const common_work *cw, int32_t *rows, int32_t *cols)
+{
+    *rows = (cw->height + cw->tile.height - 1) / cw->tile.height;
+    *cols = (cw->width + cw->tile.width - 1) / cw->tile.width;
+}
 
+/* Makes the tiles shorter if there are fewer of them than threads, so that
+ * every worker gets a share (unless the image has fewer rows than that)
+ */
+static void split_tiles(common_work *cw, int32_t num_threads)
+{
+    int32_t rows, cols;
+    tile_grid(cw, &rows, &cols);
+    int32_t rows_needed = (num_threads + cols - 1) / cols;
+    if (rows >= rows_needed) return;
+    cw->tile.height = cw->height / rows_needed > 0
+        ? cw->height / rows_needed : 1;
+}
 
-    // determine start column and end column
-    int start_col = w.id * (width / max_threads); // inclusive
-    int end_col = (w.id + 1) * (width / max_threads); // exclusive
-    if (w.id == max_threads - 1) end_col = width;
+/* The share [*first, *last) of worker id, in tile numbers */
+static void tile_share(const common_work *cw, int32_t id,
+        int32_t *first, int32_t *last)
+{
+    int32_t rows, cols;
+    tile_grid(cw, &rows, &cols);
+    int64_t tiles = (int64_t) rows * cols;
+    *first = tiles * id / cw->max_threads;
+    *last = tiles * (id + 1) / cw->max_threads;
+}
+
+/* Runs the first phase, or the second one if normalize, on the tiles
+ * [first, last) of the image numbered in share_order, visiting them in
+ * visit_order.
+ */
+static void visit_tile_share(const common_work *cw, int32_t *scratch,
+        tile_order share_order, tile_order visit_order, int normalize,
+        int32_t first, int32_t last, int32_t smallest, int32_t largest,
+        int32_t *min, int32_t *max)
+{
+    if (first >= last) return;
+    int32_t rows, cols;
+    tile_grid(cw, &rows, &cols);
+
+    // the lines of tiles (rows, or columns if numbered column-major) the
+    // share touches, across tiles each; visit their tiles in the share
+    int32_t across = share_order == TILES_ROW_MAJOR ? cols : rows;
+    int32_t first_line = first / across;
+    int32_t lines = (last - 1) / across - first_line + 1;
+    for (int32_t i = 0; i < lines * across; i ++) {
+        int32_t line = first_line +
+            (visit_order == share_order ? i / across : i % lines);
+        int32_t position = visit_order == share_order ? i % across
+                                                      : i / lines;
+        int32_t k = line * across + position;
+        if (k < first || k >= last) continue;
+
+        int32_t tile_row = share_order == TILES_ROW_MAJOR ? line : position;
+        int32_t tile_col = share_order == TILES_ROW_MAJOR ? position : line;
+        int32_t rs = tile_row * cw->tile.height;
+        int32_t re = rs + cw->tile.height < cw->height
+            ? rs + cw->tile.height : cw->height;
+        int32_t cs = tile_col * cw->tile.width;
+        int32_t ce = cs + cw->tile.width < cw->width
+            ? cs + cw->tile.width : cw->width;
+        TRACE_BEGIN(TRACE_TILE, k);
+        if (normalize) {
+            normalize_phase(cw, scratch, rs, re, cs, ce, smallest, largest);
+        } else {
+            filter_phase(cw, scratch, rs, re, cs, ce, min, max);
+        }
+        TRACE_END();
+    }
+}
+
+/* Both phases of a sharding method for worker w */
+static void shard_tiles(const work *w, tile_order share_order,
+        tile_order visit_order)
+{
+    common_work *cw = w->common;
+    int32_t *scratch = alloc_scratch(cw);
+    begin_work(w->id);
+
+    int32_t first, last;
+    tile_share(cw, w->id, &first, &last);
 
     // min and max pixel values for normalization
     int32_t min = INT_MAX;
     int32_t max = INT_MIN;
 
-    // vertical sharding row major
-    for (int r = 0; r < height; r ++) { // iterate through each row
-        for (int c = start_col; c < end_col; c ++) { // iterate through each col
-            // process each pixel
-            target[r * width + c] = apply2d(f, original, target, width, height, r, c);
-            // look for min pixel value
-            if (target[r * width + c] < min) min = target[r * width + c];
-            // look for max pixel value
-            if (target[r * width + c] > max) max = target[r * width + c];
-        }
-    }
-    // update global min and global max for normalization
-    update_global_min_max(min, max);
+    visit_tile_share(cw, scratch, share_order, visit_order, 0, first, last,
+            0, 0, &min, &max);
+
+    // publish this thread's min and max for normalization
+    publish_min_max(cw, w->id, min, max);
 
     // wait for all threads to be done with their work
-    pthread_barrier_wait(&(w.common->barrier));
+    pthread_barrier_wait(&(cw->barrier));
+
+    // global min and global max for normalization
+    int32_t global_min, global_max;
+    reduce_min_max(cw, &global_min, &global_max);
 
     // normalization
-    for (int r = 0; r < height; r ++) { // iterate through each row
-        for (int c = start_col; c < end_col; c ++) { // iterate through each row
-            normalize_pixel(target, r * width + c, global_min, global_max);
-        }
-    }
+    visit_tile_share(cw, scratch, share_order, visit_order, 1, first, last,
+            global_min, global_max, NULL, NULL);
 
+    end_work();
+    free(scratch);
+}
+
+void* horizontal_sharding(void *param) {
+    // rows of tiles, row major
+    shard_tiles((work *) param, TILES_ROW_MAJOR, TILES_ROW_MAJOR);
     return NULL;
 }
 
+void* vertical_sharding_column_major(void *param) {
+    // columns of tiles, down each column
+    shard_tiles((work *) param, TILES_COLUMN_MAJOR, TILES_COLUMN_MAJOR);
+    return NULL;
+}
+
+void* vertical_sharding_row_major(void *param) {
+    // columns of tiles, across their rows
+    shard_tiles((work *) param, TILES_COLUMN_MAJOR, TILES_ROW_MAJOR);
+    return NULL;
+}
+
+
+/* Cuts the image into work_chunk x work_chunk chunks (smaller along the
+ * right and bottom edges), numbered row-major.
+ */
+static void init_chunk_grid(common_work *cw, int32_t work_chunk) {
+    cw->work_chunk = work_chunk;
+    cw->chunks_per_row = (cw->width + work_chunk - 1) / work_chunk;
+    cw->num_chunks = cw->chunks_per_row *
+        ((cw->height + work_chunk - 1) / work_chunk);
+}
+
+/* Sets up the chunk counters of the WORK_QUEUE method */
+static void init_work_queue(common_work *cw, int32_t work_chunk,
+        int32_t claim_batch) {
+    init_chunk_grid(cw, work_chunk);
+    cw->claim_batch = claim_batch > 0 ? claim_batch : 1;
+    atomic_init(&cw->next_chunk, 0);
+    atomic_init(&cw->next_normalization_chunk, 0);
+}
+
+/* Claims the next claim_batch chunks from counter. Returns 0 once every
+ * chunk has been claimed, otherwise sets [*first, *last) to the claimed
+ * chunk numbers.
+ */
+static int claim_chunks(const common_work *cw, _Atomic int64_t *counter,
+        int32_t *first, int32_t *last) {
+    // relaxed is enough: the chunks are disjoint and the barrier orders the
+    // two phases
+    TRACE_BEGIN(TRACE_CLAIM, 0);
+    int64_t start = atomic_fetch_add_explicit(counter, cw->claim_batch,
+            memory_order_relaxed);
+    TRACE_END();
+    if (start >= cw->num_chunks) return 0;
+    *first = start;
+    *last = start + cw->claim_batch < cw->num_chunks
+        ? start + cw->claim_batch : cw->num_chunks;
+    return 1;
+}
+
+/* Coordinates of chunk number `chunk` */
+static void chunk_bounds(const common_work *cw, int32_t chunk,
+        int32_t *row_start, int32_t *row_end,
+        int32_t *col_start, int32_t *col_end) {
+    int32_t chunk_row = chunk / cw->chunks_per_row;
+    int32_t chunk_col = chunk % cw->chunks_per_row;
+    *row_start = chunk_row * cw->work_chunk;
+    *row_end = *row_start + cw->work_chunk;
+    if (*row_end > cw->height) *row_end = cw->height;
+    *col_start = chunk_col * cw->work_chunk;
+    *col_end = *col_start + cw->work_chunk;
+    if (*col_end > cw->width) *col_end = cw->width;
+}
 
 void* work_pool(void *param) {
     work w = *(work*) param;
-
-    // make a copy of the data on local stack
-    int height = w.common->height;
-    int width = w.common->width;
-    const filter *f = w.common->f;
-    const int32_t *original = w.common->original_image;
-    int32_t *target = w.common->output_image;
+    common_work *cw = w.common;
+    int32_t *scratch = alloc_scratch(cw);
+    begin_work(w.id);
+    int32_t first, last;
+    int32_t row_start, row_end, col_start, col_end;
 
     // min and max pixel values for normalization
     int32_t min = INT_MAX;
     int32_t max = INT_MIN;
 
-    // get a job from queue
-    pthread_mutex_lock(&queue_mutex);
-    while (q) {
-        int32_t row_start = q->row_start;
-        int32_t row_end = q->row_end;
-        int32_t col_start = q->col_start;
-        int32_t col_end = q->col_end;
-        q = q->next;
-        pthread_mutex_unlock(&queue_mutex);
-
-        // process assigned image chunk
-        for (int r = row_start; r < row_end; r ++) { // iterate through each row
-            for (int c = col_start; c < col_end; c ++) { // iterate through each column
-                // process each pixel
-                target[r * width + c] = apply2d(f, original, target, width, height, r, c);
-                // look for min pixel value
-                if (target[r * width + c] < min) min = target[r * width + c];
-                // look for max pixel value
-                if (target[r * width + c] > max) max = target[r * width + c];
-            }
+    // claim chunks until there are none left
+    while (claim_chunks(cw, &cw->next_chunk, &first, &last)) {
+        for (int32_t chunk = first; chunk < last; chunk ++) {
+            // process assigned image chunk
+            chunk_bounds(cw, chunk, &row_start, &row_end, &col_start, &col_end);
+            TRACE_BEGIN(TRACE_CHUNK, chunk);
+            filter_tiles(cw, scratch, TILES_ROW_MAJOR, row_start, row_end,
+                    col_start, col_end, &min, &max);
+            TRACE_END();
         }
-        pthread_mutex_lock(&queue_mutex);
     }
-    pthread_mutex_unlock(&queue_mutex);
 
-    // update global min and global max for normalization
-    update_global_min_max(min, max);
+    // publish this thread's min and max for normalization
+    publish_min_max(cw, w.id, min, max);
 
     // wait for all threads to be done with their work
-    pthread_barrier_wait(&(w.common->barrier));
+    pthread_barrier_wait(&(cw->barrier));
+
+    // global min and global max for normalization
+    int32_t global_min, global_max;
+    reduce_min_max(cw, &global_min, &global_max);
 
     // normalization
-    pthread_mutex_lock(&queue_mutex);
-    while (q_normalization) {
-        int32_t row_start = q_normalization->row_start;
-        int32_t row_end = q_normalization->row_end;
-        int32_t col_start = q_normalization->col_start;
-        int32_t col_end = q_normalization->col_end;
-        q_normalization = q_normalization->next;
-        pthread_mutex_unlock(&queue_mutex);
-
-        for (int r = row_start; r < row_end; r ++) { // iterate through each row
-            for (int c = col_start; c < col_end; c ++) { // iterate through each column
-                normalize_pixel(target, r * width + c, global_min, global_max);
-            }
+    while (claim_chunks(cw, &cw->next_normalization_chunk, &first, &last)) {
+        for (int32_t chunk = first; chunk < last; chunk ++) {
+            chunk_bounds(cw, chunk, &row_start, &row_end, &col_start, &col_end);
+            TRACE_BEGIN(TRACE_CHUNK, chunk);
+            normalize_tiles(cw, scratch, TILES_ROW_MAJOR, row_start, row_end,
+                    col_start, col_end, global_min, global_max);
+            TRACE_END();
         }
-        pthread_mutex_lock(&queue_mutex);
     }
-    pthread_mutex_unlock(&queue_mutex);
+    end_work();
+    free(scratch);
     return NULL;
 }
 
-void create_work_queue(int32_t width, int32_t height, int32_t work_chunk) {
-    q = (queue_node*)malloc(sizeof(queue_node));
-    q->next = NULL;
-    q_normalization = q;
-    q_cleanup = q;
-    queue_node* old_head = q;
-    // initialize the chunk work queue
-    for (int r = 0; r < ((height / work_chunk) + 1); ++r) {
-        for (int c = 0; c < ((width / work_chunk) + 1); ++c) {
-            q->row_start = work_chunk * r;
-            q->row_end = work_chunk * (r + 1);
-            if (q->row_end > height) q->row_end = height;
-
-            q->col_start = work_chunk * c;
-            q->col_end = work_chunk * (c + 1);
-            if (q->col_end > width) q->col_end = width;
-
-            // If loop won't run anymore no need to create another queue element
-            if (r < (height / work_chunk) || c < (width / work_chunk)) {
-                q->next = (queue_node*)malloc(sizeof(queue_node));
-                q = q->next;
-            }
+
+static inline uint64_t pack_range(uint32_t front, uint32_t back) {
+    return ((uint64_t) front << 32) | back;
+}
+
+/* Sets up the deques of the WORK_STEALING method: both phases start with
+ * every thread owning a contiguous block of row-major chunks, like
+ * SHARDED_ROWS with a finer grain.
+ */
+static void init_work_stealing(common_work *cw, int32_t work_chunk) {
+    init_chunk_grid(cw, work_chunk);
+    for (int i = 0; i < cw->max_threads; i ++) {
+        uint32_t front = (int64_t) cw->num_chunks * i / cw->max_threads;
+        uint32_t back = (int64_t) cw->num_chunks * (i + 1) / cw->max_threads;
+        atomic_init(&cw->deques[i].range, pack_range(front, back));
+        atomic_init(&cw->normalization_deques[i].range,
+                pack_range(front, back));
+    }
+}
+
+/* The owner takes the first 1/STEAL_RUN_SPLIT of its own deque at once
+ * (at least one chunk), [*first, *last): few compare-and-swaps on small
+ * chunks, while most of a descheduled owner's chunks stay up for stealing.
+ */
+static int take_front(steal_deque *deque, int32_t *first, int32_t *last) {
+    uint64_t range = atomic_load_explicit(&deque->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t front = range >> 32;
+        uint32_t back = (uint32_t) range;
+        if (front >= back) return 0;
+        uint32_t taken = (back - front + STEAL_RUN_SPLIT - 1) / STEAL_RUN_SPLIT;
+        if (atomic_compare_exchange_weak_explicit(&deque->range, &range,
+                    pack_range(front + taken, back),
+                    memory_order_relaxed, memory_order_relaxed)) {
+            *first = front;
+            *last = front + taken;
+            return 1;
+        }
+    }
+}
+
+/* A thief takes the back half of the victim's deque, [*first, *last) */
+static int steal_back(steal_deque *victim, int32_t *first, int32_t *last) {
+    uint64_t range = atomic_load_explicit(&victim->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t front = range >> 32;
+        uint32_t back = (uint32_t) range;
+        if (front >= back) return 0;
+        uint32_t taken = (back - front + 1) / 2;
+        if (atomic_compare_exchange_weak_explicit(&victim->range, &range,
+                    pack_range(front, back - taken),
+                    memory_order_relaxed, memory_order_relaxed)) {
+            *first = back - taken;
+            *last = back;
+            return 1;
+        }
+    }
+}
+
+/* Gets the next run of chunks [*first, *last) for thread id: from the
+ * front of its own deque, or else by stealing half of a random victim's
+ * deque into its own first. Returns 0 once every deque is empty.
+ */
+static int next_stolen_run(steal_deque *deques, int32_t num_threads,
+        int32_t id, uint32_t *seed, int32_t *first, int32_t *last) {
+    while (!take_front(&deques[id], first, last)) {
+        TRACE_BEGIN(TRACE_STEAL, 0);
+        int stolen = 0;
+        int32_t stolen_first, stolen_last;
+        for (int attempt = 0; !stolen && attempt < 2 * num_threads;
+                attempt ++) {
+            // xorshift: cheap and good enough to spread the thieves
+            *seed ^= *seed << 13;
+            *seed ^= *seed >> 17;
+            *seed ^= *seed << 5;
+            int32_t victim = *seed % num_threads;
+            // after the random attempts, sweep every deque once before
+            // giving up
+            if (attempt >= num_threads) victim = (id + attempt) % num_threads;
+            if (victim == id) continue;
+            stolen = steal_back(&deques[victim], &stolen_first, &stolen_last);
+        }
+        TRACE_END();
+        if (!stolen) return 0;
+        // our own deque is empty, so nobody else changes it until the
+        // stolen range is published; thieves may then empty it again
+        // before we take from it, hence the loop
+        atomic_store_explicit(&deques[id].range,
+                pack_range(stolen_first, stolen_last), memory_order_relaxed);
+    }
+    return 1;
+}
+
+/* Filters (normalize = 0) or normalizes the run of row-major chunks
+ * [first, last) as few rectangles as it takes: the partial chunk rows at
+ * either end, and one band for the whole chunk rows in between.
+ */
+static void visit_chunk_run(const common_work *cw, int32_t *scratch,
+        int normalize, int32_t first, int32_t last, int32_t *min,
+        int32_t *max) {
+    while (first < last) {
+        int32_t chunk_row = first / cw->chunks_per_row;
+        int32_t chunk_col = first % cw->chunks_per_row;
+        int32_t end = (chunk_row + 1) * cw->chunks_per_row;
+        int32_t rows = 1;
+        if (chunk_col == 0 && last >= end) {
+            rows = (last - first) / cw->chunks_per_row;
+            end = first + rows * cw->chunks_per_row;
+        }
+        else if (end > last) {
+            end = last;
+        }
+        int32_t row_start = chunk_row * cw->work_chunk;
+        int32_t row_end = row_start + rows * cw->work_chunk;
+        if (row_end > cw->height) row_end = cw->height;
+        int32_t col_start = chunk_col * cw->work_chunk;
+        int32_t col_end = rows > 1 ? cw->width :
+            (end - chunk_row * cw->chunks_per_row) * cw->work_chunk;
+        if (col_end > cw->width) col_end = cw->width;
+        TRACE_BEGIN(TRACE_CHUNK, first);
+        if (normalize) {
+            normalize_tiles(cw, scratch, TILES_ROW_MAJOR, row_start, row_end,
+                    col_start, col_end, *min, *max);
         }
+        else {
+            filter_tiles(cw, scratch, TILES_ROW_MAJOR, row_start, row_end,
+                    col_start, col_end, min, max);
+        }
+        TRACE_END();
+        first = end;
     }
-    // Restore q pointer so that it still points to the head of the chunk
-    // work queue
-    q = old_head;
 }
 
-void clean_up_work_queue() {
-    while(q_cleanup) {
-        queue_node* head = q_cleanup;
-        q_cleanup = q_cleanup->next;
-        free(head);
+void* work_stealing(void *param) {
+    work w = *(work*) param;
+    common_work *cw = w.common;
+    int32_t *scratch = alloc_scratch(cw);
+    begin_work(w.id);
+    uint32_t seed = 2654435761u * (w.id + 1);
+    int32_t first, last;
+
+    // min and max pixel values for normalization
+    int32_t min = INT_MAX;
+    int32_t max = INT_MIN;
+
+    while (next_stolen_run(cw->deques, cw->max_threads, w.id, &seed,
+                &first, &last)) {
+        visit_chunk_run(cw, scratch, 0, first, last, &min, &max);
+    }
+
+    // publish this thread's min and max for normalization
+    publish_min_max(cw, w.id, min, max);
+
+    // wait for all threads to be done with their work
+    pthread_barrier_wait(&(cw->barrier));
+
+    // global min and global max for normalization
+    int32_t global_min, global_max;
+    reduce_min_max(cw, &global_min, &global_max);
+
+    // normalization
+    while (next_stolen_run(cw->normalization_deques, cw->max_threads, w.id,
+                &seed, &first, &last)) {
+        visit_chunk_run(cw, scratch, 1, first, last, &global_min,
+                &global_max);
     }
-    // restore the global queue
-    q = NULL;
-    q_normalization = NULL;
-    q_cleanup = NULL;
+    end_work();
+    free(scratch);
+    return NULL;
 }
 
 
@@ -447,62 +1367,343 @@ void apply_filter2d_threaded(const filter *f,
         int32_t width, int32_t height,
         int32_t num_threads, parallel_method method, int32_t work_chunk)
 {
-    // initialize common work
-    common_work* cw = (common_work*)malloc(sizeof(common_work));
-    cw->f = f;
-    cw->original_image = original;
-    cw->output_image = target;
-    cw->width = width;
-    cw->height = height;
+    apply_filter2d_threaded_mode(f, original, target, width, height,
+            num_threads, method, work_chunk, NORMALIZE_IN_PLACE);
+}
+
+void apply_filter2d_threaded_mode(const filter *f,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method, int32_t work_chunk,
+        normalization_mode normalization)
+{
+    // a one-off pool: callers filtering many images should keep their own
+    filter_pool *pool = create_filter_pool(num_threads);
+    if (pool == NULL) exit(-1);
+    apply_filter2d_pool(pool, f, original, target, width, height,
+            method, work_chunk, normalization);
+    destroy_filter_pool(pool);
+}
+
+/* Runs method on the workers of pool for the call described by cw, whose
+ * image, filter and normalization fields are already set.
+ */
+static void run_on_pool(filter_pool *pool, common_work *cw,
+        parallel_method method, int32_t work_chunk)
+{
+    int32_t num_threads = filter_pool_size(pool);
+    cw->tile = reshape_tile(cw->tile, filter_pool_tile_aspect(pool),
+            cw->width, cw->height);
+    if (method == SHARDED_ROWS || method == SHARDED_COLUMNS_COLUMN_MAJOR ||
+            method == SHARDED_COLUMNS_ROW_MAJOR) {
+        split_tiles(cw, num_threads);
+    }
+
+    // the rest of the common work only lives for this call, so it stays on
+    // the stack and a call allocates nothing
+    min_max_slot min_max[num_threads];
     cw->max_threads = num_threads;
     pthread_barrier_init(&(cw->barrier) ,NULL, num_threads);
+    cw->min_max = min_max;
 
     // initialize work array
-    work** threads_work = (work**)malloc(sizeof(work*) * num_threads);
+    work threads_work[num_threads];
+    void *params[num_threads];
     for (int i = 0; i < num_threads; i ++) {
-        threads_work[i] = (work *) malloc(sizeof(work));
-        threads_work[i]->common = cw;
-        threads_work[i]->id = i;
+        threads_work[i].common = cw;
+        threads_work[i].id = i;
+        params[i] = &threads_work[i];
     }
 
-    pthread_t threads[num_threads];
-    int rc;
+    steal_deque deques[method == WORK_STEALING ? num_threads : 1];
+    steal_deque normalization_deques[method == WORK_STEALING ? num_threads : 1];
+    if (method == WORK_QUEUE) {
+        init_work_queue(cw, work_chunk, filter_pool_claim_batch(pool));
+    }
+    else if (method == WORK_STEALING) {
+        cw->deques = deques;
+        cw->normalization_deques = normalization_deques;
+        init_work_stealing(cw, work_chunk > 0 ? work_chunk
+                                              : DEFAULT_STEALING_CHUNK);
+    }
 
-    if (method == WORK_QUEUE) create_work_queue(width, height, work_chunk);
+    pool_job job = NULL;
+    if (method == SHARDED_ROWS) job = horizontal_sharding;
+    else if (method == SHARDED_COLUMNS_COLUMN_MAJOR) job = vertical_sharding_column_major;
+    else if (method == SHARDED_COLUMNS_ROW_MAJOR) job = vertical_sharding_row_major;
+    else if (method == WORK_QUEUE) job = work_pool;
+    else if (method == WORK_STEALING) job = work_stealing;
+    else exit(-1);
 
-    for (int i = 0; i < num_threads; ++i) {
-        if (method == SHARDED_ROWS) {
-            rc = pthread_create(&threads[i], NULL, horizontal_sharding, (void *)threads_work[i]);
-        }
-        else if (method == SHARDED_COLUMNS_COLUMN_MAJOR) {
-            rc = pthread_create(&threads[i], NULL, vertical_sharding_column_major, (void *)threads_work[i]);
+    // All threads finish their job
+    filter_pool_run(pool, job, params);
+
+    // clean up
+    pthread_barrier_destroy(&(cw->barrier));
+}
+
+void apply_filter2d_pool(filter_pool *pool, const filter *f,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        parallel_method method, int32_t work_chunk,
+        normalization_mode normalization)
+{
+    common_work common;
+    init_common_work(&common, f, original, target, NULL, NULL, width, height,
+            normalization);
+    run_on_pool(pool, &common, method, work_chunk);
+}
+
+void apply_filter2d_pool_u8(filter_pool *pool, const filter *f,
+        const uint8_t *original, uint8_t *target,
+        int32_t width, int32_t height,
+        parallel_method method, int32_t work_chunk)
+{
+    common_work common;
+    init_common_work(&common, f, NULL, NULL, original, target, width, height,
+            NORMALIZE_RECOMPUTE);
+    run_on_pool(pool, &common, method, work_chunk);
+}
+
+
+/***************** PIPELINED STREAMING ******/
+/* Band buffers in flight per worker: enough for the reader to stay ahead
+ * while the writer drains finished bands.
+ */
+#define PIPELINE_SLOTS_PER_THREAD 2
+
+/* One band buffer of the pipeline. Band b always goes through slot
+ * b % num_slots, and the slot's ticket says where it stands:
+ * 3b - free for the reader to load band b,
+ * 3b + 1 - band b loaded, for a worker to filter,
+ * 3b + 2 - band b filtered, for the writer to store.
+ * Whoever is done with band b moves the ticket to 3(b + num_slots), which
+ * hands the slot back to the reader. Each step has a single owner, so the
+ * ring is a bounded queue between the stages that needs no lock.
+ */
+typedef struct band_slot_t
+{
+    _Alignas(64) _Atomic int64_t ticket;
+    uint8_t *band; // source rows, with the halo
+    uint8_t *out;  // normalized rows
+} band_slot;
+
+/* Everything the stages of apply_filter2d_stream_pool share */
+typedef struct pipeline_t
+{
+    const filter *f;
+    row_kernel_u8 kernel;
+    int32_t width;
+    int32_t height;
+    int32_t band_height;
+    int32_t num_bands;
+    int32_t num_slots;
+    band_slot *slots;
+    stream_reader read;
+    void *read_context;
+    stream_writer write;
+    void *write_context;
+
+    // 0: look for the min and max, 1: filter, normalize and write
+    int32_t pass;
+    int32_t smallest;
+    int32_t largest;
+    min_max_slot *min_max; // one slot per worker
+
+    _Alignas(64) atomic_int next_band; // claimed by the workers
+    _Alignas(64) atomic_int error;     // set by a failed stage, stops all
+} pipeline;
+
+typedef struct pipeline_work_t
+{
+    pipeline *p;
+    int32_t id;
+} pipeline_work;
+
+/* Rows of band b */
+static int32_t band_rows(const pipeline *p, int32_t b)
+{
+    int32_t first = b * p->band_height;
+    return p->height - first < p->band_height
+        ? p->height - first : p->band_height;
+}
+
+/* Waits until the ticket of slot reaches value. Returns 0 if another stage
+ * failed in the meantime.
+ */
+static int wait_ticket(pipeline *p, band_slot *slot, int64_t value)
+{
+    while (atomic_load_explicit(&slot->ticket, memory_order_acquire) != value) {
+        if (atomic_load_explicit(&p->error, memory_order_relaxed)) return 0;
+        sched_yield();
+    }
+    return 1;
+}
+
+/* Hands slot back to the reader once band b is done with */
+static void release_slot(pipeline *p, band_slot *slot, int32_t b)
+{
+    atomic_store_explicit(&slot->ticket, 3 * (int64_t) (b + p->num_slots),
+            memory_order_release);
+}
+
+/* Reader stage: loads the bands in order, each with its own halo, as soon
+ * as their slot is free.
+ */
+static void *pipeline_reader(void *param)
+{
+    pipeline *p = (pipeline *) param;
+    int32_t half = p->f->dimension / 2;
+    for (int32_t b = 0; b < p->num_bands; b ++) {
+        band_slot *slot = &p->slots[b % p->num_slots];
+        if (!wait_ticket(p, slot, 3 * (int64_t) b)) return NULL;
+        int32_t first_row = b * p->band_height;
+        int32_t band_top = first_row - half;
+        int32_t band_end = band_top; // nothing to keep
+        if (read_stream_band(p->read, p->read_context, slot->band,
+                    p->width, p->height, half, first_row,
+                    band_rows(p, b) + 2 * half, &band_top, &band_end) != 0) {
+            atomic_store(&p->error, 1);
+            return NULL;
         }
-        else if (method == SHARDED_COLUMNS_ROW_MAJOR) {
-            rc = pthread_create(&threads[i], NULL, vertical_sharding_row_major, (void *)threads_work[i]);
+        atomic_store_explicit(&slot->ticket, 3 * (int64_t) b + 1,
+                memory_order_release);
+    }
+    return NULL;
+}
+
+/* Writer stage: stores the filtered bands in order */
+static void *pipeline_writer(void *param)
+{
+    pipeline *p = (pipeline *) param;
+    for (int32_t b = 0; b < p->num_bands; b ++) {
+        band_slot *slot = &p->slots[b % p->num_slots];
+        if (!wait_ticket(p, slot, 3 * (int64_t) b + 2)) return NULL;
+        if (p->write(p->write_context, slot->out, band_rows(p, b)) != 0) {
+            atomic_store(&p->error, 1);
+            return NULL;
         }
-        else if (method == WORK_QUEUE) {
-            rc = pthread_create(&threads[i], NULL, work_pool, (void*)(threads_work[i]));
+        release_slot(p, slot, b);
+    }
+    return NULL;
+}
+
+/* Worker stage, on the pool: filters whichever loaded band comes next */
+static void *pipeline_worker(void *param)
+{
+    pipeline_work w = *(pipeline_work *) param;
+    pipeline *p = w.p;
+    int32_t half = p->f->dimension / 2;
+    int32_t *scratch = (int32_t *) malloc(p->width * sizeof(int32_t));
+    if (scratch == NULL) atomic_store(&p->error, 1);
+
+    int32_t min = INT_MAX;
+    int32_t max = INT_MIN;
+    int32_t b;
+    while (scratch != NULL && (b = atomic_fetch_add_explicit(&p->next_band, 1,
+                    memory_order_relaxed)) < p->num_bands) {
+        band_slot *slot = &p->slots[b % p->num_slots];
+        if (!wait_ticket(p, slot, 3 * (int64_t) b + 1)) break;
+        int32_t rows = band_rows(p, b);
+        // within the band buffer, the band's rows are interior
+        if (p->pass == 0) {
+            scan_block_row_major_u8(p->f, p->kernel, slot->band, scratch,
+                    p->width, rows + 2 * half, half, half + rows,
+                    0, p->width, &min, &max);
+            release_slot(p, slot, b);
+            continue;
         }
+        finalize_stream_band(p->f, p->kernel, slot->band, scratch, slot->out,
+                p->width, rows, p->smallest, p->largest);
+        atomic_store_explicit(&slot->ticket, 3 * (int64_t) b + 2,
+                memory_order_release);
+    }
+    p->min_max[w.id].min = min;
+    p->min_max[w.id].max = max;
+    free(scratch);
+    return NULL;
+}
 
-        if (rc) exit(-1);
+int32_t apply_filter2d_stream_pool(filter_pool *pool, const filter *f,
+        int32_t width, int32_t height, int32_t band_height,
+        stream_reader read, void *read_context,
+        stream_writer write, void *write_context)
+{
+    int32_t num_threads = filter_pool_size(pool);
+    int32_t half = f->dimension / 2;
+    if (band_height > height) band_height = height;
+    if (band_height < 1) band_height = 1;
+
+    pipeline p;
+    p.f = f;
+    p.kernel = select_row_kernel_u8(f);
+    p.width = width;
+    p.height = height;
+    p.band_height = band_height;
+    p.num_bands = (height + band_height - 1) / band_height;
+    p.num_slots = PIPELINE_SLOTS_PER_THREAD * num_threads + 2;
+    p.read = read;
+    p.read_context = read_context;
+    p.write = write;
+    p.write_context = write_context;
+    atomic_init(&p.error, 0);
+
+    // memory stays bounded by the slots, whatever the height
+    band_slot slots[p.num_slots];
+    p.slots = slots;
+    for (int i = 0; i < p.num_slots; i ++) {
+        slots[i].band = (uint8_t *) malloc(
+                (size_t) (band_height + 2 * half) * width);
+        slots[i].out = (uint8_t *) malloc((size_t) band_height * width);
+        if (slots[i].band == NULL || slots[i].out == NULL) {
+            atomic_store(&p.error, 1);
+        }
     }
 
-    // All threads finish their job
-    for (int i = 0; i < num_threads; ++i) {
-        rc = pthread_join(threads[i], NULL);
-        if (rc) exit(-1);
+    min_max_slot min_max[num_threads];
+    p.min_max = min_max;
+    pipeline_work threads_work[num_threads];
+    void *params[num_threads];
+    for (int i = 0; i < num_threads; i ++) {
+        threads_work[i].p = &p;
+        threads_work[i].id = i;
+        params[i] = &threads_work[i];
     }
 
-    // clean up
-    for (int i = 0; i < num_threads; ++i) {
-        free(threads_work[i]);
+    // the first pass only needs the reader and the workers, the second
+    // adds the writer
+    for (p.pass = 0; p.pass < 2 && !atomic_load(&p.error); p.pass ++) {
+        for (int i = 0; i < p.num_slots; i ++) {
+            atomic_init(&slots[i].ticket, 3 * (int64_t) i);
+        }
+        atomic_init(&p.next_band, 0);
+
+        pthread_t reader, writer;
+        if (pthread_create(&reader, NULL, pipeline_reader, &p) != 0) {
+            atomic_store(&p.error, 1);
+            break;
+        }
+        int has_writer = p.pass == 1 &&
+            pthread_create(&writer, NULL, pipeline_writer, &p) == 0;
+        if (p.pass == 1 && !has_writer) atomic_store(&p.error, 1);
+
+        filter_pool_run(pool, pipeline_worker, params);
+        pthread_join(reader, NULL);
+        if (has_writer) pthread_join(writer, NULL);
+
+        if (p.pass == 1) break;
+        // global min and max for the second pass
+        p.smallest = INT_MAX;
+        p.largest = INT_MIN;
+        for (int i = 0; i < num_threads; i ++) {
+            if (min_max[i].min < p.smallest) p.smallest = min_max[i].min;
+            if (min_max[i].max > p.largest) p.largest = min_max[i].max;
+        }
     }
-    free(threads_work);
-    free(cw);
-    pthread_barrier_destroy(&(cw->barrier));
-    // restore global max and global min
-    global_min = INT_MAX;
-    global_max = INT_MIN;
-    if (method == WORK_QUEUE) clean_up_work_queue();
 
+    for (int i = 0; i < p.num_slots; i ++) {
+        free(slots[i].band);
+        free(slots[i].out);
+    }
+    return atomic_load(&p.error) ? -1 : 0;
 }
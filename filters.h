@@ -24,6 +24,8 @@ typedef struct filter_t
 {
     int32_t dimension;
     int8_t *matrix;
+    /* Set by register_filter: how the filter is computed fastest */
+    const struct filter_plan_t *plan;
 } filter;
 
 /* Filter constants */
@@ -35,8 +37,39 @@ typedef struct filter_t
 
 extern filter *builtin_filters[NUM_FILTERS];
 
+/* Analyzes f once (zero taps, tap range and so accumulator width,
+ * symmetry, separability) and caches the result in f->plan, so that every
+ * later call filters with it the cheapest exact way: a filter that splits
+ * into a few separable terms (a separable filter, a box plus a delta like
+ * LAPLACIAN_FILTER_5, a filter with repeated rows like LAP_OF_GAUS_FILTER)
+ * is run as row and column passes, one whose taps repeat (a symmetric
+ * filter) adds the pixels under equal taps before multiplying, with the
+ * same result as the direct 2D form. The builtin filters are registered at
+ * startup but keep their compile-time kernels, which are faster still.
+ * Unregistered filters work too, in the direct form.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int32_t register_filter(filter *f);
+
+/* Frees what register_filter set up for f */
+void unregister_filter(filter *f);
+
 
 /**************FILTER METHODS********************/
+/* How the filtered image is normalized to [0, 255] */
+typedef enum
+{
+    /* Write every filtered pixel to target, then read it back and
+     * normalize it in a second pass over target once the min and max are
+     * known. */
+    NORMALIZE_IN_PLACE,
+    /* Only look for the min and max in the first pass, without writing
+     * target, then filter again and write every pixel already normalized.
+     * Costs a second convolution but target is written once and never read
+     * back, which saves memory traffic on images larger than the cache. */
+    NORMALIZE_RECOMPUTE
+} normalization_mode;
+
 /* sequential methods */
 
 /* Applies a filter to an image using a single thread.
@@ -51,13 +84,70 @@ void apply_filter2d(const filter *f,
         const int32_t *original, int32_t *target,
         int32_t width, int32_t height);
 
-/* parallel methods*/
+/* Same as apply_filter2d (which uses NORMALIZE_IN_PLACE), with the given
+ * normalization mode. The output is the same in every mode.
+ */
+void apply_filter2d_mode(const filter *f,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height, normalization_mode normalization);
+
+/* Same as apply_filter2d, on 8-bit images: the source is read as bytes and
+ * target receives the normalized pixels directly, narrowed like
+ * save_pgm_to_file narrows them, so the saved image is the same. Uses a
+ * quarter of the memory traffic of the int32_t version.
+ */
+void apply_filter2d_u8(const filter *f,
+        const uint8_t *original, uint8_t *target,
+        int32_t width, int32_t height);
+
+/* Same as applying filters[0] to original, then filters[1] to the result,
+ * and so on, normalizing after every filter like apply_filter2d, without
+ * ever storing the intermediate images: the chain runs tile by tile, each
+ * tile padded with the halo of every filter and its intermediates kept in
+ * cache-sized scratch buffers. Since a filter's normalization depends on
+ * the min and max of everything before it, each but the last filter
+ * first gets a pre-pass over the chain up to it that only finds its min
+ * and max.
+ * precondition: num_filters > 0.
+ */
+void apply_filter2d_chain(const filter **filters, int32_t num_filters,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height);
+
+/* Row-band streaming, for images that do not fit in memory. The source is
+ * read through `read`, which must copy count 8-bit rows starting at row
+ * into rows, and the result is handed to `write` band by band, top to
+ * bottom. Both return 0 on success.
+ */
+typedef int32_t (*stream_reader)(void *context, int32_t row, int32_t count,
+        uint8_t *rows);
+typedef int32_t (*stream_writer)(void *context, const uint8_t *rows,
+        int32_t count);
+
+/* Same as apply_filter2d_u8, streaming the image in bands of band_height
+ * rows (plus dimension - 1 halo rows), so memory stays O(width *
+ * band_height) whatever the height. The source is read twice: a first
+ * pass only looks for the global min and max, and the second filters
+ * again and writes normalized bands. Returns 0 on success, -1 if a
+ * callback or an allocation failed.
+ */
+int32_t apply_filter2d_stream(const filter *f, int32_t width, int32_t height,
+        int32_t band_height, stream_reader read, void *read_context,
+        stream_writer write, void *write_context);
+
+/* parallel methods. Every method walks its share of the image in cache
+ * sized tiles (see tiles.h), each tile row by row.*/
 typedef enum
 {
     SHARDED_ROWS,
+    /* Visits its columns' tiles down one column of tiles, then the next */
     SHARDED_COLUMNS_COLUMN_MAJOR,
     SHARDED_COLUMNS_ROW_MAJOR,
-    WORK_QUEUE
+    WORK_QUEUE,
+    /* Each thread starts with a contiguous block of row-major chunks, takes
+     * them from the front a run at a time and, once it runs out, steals
+     * half of the remaining chunks of a random other thread. */
+    WORK_STEALING
 } parallel_method;
 
 
@@ -69,7 +159,8 @@ typedef enum
  *            num_threads - the number of threads to be used.
  *            method - the method to use.
  *            work_chunk - the size of the submatrices used in the WORK_QUEUE 
- *                         method.
+ *                         and WORK_STEALING methods (0 picks a default
+ *                         for WORK_STEALING).
  * precondition: target should be as big as original.
  * precondition: original should be at least width * height long.
  * precondition: num_threads > 0.
@@ -80,4 +171,77 @@ void apply_filter2d_threaded(const filter *f,
         int32_t width, int32_t height,
         int32_t num_threads, parallel_method method,
         int32_t work_chunk);
+
+/* Same as apply_filter2d_threaded (which uses NORMALIZE_IN_PLACE), with the
+ * given normalization mode. The output is the same in every mode.
+ */
+void apply_filter2d_threaded_mode(const filter *f,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method,
+        int32_t work_chunk, normalization_mode normalization);
+
+/**************THREAD POOL********************/
+/* A set of worker threads created once and reused across filter calls, so
+ * that a call does not pay for creating and joining its threads. Workers
+ * sleep on a condition variable between calls.
+ */
+typedef struct filter_pool_t filter_pool;
+
+/* Starts a pool of num_threads workers. Returns NULL on failure.
+ * precondition: num_threads > 0.
+ */
+filter_pool *create_filter_pool(int32_t num_threads);
+
+/* Stops and joins the workers and frees the pool. Must not be called while
+ * a call on the pool is running.
+ */
+void destroy_filter_pool(filter_pool *pool);
+
+/* Number of WORK_QUEUE chunks a thread claims at once (default 1). Claiming
+ * several chunks per atomic increment cuts contention on the shared chunk
+ * counter when work_chunk is small, at the cost of coarser load balancing.
+ */
+void filter_pool_set_claim_batch(filter_pool *pool, int32_t batch);
+
+/* Reshapes the tiles calls on the pool walk (default 0): 2^aspect times
+ * wider and shorter than choose_tile_shape makes them, or narrower and
+ * taller for a negative aspect (see reshape_tile). The output is the same
+ * whatever the aspect; which one is fastest depends on the machine and the
+ * image, and is best found by autotune.
+ */
+void filter_pool_set_tile_aspect(filter_pool *pool, int32_t aspect);
+
+/* Same as apply_filter2d_threaded_mode, running on the workers of pool
+ * (one thread per worker). Calls on the same pool from several threads are
+ * run one after the other.
+ */
+void apply_filter2d_pool(filter_pool *pool, const filter *f,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        parallel_method method, int32_t work_chunk,
+        normalization_mode normalization);
+
+/* Same as apply_filter2d_pool, on 8-bit images (see apply_filter2d_u8).
+ * Always normalizes with NORMALIZE_RECOMPUTE, since target cannot hold the
+ * unnormalized values.
+ */
+void apply_filter2d_pool_u8(filter_pool *pool, const filter *f,
+        const uint8_t *original, uint8_t *target,
+        int32_t width, int32_t height,
+        parallel_method method, int32_t work_chunk);
+
+/* Same as apply_filter2d_stream, pipelined: a reader thread loads bands
+ * ahead into a ring of band buffers, the workers of pool filter each band
+ * as soon as it is loaded, and a writer thread stores finished bands in
+ * order, so reading, filtering and writing overlap. The stages hand bands
+ * to each other through the ring without locks. Like
+ * apply_filter2d_stream, the source is read twice, the first pass only
+ * looking for the min and max. read is only called from the reader and
+ * write only from the writer, in row order.
+ */
+int32_t apply_filter2d_stream_pool(filter_pool *pool, const filter *f,
+        int32_t width, int32_t height, int32_t band_height,
+        stream_reader read, void *read_context,
+        stream_writer write, void *write_context);
 #endif
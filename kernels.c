@@ -0,0 +1,936 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "kernels.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+static kernel_isa cpu_isa = ISA_SCALAR;
+
+/* Runs before main: picks the instruction set once, so that the kernels
+ * never have to query the cpu again.
+ */
+__attribute__((constructor))
+static void detect_isa(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) cpu_isa = ISA_AVX2;
+    else if (__builtin_cpu_supports("sse4.1")) cpu_isa = ISA_SSE41;
+#endif
+
+    // allow lowering (never raising) the level, e.g. to compare kernels
+    const char *forced = getenv("FILTER_ISA");
+    if (forced == NULL) return;
+    kernel_isa wanted = cpu_isa;
+    if (strcmp(forced, "scalar") == 0) wanted = ISA_SCALAR;
+    else if (strcmp(forced, "sse4.1") == 0) wanted = ISA_SSE41;
+    else if (strcmp(forced, "avx2") == 0) wanted = ISA_AVX2;
+    if (wanted < cpu_isa) cpu_isa = wanted;
+}
+
+kernel_isa detected_isa(void)
+{
+    return cpu_isa;
+}
+
+/*************** GENERIC KERNELS ***********************/
+/* Plain C kernel, one output pixel at a time. Also used for the leftover
+ * pixels of the vector kernels.
+ */
+static void row_kernel_scalar(const filter *f, const int32_t *src,
+        int32_t stride, int32_t *dst, int32_t count, int32_t *min, int32_t *max)
+{
+    int32_t dimension = f->dimension;
+    int32_t lo = *min;
+    int32_t hi = *max;
+    for (int32_t i = 0; i < count; i ++) {
+        const int32_t *row = src + i;
+        const int8_t *weights = f->matrix;
+        int32_t pixel = 0;
+        for (int r = 0; r < dimension; r ++, row += stride, weights += dimension) {
+            for (int c = 0; c < dimension; c ++) {
+                pixel += row[c] * weights[c];
+            }
+        }
+        dst[i] = pixel;
+        if (pixel < lo) lo = pixel;
+        if (pixel > hi) hi = pixel;
+    }
+    *min = lo;
+    *max = hi;
+}
+
+#ifdef HAVE_X86_SIMD
+/* SSE4.1 kernel: 8 output pixels per iteration, in two 4-lane accumulators.
+ * SSE4.1 is the first level with a 32 bit lane multiply (pmulld).
+ */
+__attribute__((target("sse4.1")))
+static void row_kernel_sse41(const filter *f, const int32_t *src,
+        int32_t stride, int32_t *dst, int32_t count, int32_t *min, int32_t *max)
+{
+    int32_t dimension = f->dimension;
+    __m128i vmin = _mm_set1_epi32(*min);
+    __m128i vmax = _mm_set1_epi32(*max);
+    int32_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+        const int32_t *row = src + i;
+        const int8_t *weights = f->matrix;
+        for (int r = 0; r < dimension; r ++, row += stride, weights += dimension) {
+            for (int c = 0; c < dimension; c ++) {
+                if (weights[c] == 0) continue;
+                __m128i w = _mm_set1_epi32(weights[c]);
+                __m128i p0 = _mm_loadu_si128((const __m128i *) (row + c));
+                __m128i p1 = _mm_loadu_si128((const __m128i *) (row + c + 4));
+                acc0 = _mm_add_epi32(acc0, _mm_mullo_epi32(p0, w));
+                acc1 = _mm_add_epi32(acc1, _mm_mullo_epi32(p1, w));
+            }
+        }
+        _mm_storeu_si128((__m128i *) (dst + i), acc0);
+        _mm_storeu_si128((__m128i *) (dst + i + 4), acc1);
+        vmin = _mm_min_epi32(vmin, _mm_min_epi32(acc0, acc1));
+        vmax = _mm_max_epi32(vmax, _mm_max_epi32(acc0, acc1));
+    }
+
+    // fold the lanes of the running min and max
+    vmin = _mm_min_epi32(vmin, _mm_shuffle_epi32(vmin, _MM_SHUFFLE(1, 0, 3, 2)));
+    vmin = _mm_min_epi32(vmin, _mm_shuffle_epi32(vmin, _MM_SHUFFLE(2, 3, 0, 1)));
+    vmax = _mm_max_epi32(vmax, _mm_shuffle_epi32(vmax, _MM_SHUFFLE(1, 0, 3, 2)));
+    vmax = _mm_max_epi32(vmax, _mm_shuffle_epi32(vmax, _MM_SHUFFLE(2, 3, 0, 1)));
+    *min = _mm_cvtsi128_si32(vmin);
+    *max = _mm_cvtsi128_si32(vmax);
+
+    row_kernel_scalar(f, src + i, stride, dst + i, count - i, min, max);
+}
+
+/* AVX2 kernel: 16 output pixels per iteration in two 8-lane accumulators,
+ * then one more 8-pixel block if it fits.
+ */
+__attribute__((target("avx2")))
+static void row_kernel_avx2(const filter *f, const int32_t *src,
+        int32_t stride, int32_t *dst, int32_t count, int32_t *min, int32_t *max)
+{
+    int32_t dimension = f->dimension;
+    __m256i vmin = _mm256_set1_epi32(*min);
+    __m256i vmax = _mm256_set1_epi32(*max);
+    int32_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        const int32_t *row = src + i;
+        const int8_t *weights = f->matrix;
+        for (int r = 0; r < dimension; r ++, row += stride, weights += dimension) {
+            for (int c = 0; c < dimension; c ++) {
+                if (weights[c] == 0) continue;
+                __m256i w = _mm256_set1_epi32(weights[c]);
+                __m256i p0 = _mm256_loadu_si256((const __m256i *) (row + c));
+                __m256i p1 = _mm256_loadu_si256((const __m256i *) (row + c + 8));
+                acc0 = _mm256_add_epi32(acc0, _mm256_mullo_epi32(p0, w));
+                acc1 = _mm256_add_epi32(acc1, _mm256_mullo_epi32(p1, w));
+            }
+        }
+        _mm256_storeu_si256((__m256i *) (dst + i), acc0);
+        _mm256_storeu_si256((__m256i *) (dst + i + 8), acc1);
+        vmin = _mm256_min_epi32(vmin, _mm256_min_epi32(acc0, acc1));
+        vmax = _mm256_max_epi32(vmax, _mm256_max_epi32(acc0, acc1));
+    }
+
+    if (i + 8 <= count) {
+        __m256i acc = _mm256_setzero_si256();
+        const int32_t *row = src + i;
+        const int8_t *weights = f->matrix;
+        for (int r = 0; r < dimension; r ++, row += stride, weights += dimension) {
+            for (int c = 0; c < dimension; c ++) {
+                if (weights[c] == 0) continue;
+                __m256i p = _mm256_loadu_si256((const __m256i *) (row + c));
+                acc = _mm256_add_epi32(acc,
+                        _mm256_mullo_epi32(p, _mm256_set1_epi32(weights[c])));
+            }
+        }
+        _mm256_storeu_si256((__m256i *) (dst + i), acc);
+        vmin = _mm256_min_epi32(vmin, acc);
+        vmax = _mm256_max_epi32(vmax, acc);
+        i += 8;
+    }
+
+    // fold the lanes of the running min and max
+    __m128i lo = _mm_min_epi32(_mm256_castsi256_si128(vmin),
+            _mm256_extracti128_si256(vmin, 1));
+    __m128i hi = _mm_max_epi32(_mm256_castsi256_si128(vmax),
+            _mm256_extracti128_si256(vmax, 1));
+    lo = _mm_min_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = _mm_min_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_max_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_max_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    *min = _mm_cvtsi128_si32(lo);
+    *max = _mm_cvtsi128_si32(hi);
+
+    row_kernel_scalar(f, src + i, stride, dst + i, count - i, min, max);
+}
+#endif
+
+/* The generic kernel for the detected instruction set */
+static row_kernel select_generic_row_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+    if (cpu_isa == ISA_AVX2) return row_kernel_avx2;
+    if (cpu_isa == ISA_SSE41) return row_kernel_sse41;
+#endif
+    return row_kernel_scalar;
+}
+
+/*************** TEMPLATED KERNELS ***********************/
+/* Kernel bodies written with gcc vector extensions, two vectors per
+ * iteration, and instantiated once per vector width, source pixel type and
+ * accumulator type so that each instruction set gets registers of its
+ * native size. 8-bit sources are widened in registers only; an int16
+ * accumulator doubles the pixels per vector and is only used for filters
+ * whose results are known to fit (see fits_int16).
+ *
+ * When dimension and taps are compile-time constants (the filters in
+ * filters.def), gcc unrolls every tap, drops the zero taps together with
+ * their loads, and turns the +-1 and power of two taps into adds and
+ * shifts: the 3x3 laplacian becomes 4 adds, a shift and a subtract per
+ * vector. With runtime values the same body gives the generic 8-bit
+ * kernels.
+ */
+#define DEFINE_TEMPLATE_ROW_KERNEL(suffix, lanes, pixel_t, acc_t) \
+    typedef acc_t vec_##suffix \
+        __attribute__((vector_size(sizeof(acc_t) * lanes))); \
+    typedef int32_t out_##suffix \
+        __attribute__((vector_size(4 * lanes), aligned(4), __may_alias__)); \
+    \
+    static inline __attribute__((always_inline)) \
+    void template_tap_sum_##suffix(const int32_t dimension, \
+            const int8_t *taps, const pixel_t *src, int32_t stride, \
+            int32_t *dst, vec_##suffix *vmin, vec_##suffix *vmax) \
+    { \
+        vec_##suffix acc = {0}; \
+        _Pragma("GCC unroll 16") \
+        for (int r = 0; r < dimension; r ++) { \
+            _Pragma("GCC unroll 16") \
+            for (int c = 0; c < dimension; c ++) { \
+                const pixel_t *p = src + r * stride + c; \
+                vec_##suffix pixels; \
+                /* gcc 12 turns this loop into one widening load, but \
+                 * splits __builtin_convertvector from bytes into one \
+                 * load per byte */ \
+                _Pragma("GCC unroll 16") \
+                for (int l = 0; l < lanes; l ++) pixels[l] = p[l]; \
+                acc += pixels * (acc_t) taps[r * dimension + c]; \
+            } \
+        } \
+        *(out_##suffix *) dst = __builtin_convertvector(acc, out_##suffix); \
+        vec_##suffix lower = acc < *vmin; \
+        *vmin = (acc & lower) | (*vmin & ~lower); \
+        vec_##suffix higher = acc > *vmax; \
+        *vmax = (acc & higher) | (*vmax & ~higher); \
+    } \
+    \
+    static inline __attribute__((always_inline)) \
+    void template_row_kernel_##suffix(const int32_t dimension, \
+            const int8_t *taps, const pixel_t *src, int32_t stride, \
+            int32_t *dst, int32_t count, int32_t *min, int32_t *max) \
+    { \
+        vec_##suffix vmin = {0}; \
+        vec_##suffix vmax = {0}; \
+        int32_t lo = *min; \
+        int32_t hi = *max; \
+        int32_t i = 0; \
+        /* the lanes start at the limits of acc_t, which *min and *max \
+         * may not fit in */ \
+        vmin += (acc_t) ((1ull << (8 * sizeof(acc_t) - 1)) - 1); \
+        vmax -= (acc_t) ((1ull << (8 * sizeof(acc_t) - 1)) - 1); \
+        vmax -= 1; \
+        for (; i + 2 * lanes <= count; i += 2 * lanes) { \
+            template_tap_sum_##suffix(dimension, taps, src + i, stride, \
+                    dst + i, &vmin, &vmax); \
+            template_tap_sum_##suffix(dimension, taps, src + i + lanes, \
+                    stride, dst + i + lanes, &vmin, &vmax); \
+        } \
+        if (i > 0) { \
+            for (int l = 0; l < lanes; l ++) { \
+                if (vmin[l] < lo) lo = vmin[l]; \
+                if (vmax[l] > hi) hi = vmax[l]; \
+            } \
+        } \
+        for (; i < count; i ++) { \
+            int32_t pixel = 0; \
+            _Pragma("GCC unroll 16") \
+            for (int r = 0; r < dimension; r ++) { \
+                _Pragma("GCC unroll 16") \
+                for (int c = 0; c < dimension; c ++) { \
+                    pixel += src[r * stride + i + c] * taps[r * dimension + c]; \
+                } \
+            } \
+            dst[i] = pixel; \
+            if (pixel < lo) lo = pixel; \
+            if (pixel > hi) hi = pixel; \
+        } \
+        *min = lo; \
+        *max = hi; \
+    }
+
+DEFINE_TEMPLATE_ROW_KERNEL(i32_4, 4, int32_t, int32_t)
+DEFINE_TEMPLATE_ROW_KERNEL(i32_8, 8, int32_t, int32_t)
+DEFINE_TEMPLATE_ROW_KERNEL(u8_4, 4, uint8_t, int32_t)
+DEFINE_TEMPLATE_ROW_KERNEL(u8_8, 8, uint8_t, int32_t)
+DEFINE_TEMPLATE_ROW_KERNEL(u8_narrow_8, 8, uint8_t, int16_t)
+DEFINE_TEMPLATE_ROW_KERNEL(u8_narrow_16, 16, uint8_t, int16_t)
+
+#ifdef HAVE_X86_SIMD
+#define TARGET_SCALAR
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+// never selected, since cpu_isa stays ISA_SCALAR
+#define TARGET_SCALAR
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+/* Defines row kernel `name`, running template `body` for one instruction
+ * set with the given dimension and taps.
+ */
+#define TEMPLATE_KERNEL(name, target, pixel_t, body, dimension, taps) \
+    TARGET_##target \
+    static void name(const filter *f, const pixel_t *src, int32_t stride, \
+            int32_t *dst, int32_t count, int32_t *min, int32_t *max) \
+    { \
+        (void) f; \
+        template_row_kernel_##body(dimension, taps, src, stride, dst, count, \
+                min, max); \
+    }
+
+/* Every instruction set's variant of one kernel family, with the name
+ * prefix and the templates used for SCALAR, SSE41 and AVX2.
+ */
+#define TEMPLATE_KERNEL_FAMILY(prefix, pixel_t, scalar, sse41, avx2, \
+        dimension, taps) \
+    TEMPLATE_KERNEL(prefix##_scalar, SCALAR, pixel_t, scalar, dimension, taps) \
+    TEMPLATE_KERNEL(prefix##_sse41, SSE41, pixel_t, sse41, dimension, taps) \
+    TEMPLATE_KERNEL(prefix##_avx2, AVX2, pixel_t, avx2, dimension, taps)
+#define KERNEL_FAMILY(prefix) \
+    {prefix##_scalar, prefix##_sse41, prefix##_avx2}
+
+/* generic 8-bit kernels */
+TEMPLATE_KERNEL_FAMILY(generic_u8, uint8_t, u8_4, u8_4, u8_8,
+        f->dimension, f->matrix)
+TEMPLATE_KERNEL_FAMILY(generic_u8_narrow, uint8_t, u8_narrow_8, u8_narrow_8,
+        u8_narrow_16, f->dimension, f->matrix)
+static const row_kernel_u8 generic_u8_kernels[] = KERNEL_FAMILY(generic_u8);
+static const row_kernel_u8 generic_u8_narrow_kernels[] =
+    KERNEL_FAMILY(generic_u8_narrow);
+
+/*************** SEPARABLE TERM KERNELS ***********************/
+/* Kernels for filters whose plan (see create_filter_plan) splits them into
+ * a sum of separable terms. For every term, a vertical pass first combines
+ * the source rows into one row of column values, then a horizontal pass
+ * runs the term's row taps over it, so a term costs its nonzero column taps
+ * plus its nonzero row taps per pixel instead of dimension^2. The row is
+ * done in blocks of TERMS_BLOCK pixels so that the column values stay in L1.
+ * Everything is integer arithmetic on the exact decomposition, so the
+ * result is bit-identical to the direct 2D form.
+ */
+#define TERMS_BLOCK 128
+
+/* acc += pixels * tap, without the multiply for the common +-1 taps */
+#define ADD_TAP(acc, pixels, tap) \
+    do { \
+        if ((tap) == 1) (acc) += (pixels); \
+        else if ((tap) == -1) (acc) -= (pixels); \
+        else (acc) += (pixels) * (tap); \
+    } while (0)
+
+#define DEFINE_TERMS_ROW_KERNEL(suffix, lanes, pixel_t) \
+    typedef int32_t terms_vec_##suffix \
+        __attribute__((vector_size(4 * lanes), aligned(4), __may_alias__)); \
+    \
+    static inline __attribute__((always_inline)) \
+    void terms_row_kernel_##suffix(const filter *f, const pixel_t *src, \
+            int32_t stride, int32_t *dst, int32_t count, \
+            int32_t *min, int32_t *max) \
+    { \
+        const filter_plan *plan = f->plan; \
+        int32_t dimension = f->dimension; \
+        int32_t num_terms = plan->num_terms; \
+        int32_t columns[MAX_PLAN_TERMS][TERMS_BLOCK + MAX_PLAN_DIMENSION]; \
+        int32_t lo = *min; \
+        int32_t hi = *max; \
+        for (int32_t block = 0; block < count; block += TERMS_BLOCK) { \
+            int32_t n = count - block < TERMS_BLOCK \
+                ? count - block : TERMS_BLOCK; \
+            int32_t span = n + dimension - 1; \
+            const pixel_t *in = src + block; \
+            int32_t *out = dst + block; \
+            /* vertical pass: every term's column values */ \
+            for (int32_t t = 0; t < num_terms; t ++) { \
+                const int32_t *column_taps = plan->column_taps + t * dimension; \
+                int32_t *column = columns[t]; \
+                int32_t x = 0; \
+                for (; x + lanes <= span; x += lanes) { \
+                    terms_vec_##suffix acc = {0}; \
+                    for (int r = 0; r < dimension; r ++) { \
+                        if (column_taps[r] == 0) continue; \
+                        const pixel_t *p = in + r * stride + x; \
+                        terms_vec_##suffix pixels; \
+                        _Pragma("GCC unroll 16") \
+                        for (int l = 0; l < lanes; l ++) pixels[l] = p[l]; \
+                        ADD_TAP(acc, pixels, column_taps[r]); \
+                    } \
+                    *(terms_vec_##suffix *) (column + x) = acc; \
+                } \
+                for (; x < span; x ++) { \
+                    int32_t acc = 0; \
+                    for (int r = 0; r < dimension; r ++) { \
+                        acc += in[r * stride + x] * column_taps[r]; \
+                    } \
+                    column[x] = acc; \
+                } \
+            } \
+            /* horizontal pass: all the terms at once, in registers */ \
+            terms_vec_##suffix vmin = {0}; \
+            terms_vec_##suffix vmax = {0}; \
+            vmin += lo; \
+            vmax += hi; \
+            int32_t i = 0; \
+            for (; i + lanes <= n; i += lanes) { \
+                terms_vec_##suffix acc = {0}; \
+                for (int32_t t = 0; t < num_terms; t ++) { \
+                    const int32_t *row_taps = plan->row_taps + t * dimension; \
+                    for (int c = 0; c < dimension; c ++) { \
+                        if (row_taps[c] == 0) continue; \
+                        terms_vec_##suffix values = \
+                            *(const terms_vec_##suffix *) (columns[t] + i + c); \
+                        ADD_TAP(acc, values, row_taps[c]); \
+                    } \
+                } \
+                *(terms_vec_##suffix *) (out + i) = acc; \
+                terms_vec_##suffix lower = acc < vmin; \
+                vmin = (acc & lower) | (vmin & ~lower); \
+                terms_vec_##suffix higher = acc > vmax; \
+                vmax = (acc & higher) | (vmax & ~higher); \
+            } \
+            for (int l = 0; l < lanes; l ++) { \
+                if (vmin[l] < lo) lo = vmin[l]; \
+                if (vmax[l] > hi) hi = vmax[l]; \
+            } \
+            for (; i < n; i ++) { \
+                int32_t pixel = 0; \
+                for (int32_t t = 0; t < num_terms; t ++) { \
+                    const int32_t *row_taps = plan->row_taps + t * dimension; \
+                    for (int c = 0; c < dimension; c ++) { \
+                        pixel += columns[t][i + c] * row_taps[c]; \
+                    } \
+                } \
+                out[i] = pixel; \
+                if (pixel < lo) lo = pixel; \
+                if (pixel > hi) hi = pixel; \
+            } \
+        } \
+        *min = lo; \
+        *max = hi; \
+    }
+
+DEFINE_TERMS_ROW_KERNEL(i32_4, 4, int32_t)
+DEFINE_TERMS_ROW_KERNEL(i32_8, 8, int32_t)
+DEFINE_TERMS_ROW_KERNEL(u8_4, 4, uint8_t)
+DEFINE_TERMS_ROW_KERNEL(u8_8, 8, uint8_t)
+
+#define TERMS_KERNEL(name, target, pixel_t, body) \
+    TARGET_##target \
+    static void name(const filter *f, const pixel_t *src, int32_t stride, \
+            int32_t *dst, int32_t count, int32_t *min, int32_t *max) \
+    { \
+        terms_row_kernel_##body(f, src, stride, dst, count, min, max); \
+    }
+
+TERMS_KERNEL(terms_kernel_scalar, SCALAR, int32_t, i32_4)
+TERMS_KERNEL(terms_kernel_sse41, SSE41, int32_t, i32_4)
+TERMS_KERNEL(terms_kernel_avx2, AVX2, int32_t, i32_8)
+TERMS_KERNEL(terms_kernel_u8_scalar, SCALAR, uint8_t, u8_4)
+TERMS_KERNEL(terms_kernel_u8_sse41, SSE41, uint8_t, u8_4)
+TERMS_KERNEL(terms_kernel_u8_avx2, AVX2, uint8_t, u8_8)
+static const row_kernel terms_kernels[] = KERNEL_FAMILY(terms_kernel);
+static const row_kernel_u8 terms_u8_kernels[] = KERNEL_FAMILY(terms_kernel_u8);
+
+/*************** GROUPED TAP KERNELS ***********************/
+/* Kernels for filters whose plan groups their taps by value: the pixels
+ * under a group are added up first and multiplied by its weight once, so a
+ * pixel costs one add per nonzero tap but only one multiply per group
+ * (about a quarter of the taps for a filter symmetric about both axes).
+ * Sums are exact in two's complement, so the result is the same as the
+ * direct form's. The int16 accumulators are only used for narrow filters:
+ * a group's sum is bounded by its share of the bound fits_int16 checks.
+ */
+#define DEFINE_GROUPED_ROW_KERNEL(suffix, lanes, pixel_t, acc_t) \
+    typedef acc_t grouped_vec_##suffix \
+        __attribute__((vector_size(sizeof(acc_t) * lanes))); \
+    typedef int32_t grouped_out_##suffix \
+        __attribute__((vector_size(4 * lanes), aligned(4), __may_alias__)); \
+    \
+    static inline __attribute__((always_inline)) \
+    void grouped_row_kernel_##suffix(const filter *f, const pixel_t *src, \
+            int32_t stride, int32_t *dst, int32_t count, \
+            int32_t *min, int32_t *max) \
+    { \
+        const filter_plan *plan = f->plan; \
+        int32_t num_groups = plan->num_groups; \
+        const int32_t *starts = plan->group_starts; \
+        const int32_t *rows = plan->tap_rows; \
+        const int32_t *cols = plan->tap_cols; \
+        grouped_vec_##suffix vmin = {0}; \
+        grouped_vec_##suffix vmax = {0}; \
+        vmin += (acc_t) ((1ull << (8 * sizeof(acc_t) - 1)) - 1); \
+        vmax -= (acc_t) ((1ull << (8 * sizeof(acc_t) - 1)) - 1); \
+        vmax -= 1; \
+        int32_t lo = *min; \
+        int32_t hi = *max; \
+        int32_t i = 0; \
+        for (; i + lanes <= count; i += lanes) { \
+            grouped_vec_##suffix acc = {0}; \
+            for (int32_t g = 0; g < num_groups; g ++) { \
+                grouped_vec_##suffix sum = {0}; \
+                for (int32_t k = starts[g]; k < starts[g + 1]; k ++) { \
+                    const pixel_t *p = src + i + rows[k] * stride + cols[k]; \
+                    grouped_vec_##suffix pixels; \
+                    _Pragma("GCC unroll 16") \
+                    for (int l = 0; l < lanes; l ++) pixels[l] = p[l]; \
+                    sum += pixels; \
+                } \
+                ADD_TAP(acc, sum, (acc_t) plan->group_taps[g]); \
+            } \
+            *(grouped_out_##suffix *) (dst + i) = \
+                __builtin_convertvector(acc, grouped_out_##suffix); \
+            grouped_vec_##suffix lower = acc < vmin; \
+            vmin = (acc & lower) | (vmin & ~lower); \
+            grouped_vec_##suffix higher = acc > vmax; \
+            vmax = (acc & higher) | (vmax & ~higher); \
+        } \
+        if (i > 0) { \
+            for (int l = 0; l < lanes; l ++) { \
+                if (vmin[l] < lo) lo = vmin[l]; \
+                if (vmax[l] > hi) hi = vmax[l]; \
+            } \
+        } \
+        for (; i < count; i ++) { \
+            int32_t pixel = 0; \
+            for (int32_t g = 0; g < num_groups; g ++) { \
+                int32_t sum = 0; \
+                for (int32_t k = starts[g]; k < starts[g + 1]; k ++) { \
+                    sum += src[i + rows[k] * stride + cols[k]]; \
+                } \
+                pixel += sum * plan->group_taps[g]; \
+            } \
+            dst[i] = pixel; \
+            if (pixel < lo) lo = pixel; \
+            if (pixel > hi) hi = pixel; \
+        } \
+        *min = lo; \
+        *max = hi; \
+    }
+
+DEFINE_GROUPED_ROW_KERNEL(i32_4, 4, int32_t, int32_t)
+DEFINE_GROUPED_ROW_KERNEL(i32_8, 8, int32_t, int32_t)
+DEFINE_GROUPED_ROW_KERNEL(u8_4, 4, uint8_t, int32_t)
+DEFINE_GROUPED_ROW_KERNEL(u8_8, 8, uint8_t, int32_t)
+DEFINE_GROUPED_ROW_KERNEL(u8_narrow_8, 8, uint8_t, int16_t)
+DEFINE_GROUPED_ROW_KERNEL(u8_narrow_16, 16, uint8_t, int16_t)
+
+#define GROUPED_KERNEL(name, target, pixel_t, body) \
+    TARGET_##target \
+    static void name(const filter *f, const pixel_t *src, int32_t stride, \
+            int32_t *dst, int32_t count, int32_t *min, int32_t *max) \
+    { \
+        grouped_row_kernel_##body(f, src, stride, dst, count, min, max); \
+    }
+
+// with int32_t pixels, only the scalar level gains from grouping: the
+// generic SSE4.1 and AVX2 kernels are bound by their loads, not their
+// multiplies
+GROUPED_KERNEL(grouped_kernel_scalar, SCALAR, int32_t, i32_4)
+GROUPED_KERNEL(grouped_kernel_u8_scalar, SCALAR, uint8_t, u8_4)
+GROUPED_KERNEL(grouped_kernel_u8_sse41, SSE41, uint8_t, u8_4)
+GROUPED_KERNEL(grouped_kernel_u8_avx2, AVX2, uint8_t, u8_8)
+GROUPED_KERNEL(grouped_kernel_u8_narrow_scalar, SCALAR, uint8_t, u8_narrow_8)
+GROUPED_KERNEL(grouped_kernel_u8_narrow_sse41, SSE41, uint8_t, u8_narrow_8)
+GROUPED_KERNEL(grouped_kernel_u8_narrow_avx2, AVX2, uint8_t, u8_narrow_16)
+static const row_kernel_u8 grouped_u8_kernels[] =
+    KERNEL_FAMILY(grouped_kernel_u8);
+static const row_kernel_u8 grouped_u8_narrow_kernels[] =
+    KERNEL_FAMILY(grouped_kernel_u8_narrow);
+
+/*************** FILTER PLANS ***********************/
+static int fits_int16(const filter *f);
+static int32_t fixed_kernel_index(const filter *f);
+
+static int32_t gcd(int32_t a, int32_t b)
+{
+    while (b != 0) {
+        int32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Splits matrix - offset into separable terms, one per distinct row shape:
+ * each nonzero row is k times a primitive row (its entries divided by their
+ * gcd, first one positive), and rows with the same primitive row share a
+ * term, k going to the term's column taps. A nonzero offset adds a first
+ * term for the constant part, offset times a box. Returns the number of
+ * terms written to column_taps and row_taps (dimension + 1 at most).
+ */
+static int32_t split_rows(const int8_t *matrix, int32_t dimension,
+        int32_t offset, int32_t *column_taps, int32_t *row_taps)
+{
+    int32_t num_terms = 0;
+    size_t term_size = dimension * sizeof(int32_t);
+    if (offset != 0) {
+        for (int32_t i = 0; i < dimension; i ++) {
+            column_taps[i] = offset;
+            row_taps[i] = 1;
+        }
+        num_terms = 1;
+    }
+    int32_t first_row_term = num_terms;
+    int32_t shape[dimension];
+    for (int32_t r = 0; r < dimension; r ++) {
+        int32_t k = 0;
+        for (int32_t c = 0; c < dimension; c ++) {
+            int32_t w = matrix[r * dimension + c] - offset;
+            k = gcd(abs(w), k);
+            shape[c] = w;
+        }
+        if (k == 0) continue; // all zero
+        for (int32_t c = 0; c < dimension; c ++) {
+            if (shape[c] != 0) {
+                if (shape[c] < 0) k = -k;
+                break;
+            }
+        }
+        for (int32_t c = 0; c < dimension; c ++) shape[c] /= k;
+
+        int32_t t = first_row_term;
+        while (t < num_terms &&
+                memcmp(row_taps + t * dimension, shape, term_size) != 0) {
+            t ++;
+        }
+        if (t == num_terms) { // a new shape
+            memset(column_taps + t * dimension, 0, term_size);
+            memcpy(row_taps + t * dimension, shape, term_size);
+            num_terms ++;
+        }
+        column_taps[t * dimension + r] = k;
+    }
+    return num_terms;
+}
+
+/* Multiply-adds per pixel of a split, and whether its partial sums over
+ * 8-bit pixels are sure to fit an int32_t.
+ */
+static int32_t split_cost(const int32_t *column_taps, const int32_t *row_taps,
+        int32_t num_terms, int32_t dimension, int *fits)
+{
+    int32_t cost = 0;
+    int64_t bound = 0;
+    for (int32_t t = 0; t < num_terms * dimension; t += dimension) {
+        int64_t column_sum = 0;
+        int64_t row_sum = 0;
+        for (int32_t i = 0; i < dimension; i ++) {
+            cost += (column_taps[t + i] != 0) + (row_taps[t + i] != 0);
+            column_sum += abs(column_taps[t + i]);
+            row_sum += abs(row_taps[t + i]);
+        }
+        bound += 255 * column_sum * row_sum;
+    }
+    *fits = bound <= INT32_MAX;
+    return cost;
+}
+
+/* Symmetries of the dimension x dimension matrix, as MIRROR_* flags */
+static int32_t find_symmetry(const int8_t *matrix, int32_t dimension)
+{
+    int32_t symmetry = MIRROR_COLUMNS | MIRROR_ROWS | MIRROR_DIAGONAL;
+    for (int32_t r = 0; r < dimension; r ++) {
+        for (int32_t c = 0; c < dimension; c ++) {
+            int8_t w = matrix[r * dimension + c];
+            if (w != matrix[(dimension - 1 - r) * dimension + c]) {
+                symmetry &= ~MIRROR_COLUMNS;
+            }
+            if (w != matrix[r * dimension + dimension - 1 - c]) {
+                symmetry &= ~MIRROR_ROWS;
+            }
+            if (w != matrix[c * dimension + r]) symmetry &= ~MIRROR_DIAGONAL;
+        }
+    }
+    return symmetry;
+}
+
+/* Groups the nonzero taps of f by value into plan, if there are at most
+ * half as many groups as taps. Returns -1 if out of memory.
+ */
+static int32_t group_taps(const filter *f, filter_plan *plan)
+{
+    int32_t taps = f->dimension * f->dimension;
+    int32_t count[256] = {0};
+    int32_t num_groups = 0;
+    for (int32_t i = 0; i < taps; i ++) {
+        if (f->matrix[i] != 0 && count[f->matrix[i] + 128] ++ == 0) {
+            num_groups ++;
+        }
+    }
+    if (num_groups == 0 || 2 * num_groups > plan->nonzero_taps) return 0;
+
+    plan->group_taps = (int32_t *) malloc(
+            (2 * num_groups + 1 + 2 * plan->nonzero_taps) * sizeof(int32_t));
+    if (plan->group_taps == NULL) return -1;
+    plan->group_starts = plan->group_taps + num_groups;
+    plan->tap_rows = plan->group_starts + num_groups + 1;
+    plan->tap_cols = plan->tap_rows + plan->nonzero_taps;
+    plan->num_groups = num_groups;
+
+    // groups in tap order, their taps in position order
+    int32_t g = 0;
+    int32_t next = 0;
+    for (int32_t v = 0; v < 256; v ++) {
+        if (count[v] == 0 || v == 128) continue;
+        plan->group_taps[g] = v - 128;
+        plan->group_starts[g] = next;
+        for (int32_t i = 0; i < taps; i ++) {
+            if (f->matrix[i] != v - 128) continue;
+            plan->tap_rows[next] = i / f->dimension;
+            plan->tap_cols[next ++] = i % f->dimension;
+        }
+        g ++;
+    }
+    plan->group_starts[num_groups] = next;
+    return 0;
+}
+
+filter_plan *create_filter_plan(const filter *f)
+{
+    int32_t dimension = f->dimension;
+    int32_t taps = dimension * dimension;
+    filter_plan *plan = (filter_plan *) calloc(1, sizeof(filter_plan));
+    if (plan == NULL) return NULL;
+
+    // what the dispatch needs, whatever the dimension
+    for (int32_t i = 0; i < taps; i ++) {
+        plan->nonzero_taps += f->matrix[i] != 0;
+        if (abs(f->matrix[i]) > plan->largest_tap) {
+            plan->largest_tap = abs(f->matrix[i]);
+        }
+    }
+    plan->symmetry = find_symmetry(f->matrix, dimension);
+    plan->narrow = fits_int16(f);
+    plan->fixed = fixed_kernel_index(f);
+    if (dimension > MAX_PLAN_DIMENSION) {
+        if (group_taps(f, plan) != 0) {
+            destroy_filter_plan(plan);
+            return NULL;
+        }
+        return plan;
+    }
+
+    // the direct form costs one multiply-add per nonzero tap
+    int32_t best_cost = plan->nonzero_taps;
+
+    // the most frequent tap, taken out as a box term when it is not zero
+    int32_t most_frequent = 0;
+    int32_t most_count = 0;
+    for (int32_t i = 0; i < taps; i ++) {
+        int32_t n = 0;
+        for (int32_t j = 0; j < taps; j ++) n += f->matrix[j] == f->matrix[i];
+        if (n > most_count) {
+            most_count = n;
+            most_frequent = f->matrix[i];
+        }
+    }
+
+    int32_t max_terms = dimension + 1;
+    int32_t *column_taps = (int32_t *) malloc(
+            2 * max_terms * dimension * sizeof(int32_t));
+    if (column_taps == NULL) {
+        destroy_filter_plan(plan);
+        return NULL;
+    }
+    int32_t *row_taps = column_taps + max_terms * dimension;
+
+    int32_t offsets[2] = {0, most_frequent};
+    for (int v = 0; v < 2; v ++) {
+        if (v == 1 && most_frequent == 0) break;
+        int32_t num_terms = split_rows(f->matrix, dimension, offsets[v],
+                column_taps, row_taps);
+        int fits;
+        int32_t cost = split_cost(column_taps, row_taps, num_terms, dimension,
+                &fits);
+        if (!fits || cost >= best_cost || num_terms > MAX_PLAN_TERMS) continue;
+
+        best_cost = cost;
+        free(plan->column_taps);
+        plan->num_terms = num_terms;
+        plan->terms_cost = cost;
+        plan->column_taps = (int32_t *) malloc(
+                2 * num_terms * dimension * sizeof(int32_t));
+        if (plan->column_taps == NULL) {
+            plan->num_terms = 0;
+            break;
+        }
+        plan->row_taps = plan->column_taps + num_terms * dimension;
+        memcpy(plan->column_taps, column_taps,
+                num_terms * dimension * sizeof(int32_t));
+        memcpy(plan->row_taps, row_taps,
+                num_terms * dimension * sizeof(int32_t));
+    }
+    free(column_taps);
+
+    if (plan->num_terms == 0 && group_taps(f, plan) != 0) {
+        destroy_filter_plan(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+void destroy_filter_plan(filter_plan *plan)
+{
+    if (plan == NULL) return;
+    free(plan->column_taps);
+    free(plan->group_taps);
+    free(plan);
+}
+
+/*************** SPECIALIZED KERNELS ***********************/
+/* Kernels for the filters in filters.def, with the coefficients folded in */
+#define BUILTIN_FILTER(name, dim, ...) \
+    static const int8_t name##_taps[] = {__VA_ARGS__}; \
+    TEMPLATE_KERNEL_FAMILY(name##_kernel, int32_t, i32_4, i32_4, i32_8, \
+            dim, name##_taps) \
+    TEMPLATE_KERNEL_FAMILY(name##_kernel_u8, uint8_t, u8_4, u8_4, u8_8, \
+            dim, name##_taps) \
+    TEMPLATE_KERNEL_FAMILY(name##_kernel_u8_narrow, uint8_t, u8_narrow_8, \
+            u8_narrow_8, u8_narrow_16, dim, name##_taps)
+#include "filters.def"
+#undef BUILTIN_FILTER
+
+typedef struct fixed_kernel_t
+{
+    int32_t dimension;
+    const int8_t *taps;
+    // all indexed by kernel_isa
+    row_kernel kernels[ISA_AVX2 + 1];
+    row_kernel_u8 kernels_u8[ISA_AVX2 + 1];
+    row_kernel_u8 kernels_u8_narrow[ISA_AVX2 + 1];
+} fixed_kernel;
+
+static const fixed_kernel fixed_kernels[] =
+    {
+#define BUILTIN_FILTER(name, dim, ...) \
+        {dim, name##_taps, KERNEL_FAMILY(name##_kernel), \
+            KERNEL_FAMILY(name##_kernel_u8), \
+            KERNEL_FAMILY(name##_kernel_u8_narrow)},
+#include "filters.def"
+#undef BUILTIN_FILTER
+    };
+
+/*************** DISPATCH ***********************/
+/* The index in fixed_kernels of the entry matching f's coefficients, -1 if
+ * none. Any filter with the same coefficients as one in filters.def gets
+ * its specialized kernels, whether or not it is the builtin filter itself.
+ */
+static int32_t fixed_kernel_index(const filter *f)
+{
+    int32_t n = sizeof(fixed_kernels) / sizeof(fixed_kernels[0]);
+    for (int32_t k = 0; k < n; k ++) {
+        if (fixed_kernels[k].dimension == f->dimension &&
+                memcmp(fixed_kernels[k].taps, f->matrix,
+                    f->dimension * f->dimension) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/* Whether every partial sum of f over 8-bit pixels fits an int16 */
+static int fits_int16(const filter *f)
+{
+    int32_t bound = 0;
+    for (int32_t i = 0; i < f->dimension * f->dimension; i ++) {
+        bound += abs(f->matrix[i]) * 255;
+    }
+    return bound <= INT16_MAX;
+}
+
+/* Whether the int32_t pixels of f are best filtered by its separable
+ * terms. The generic vector kernels are fast enough that the terms, with
+ * their extra passes, only beat them at half the taps or fewer.
+ */
+static int use_terms(const filter_plan *plan)
+{
+    return plan != NULL && plan->num_terms > 0 && (cpu_isa == ISA_SCALAR ||
+            2 * plan->terms_cost <= plan->nonzero_taps);
+}
+
+row_kernel select_row_kernel(const filter *f)
+{
+    const filter_plan *plan = f->plan;
+    // the fixed kernels have their taps folded in at compile time, which
+    // beats the runtime taps of the other kernels even on fewer operations
+    int32_t fixed = plan != NULL ? plan->fixed : fixed_kernel_index(f);
+    if (fixed >= 0) return fixed_kernels[fixed].kernels[cpu_isa];
+    if (use_terms(plan)) return terms_kernels[cpu_isa];
+    if (plan != NULL && plan->num_groups > 0 && cpu_isa == ISA_SCALAR) {
+        return grouped_kernel_scalar;
+    }
+    return select_generic_row_kernel();
+}
+
+row_kernel_u8 select_row_kernel_u8(const filter *f)
+{
+    const filter_plan *plan = f->plan;
+    int32_t fixed = plan != NULL ? plan->fixed : fixed_kernel_index(f);
+    int narrow = plan != NULL ? plan->narrow : fits_int16(f);
+    if (fixed >= 0) {
+        return narrow ? fixed_kernels[fixed].kernels_u8_narrow[cpu_isa]
+                      : fixed_kernels[fixed].kernels_u8[cpu_isa];
+    }
+    if (plan != NULL && plan->num_terms > 0) return terms_u8_kernels[cpu_isa];
+    if (plan != NULL && plan->num_groups > 0) {
+        return narrow ? grouped_u8_narrow_kernels[cpu_isa]
+                      : grouped_u8_kernels[cpu_isa];
+    }
+    return narrow ? generic_u8_narrow_kernels[cpu_isa]
+                  : generic_u8_kernels[cpu_isa];
+}
+
+int32_t row_kernel_cost(const filter *f)
+{
+    const filter_plan *plan = f->plan;
+    if (use_terms(plan)) return plan->terms_cost;
+    if (plan != NULL) return plan->nonzero_taps;
+    int32_t cost = 0;
+    for (int32_t i = 0; i < f->dimension * f->dimension; i ++) {
+        cost += f->matrix[i] != 0;
+    }
+    return cost;
+}
@@ -0,0 +1,130 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __KERNELS__H
+#define __KERNELS__H
+
+#include "filters.h"
+#include <stdint.h>
+
+/**************ROW KERNELS*****************/
+/* A row kernel filters `count` adjacent output pixels of one row whose whole
+ * neighbourhood lies inside the source image (no clipping is done).
+ * arguments: f - the filter to be used.
+ *            src - the top left corner of the neighbourhood of the first
+ *                  output pixel, i.e. the source pixel at
+ *                  (row - dimension/2, column - dimension/2).
+ *            stride - distance between two source rows, in pixels.
+ *            dst - where the first output pixel is stored.
+ *            count - number of output pixels.
+ *            min, max - running min and max, updated with every output pixel.
+ */
+typedef void (*row_kernel)(const filter *f, const int32_t *src, int32_t stride,
+        int32_t *dst, int32_t count, int32_t *min, int32_t *max);
+
+/* Same as row_kernel, reading 8-bit source pixels */
+typedef void (*row_kernel_u8)(const filter *f, const uint8_t *src,
+        int32_t stride, int32_t *dst, int32_t count, int32_t *min, int32_t *max);
+
+/**************FILTER PLANS*****************/
+/* Largest filter dimension a plan tries to split into separable terms */
+#define MAX_PLAN_DIMENSION 32
+/* Most separable terms a plan is made of */
+#define MAX_PLAN_TERMS 8
+
+/* Symmetries of a filter, as flags */
+#define MIRROR_COLUMNS 1   /* row r equals row dimension - 1 - r */
+#define MIRROR_ROWS 2      /* every row reads the same backwards */
+#define MIRROR_DIAGONAL 4  /* equal to its transpose */
+
+/* How a registered filter is computed, worked out once by
+ * create_filter_plan:
+ * - the exact sum of num_terms separable terms, term t being the outer
+ *   product of column_taps[t] (one weight per source row) and row_taps[t]
+ *   (one weight per column), both dimension long. num_terms is 0 when the
+ *   direct 2D form is cheaper.
+ * - otherwise, when enough taps share a value (as the mirrored taps of a
+ *   symmetric filter do), num_groups groups of equal nonzero taps: group g
+ *   has weight group_taps[g] and the taps k from group_starts[g] to
+ *   group_starts[g + 1] - 1, tap k being at row tap_rows[k] and column
+ *   tap_cols[k] of the filter.
+ *   num_groups is 0 when grouping does not pay.
+ * - what the dispatch needs to know about the filter.
+ */
+typedef struct filter_plan_t
+{
+    int32_t num_terms;
+    int32_t *column_taps;
+    int32_t *row_taps;
+    int32_t terms_cost;    // multiply-adds per pixel of the terms
+
+    int32_t num_groups;
+    int32_t *group_taps;
+    int32_t *group_starts;
+    int32_t *tap_rows;
+    int32_t *tap_cols;
+
+    int32_t nonzero_taps;
+    int32_t symmetry;      // MIRROR_* flags
+    int32_t largest_tap;   // largest magnitude of a tap
+    int32_t narrow;        // sums over 8-bit pixels fit an int16 accumulator
+    int32_t fixed;         // index of its filters.def kernels, -1 if none
+} filter_plan;
+
+/* Works out the plan of f: splits it into separable terms, one per distinct
+ * row shape (so a separable filter is a single term), optionally after
+ * taking its most frequent tap out as a box term (so a box plus a delta is
+ * two terms), and keeps the split only if it takes fewer multiply-adds per
+ * pixel than the nonzero taps of the direct form. Filters that do not
+ * split get their taps grouped by value instead, when that at least halves
+ * the multiplies. Returns NULL if out of memory.
+ */
+filter_plan *create_filter_plan(const filter *f);
+void destroy_filter_plan(filter_plan *plan);
+
+/* Instruction sets the kernels can be built for, from slowest to fastest */
+typedef enum
+{
+    ISA_SCALAR,
+    ISA_SSE41,
+    ISA_AVX2
+} kernel_isa;
+
+/* The best instruction set supported by this cpu. Detected once at startup
+ * through cpuid; can be lowered with the FILTER_ISA environment variable
+ * (scalar, sse4.1 or avx2), which is useful to compare kernels.
+ */
+kernel_isa detected_isa(void);
+
+/* Returns the fastest row kernel for f on this cpu: a kernel specialized at
+ * compile time when f matches one of the filters in filters.def, otherwise
+ * the separable term kernel when f's plan has terms (and, with vector
+ * instructions, they take at most half the taps), the grouped tap kernel
+ * when it has groups and the cpu has no usable vector instructions, a
+ * generic one otherwise. Registered filters have the analysis this needs
+ * worked out once, in their plan.
+ */
+row_kernel select_row_kernel(const filter *f);
+
+/* Same as select_row_kernel, for 8-bit source pixels. The generic 8-bit
+ * kernels are the slowest ones, so the term and grouped kernels are used
+ * whenever the plan has them.
+ */
+row_kernel_u8 select_row_kernel_u8(const filter *f);
+
+/* Multiply-adds per output pixel of the kernels picked for f: the nonzero
+ * taps, or the taps of its plan's terms.
+ */
+int32_t row_kernel_cost(const filter *f);
+#endif
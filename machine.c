@@ -0,0 +1,82 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "machine.h"
+#include "kernels.h"
+#include "tiles.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+const int32_t work_chunks[NUM_WORK_CHUNKS] = {8, 16, 32, 64, 128, 256};
+
+double now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+void machine_key(int32_t *isa, int32_t *cores, size_t *l1, size_t *l2)
+{
+    *isa = detected_isa();
+    *cores = sysconf(_SC_NPROCESSORS_ONLN);
+    *l1 = data_cache_size(1);
+    *l2 = data_cache_size(2);
+}
+
+const char *machine_file_path(const char *env, const char *name, char *path,
+        size_t size)
+{
+    const char *forced = getenv(env);
+    if (forced != NULL) return forced[0] != '\0' ? forced : NULL;
+    const char *home = getenv("HOME");
+    if (home == NULL) return NULL;
+    snprintf(path, size, "%s/%s", home, name);
+    return path;
+}
+
+int read_machine_header(FILE *file, int32_t version)
+{
+    int32_t file_version, isa, cores, our_isa, our_cores;
+    size_t l1, l2, our_l1, our_l2;
+    int read = fscanf(file, "version %d isa %d cores %d l1 %zu l2 %zu",
+            &file_version, &isa, &cores, &l1, &l2);
+    machine_key(&our_isa, &our_cores, &our_l1, &our_l2);
+    return read == 5 && file_version == version && isa == our_isa &&
+        cores == our_cores && l1 == our_l1 && l2 == our_l2 ? 0 : -1;
+}
+
+FILE *begin_machine_file(const char *path, int32_t version, char *temporary,
+        size_t size)
+{
+    // one temporary file per process, so that two runs writing at once
+    // cannot interleave their lines
+    int length = snprintf(temporary, size, "%s.%ld.tmp", path,
+            (long) getpid());
+    if (length < 0 || length >= (int) size) return NULL;
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) return NULL;
+    int32_t isa, cores;
+    size_t l1, l2;
+    machine_key(&isa, &cores, &l1, &l2);
+    fprintf(file, "version %d isa %d cores %d l1 %zu l2 %zu\n", version, isa,
+            cores, l1, l2);
+    return file;
+}
+
+void end_machine_file(FILE *file, const char *temporary, const char *path)
+{
+    if (fclose(file) != 0 || rename(temporary, path) != 0) remove(temporary);
+}
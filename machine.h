@@ -0,0 +1,63 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __MACHINE__H
+#define __MACHINE__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**************MACHINE FILES*****************/
+/* What the cost model cache (see method_model.h) and the autotune profile
+ * (see autotune.h) share: the clock their trials are timed with, the chunk
+ * sizes they try, and how their files are found, tied to the machine they
+ * were measured on, and replaced.
+ */
+
+/* CLOCK_MONOTONIC, in ns */
+double now_ns(void);
+
+/* Chunk sizes tried for WORK_QUEUE and WORK_STEALING */
+#define NUM_WORK_CHUNKS 6
+extern const int32_t work_chunks[NUM_WORK_CHUNKS];
+
+/* What a machine file must match to be used: the machine it was made on */
+void machine_key(int32_t *isa, int32_t *cores, size_t *l1, size_t *l2);
+
+/* Path of a machine file: the one environment variable env names (none if
+ * it is empty), otherwise name in the home directory. Returns NULL if
+ * there is none, otherwise the path, possibly written to path.
+ */
+const char *machine_file_path(const char *env, const char *name, char *path,
+        size_t size);
+
+/* Reads the header of a machine file. Returns 0 if it was written with
+ * this version of the format on this machine.
+ */
+int read_machine_header(FILE *file, int32_t version);
+
+/* Starts writing the machine file at path: opens a temporary file next to
+ * it, of this process only, written to temporary, and writes the header.
+ * Returns NULL if it cannot.
+ */
+FILE *begin_machine_file(const char *path, int32_t version, char *temporary,
+        size_t size);
+
+/* Closes file and puts it in place of path, so that a run reading path
+ * meanwhile never sees half of it. Writing is best effort: the temporary
+ * file is dropped if it could not be written.
+ */
+void end_machine_file(FILE *file, const char *temporary, const char *path);
+#endif
@@ -14,11 +14,19 @@
 
 #include "pgm.h"
 #include "filters.h"
+#include "batch.h"
+#include "filter_file.h"
+#include "method_model.h"
+#include "autotune.h"
+#include "affinity.h"
+#include "counters.h"
+#include "trace.h"
 #include "very_big_sample.h"
 #include "very_tall_sample.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -30,6 +38,16 @@
 #define SHARDED_COLUMNS_COLUMN_MAJOR_METHOD 3
 #define SHARDED_COLUMNS_ROW_MAJOR_METHOD 4
 #define WORK_QUEUE_METHOD 5
+#define WORK_STEALING_METHOD 6
+// -m auto: picked per image by choose_method
+#define AUTO_METHOD 7
+
+/* Most filters in a -f chain */
+#define MAX_CHAIN 16
+
+/* Filter number of the filter given with -k */
+#define CUSTOM_FILTER (NUM_FILTERS + 1)
+filter custom_filter;
 
 void print_error_arguments()
 {
@@ -38,9 +56,343 @@ void print_error_arguments()
 
 filter* get_filter(int filter)
 {
+    if (filter == CUSTOM_FILTER)
+    {
+        return &custom_filter;
+    }
     return builtin_filters[filter - 1];
 }
 
+/* Loads the -k filter, from a file if spec names one, otherwise from the
+ * taps spec lists (see filter_file.h). Returns NO_ERR on success.
+ */
+int32_t load_custom_filter(const char *spec)
+{
+    int32_t err = load_filter_from_file(spec, &custom_filter);
+    if (err == ERR_NO_FILE)
+    {
+        err = parse_filter(spec, &custom_filter);
+    }
+    if (err != NO_ERR)
+    {
+        printf("error loading filter (%d)\n", err);
+    }
+    return err;
+}
+
+/* Gives a hardcoded sample an 8-bit copy of its pixels */
+void narrow_pgm_image(pgm_image *image)
+{
+    int32_t size = image->width * image->height;
+    image->pixels = (uint8_t *) malloc(size);
+    if (image->pixels == NULL)
+    {
+        printf("error allocating the 8-bit image\n");
+        exit(1);
+    }
+    for (int32_t i = 0; i < size; i++)
+    {
+        image->pixels[i] = image->matrix[i];
+    }
+}
+
+/* Callbacks of apply_filter2d_stream on pgm_file rows */
+int32_t read_stream_rows(void *context, int32_t row, int32_t count,
+        uint8_t *rows)
+{
+    return read_pgm_rows((pgm_file *) context, row, count, rows);
+}
+
+int32_t write_stream_rows(void *context, const uint8_t *rows, int32_t count)
+{
+    return write_pgm_rows((pgm_file *) context, rows, count);
+}
+
+/* Filters source_file into target_file in bands of band_height rows,
+ * without ever holding either image whole, pipelined on nthreads workers
+ * unless nthreads is 0. Returns the time spent, I/O included, or a
+ * negative value on error.
+ */
+double run_streaming(const filter *f, const char *source_file,
+        const char *target_file, int32_t band_height, int32_t nthreads)
+{
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pgm_image header;
+    pgm_file source, target;
+    init_pgm_image(&header);
+    int err = open_pgm_rows(source_file, &header, &source);
+    if (err != NO_ERR)
+    {
+        printf("error loading file (%d)\n", err);
+        return -1;
+    }
+    err = create_pgm_rows(target_file, &header, &target);
+    if (err != NO_ERR)
+    {
+        printf("error saving file (%d)\n", err);
+        close_pgm_rows(&source);
+        return -1;
+    }
+
+    if (nthreads == 0)
+    {
+        err = apply_filter2d_stream(f, header.width, header.height,
+                band_height, read_stream_rows, &source, write_stream_rows,
+                &target);
+    }
+    else
+    {
+        filter_pool *pool = create_filter_pool(nthreads);
+        err = pool == NULL ? -1 : apply_filter2d_stream_pool(pool, f,
+                header.width, header.height, band_height, read_stream_rows,
+                &source, write_stream_rows, &target);
+        if (pool != NULL) destroy_filter_pool(pool);
+    }
+    close_pgm_rows(&source);
+    if (close_pgm_rows(&target) != NO_ERR || err != 0)
+    {
+        printf("error streaming the image\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return (stop.tv_sec - start.tv_sec)
+        + (double)(stop.tv_nsec - start.tv_nsec) / 1000000000;
+}
+
+/* Parses a comma-separated list of filter numbers into chain. Returns the
+ * number of filters, or 0 if the list is invalid.
+ */
+int32_t parse_filter_chain(const char *list, int32_t *chain)
+{
+    int32_t count = 0;
+    while (count < MAX_CHAIN)
+    {
+        char *end;
+        long filter = strtol(list, &end, 10);
+        if (end == list || filter < 1 || filter > NUM_FILTERS)
+        {
+            return 0;
+        }
+        chain[count++] = filter;
+        if (*end == '\0')
+        {
+            return count;
+        }
+        if (*end != ',')
+        {
+            return 0;
+        }
+        list = end + 1;
+    }
+    return 0;
+}
+
+/* Runs the filters numbered in chain one after the other */
+void run_chain(const int32_t *chain, int32_t num_chained,
+        const pgm_image *source, pgm_image *target)
+{
+    const filter *filters[MAX_CHAIN];
+    for (int32_t i = 0; i < num_chained; i++)
+    {
+        filters[i] = get_filter(chain[i]);
+    }
+    apply_filter2d_chain(filters, num_chained, source->matrix, target->matrix,
+            source->width, source->height);
+}
+
+/* The parallel_method of a threaded method number */
+parallel_method method_of(int32_t method)
+{
+    switch (method)
+    {
+        case SHARDED_COLUMNS_COLUMN_MAJOR_METHOD:
+            return SHARDED_COLUMNS_COLUMN_MAJOR;
+        case SHARDED_COLUMNS_ROW_MAJOR_METHOD:
+            return SHARDED_COLUMNS_ROW_MAJOR;
+        case WORK_QUEUE_METHOD:
+            return WORK_QUEUE;
+        case WORK_STEALING_METHOD:
+            return WORK_STEALING;
+        default:
+            return SHARDED_ROWS;
+    }
+}
+
+/* The method number of a parallel_method */
+int32_t method_number(parallel_method method)
+{
+    switch (method)
+    {
+        case SHARDED_COLUMNS_COLUMN_MAJOR:
+            return SHARDED_COLUMNS_COLUMN_MAJOR_METHOD;
+        case SHARDED_COLUMNS_ROW_MAJOR:
+            return SHARDED_COLUMNS_ROW_MAJOR_METHOD;
+        case WORK_QUEUE:
+            return WORK_QUEUE_METHOD;
+        case WORK_STEALING:
+            return WORK_STEALING_METHOD;
+        default:
+            return SHARDED_ROWS_METHOD;
+    }
+}
+
+/* Most threads -m auto may use: -n if given, otherwise one per core */
+int32_t auto_thread_limit(int32_t nthreads)
+{
+    return nthreads > 0 ? nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* Whether method still needs a number of threads or a chunk size */
+int missing_settings(int32_t method, int32_t nthreads, int32_t chunk_size)
+{
+    if (method == SEQUENTIAL_METHOD || method == AUTO_METHOD)
+    {
+        return 0;
+    }
+    return nthreads == 0 || (method == WORK_QUEUE_METHOD && chunk_size == 0);
+}
+
+/* Writes the counters to file, if counting. Returns 1 on error. */
+int save_counters(const char *file)
+{
+    if (file == NULL)
+    {
+        return 0;
+    }
+    if (write_counters(file) != 0)
+    {
+        printf("error saving counters to %s\n", file);
+        return 1;
+    }
+    return 0;
+}
+
+/* Writes the trace to file, if asked for. Returns 1 on error. */
+int save_trace(const char *file)
+{
+    if (file == NULL)
+    {
+        return 0;
+    }
+    if (write_trace(file) != 0)
+    {
+        printf("error saving the trace to %s (built without TRACE=1?)\n",
+                file);
+        return 1;
+    }
+    return 0;
+}
+
+/* Filters a whole batch of images into target_dir, see run_batch */
+int run_batch_mode(const filter *f, const char *batch_source,
+        const char *target_dir, int32_t nthreads, parallel_method method,
+        int32_t chunk_size, int32_t print_time)
+{
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int32_t images;
+    int32_t failures = run_batch(f, batch_source, target_dir, nthreads,
+            method, chunk_size, &images);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (failures < 0)
+    {
+        printf("error listing %s\n", batch_source);
+        return 1;
+    }
+
+    double time = (stop.tv_sec - start.tv_sec)
+        + (double)(stop.tv_nsec - start.tv_nsec) / 1000000000;
+    if (print_time)
+    {
+        printf("time=%.2lf\n", time);
+        printf("images=%d images/s=%.1lf\n", images,
+                time > 0 ? images / time : 0);
+    }
+    return failures > 0;
+}
+
+/* Runs a threaded method on a pool set up with the command line settings.
+ * The pool is created and destroyed inside the timed region, like the
+ * threads of apply_filter2d_threaded.
+ */
+void run_threaded(const filter *f, const pgm_image *source, pgm_image *target,
+        int32_t nthreads, parallel_method method, int32_t chunk_size,
+        normalization_mode normalization, int32_t claim_batch,
+        int32_t tile_aspect, const affinity *pinning)
+{
+    filter_pool *pool = create_filter_pool(nthreads);
+    if (pool == NULL || pin_filter_pool(pool, pinning) != 0)
+    {
+        printf("error creating %d threads\n", nthreads);
+        exit(1);
+    }
+    filter_pool_set_claim_batch(pool, claim_batch);
+    filter_pool_set_tile_aspect(pool, tile_aspect);
+    if (source->pixels != NULL)
+    {
+        apply_filter2d_pool_u8(pool, f, source->pixels, target->pixels,
+                source->width, source->height, method, chunk_size);
+    }
+    else
+    {
+        apply_filter2d_pool(pool, f, source->matrix, target->matrix,
+                source->width, source->height, method, chunk_size,
+                normalization);
+    }
+    destroy_filter_pool(pool);
+}
+
+/* Lays source and target out for nthreads workers pinned by pinning (see
+ * place_buffer), using a pool pinned the same way as the one that filters
+ * them. The source pixels are freed unless the image does not own them.
+ */
+void place_images(pgm_image *source, pgm_image *target, int32_t nthreads,
+        const affinity *pinning, placement how, int32_t owns_source)
+{
+    filter_pool *pool = create_filter_pool(nthreads);
+    if (pool == NULL || pin_filter_pool(pool, pinning) != 0)
+    {
+        printf("error creating %d threads\n", nthreads);
+        exit(1);
+    }
+    int32_t use_8bit = source->pixels != NULL;
+    size_t row_size = source->width *
+        (use_8bit ? sizeof(uint8_t) : sizeof(int32_t));
+    void *source_pixels = use_8bit ? (void *) source->pixels
+                                   : (void *) source->matrix;
+    void *target_pixels = use_8bit ? (void *) target->pixels
+                                   : (void *) target->matrix;
+    void *placed_source = place_buffer(pool, source_pixels, row_size,
+            source->height, how);
+    void *placed_target = place_buffer(pool, NULL, row_size,
+            target->height, how);
+    destroy_filter_pool(pool);
+    if (placed_source == NULL || placed_target == NULL)
+    {
+        printf("error placing the images\n");
+        exit(1);
+    }
+
+    if (owns_source)
+    {
+        free(source_pixels);
+    }
+    free(target_pixels);
+    if (use_8bit)
+    {
+        source->pixels = (uint8_t *) placed_source;
+        target->pixels = (uint8_t *) placed_target;
+    }
+    else
+    {
+        source->matrix = (int32_t *) placed_source;
+        target->matrix = (int32_t *) placed_target;
+    }
+}
+
 int main(int argc, char **argv)
 {
     int32_t filter = 0;
@@ -48,12 +400,26 @@ int main(int argc, char **argv)
     int32_t chunk_size = 0;
     int32_t print_time = 0;
     int32_t nthreads = 0;
+    normalization_mode normalization = NORMALIZE_IN_PLACE;
+    int32_t claim_batch = 1;
+    int32_t tune = 0;
+    int32_t tile_aspect = 0;
+    affinity pinning = {AFFINITY_NONE, 0, {0}};
+    int32_t place = 0;
+    placement how = PLACE_FIRST_TOUCH;
+    int32_t use_8bit = 0;
+    int32_t band_height = 0;
+    char *batch_source = NULL;
+    char *counters_file = NULL;
+    char *trace_file = NULL;
+    int32_t chain[MAX_CHAIN];
+    int32_t num_chained = 0;
     char *source_file = NULL;
     int32_t hardcoded_source = 0;
     char *target_file = NULL;
 
     int32_t option;
-    while((option = getopt(argc, argv, "i:b:o:n:t:f:m:c:")) != -1)
+    while((option = getopt(argc, argv, "i:b:o:n:t:f:m:c:r:q:u:s:d:k:p:T:a:A:P:")) != -1)
     {
         switch(option)
         {
@@ -79,14 +445,30 @@ int main(int argc, char **argv)
                 print_time = atoi(optarg);
                 break;
             case 'f':
-                if (!(filter = atoi(optarg)))
+                // a comma-separated list runs the filters as a chain
+                num_chained = parse_filter_chain(optarg, chain);
+                if (num_chained == 0)
                 {
                     print_error_arguments();
                     return 1;
                 }
+                filter = chain[0];
+                break;
+            case 'k':
+                // a filter file, or the taps themselves, instead of -f
+                if (load_custom_filter(optarg) != NO_ERR)
+                {
+                    return 1;
+                }
+                filter = CUSTOM_FILTER;
+                num_chained = 1;
                 break;
             case 'm':
-                if (!(method = atoi(optarg)))
+                if (strcmp(optarg, "auto") == 0)
+                {
+                    method = AUTO_METHOD;
+                }
+                else if (!(method = atoi(optarg)))
                 {
                     print_error_arguments();
                     return 1;
@@ -95,6 +477,73 @@ int main(int argc, char **argv)
             case 'c':
                 chunk_size = atoi(optarg);
                 break;
+            case 'r':
+                // 1: recompute instead of normalizing target in place
+                normalization = atoi(optarg) ? NORMALIZE_RECOMPUTE
+                                             : NORMALIZE_IN_PLACE;
+                break;
+            case 'q':
+                // WORK_QUEUE chunks claimed at once
+                claim_batch = atoi(optarg);
+                break;
+            case 'u':
+                // 1: keep the pixels as bytes instead of int32_t
+                // 2: same, mapping the source file instead of reading it
+                use_8bit = atoi(optarg);
+                break;
+            case 's':
+                // stream the file in bands of this many rows, from -i to
+                // -o; any threaded method runs the pipelined version
+                band_height = atoi(optarg);
+                break;
+            case 'd':
+                // batch: a directory, glob or manifest of images, filtered
+                // into the -o directory
+                batch_source = optarg;
+                break;
+            case 'p':
+                // per-thread, per-phase hardware counters of the filtering,
+                // as CSV if the file name ends in .csv, JSON otherwise
+                counters_file = optarg;
+                break;
+            case 'T':
+                // timeline of the worker phases, as Chrome trace JSON; needs
+                // a build with tracing (make main TRACE=1)
+                trace_file = optarg;
+                break;
+            case 'a':
+                // 1: search the number of threads (up to -n), chunk size and
+                // tile aspect first, and keep them in the profile for later
+                // runs (see autotune.h)
+                tune = atoi(optarg);
+                break;
+            case 'A':
+                // pin the workers: compact, scatter or a list of cpus
+                if (parse_affinity(optarg, &pinning) != 0)
+                {
+                    printf("error parsing affinity %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                // lay the images out for the pinned workers: touch, or bind
+                // in a build with libnuma (make main NUMA=1)
+                place = 1;
+                if (strcmp(optarg, "bind") == 0)
+                {
+                    if (!can_bind())
+                    {
+                        printf("binding needs a build with libnuma\n");
+                        return 1;
+                    }
+                    how = PLACE_BIND;
+                }
+                else if (strcmp(optarg, "touch") != 0)
+                {
+                    print_error_arguments();
+                    return 1;
+                }
+                break;
             case '?':
                 print_error_arguments();
                 return 1;
@@ -107,23 +556,66 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    /* argument values check */
-    if (method != SEQUENTIAL_METHOD)
+    // chains only run sequentially
+    if (method == AUTO_METHOD && num_chained > 1)
     {
-        if (nthreads == 0)
-        {
-            print_error_arguments();
-            return 1;
-        }
+        method = SEQUENTIAL_METHOD;
+    }
+
+    /* argument values check: a single image may take the number of threads
+     * and the chunk size from the profile instead, once it is loaded */
+    int32_t single_image = batch_source == NULL && band_height == 0;
+    if (missing_settings(method, nthreads, chunk_size) && !single_image)
+    {
+        print_error_arguments();
+        return 1;
+    }
+
+    // chains only run sequentially, on a loaded int32_t image
+    if (num_chained > 1 && (method != SEQUENTIAL_METHOD || use_8bit
+                || band_height > 0 || batch_source != NULL))
+    {
+        print_error_arguments();
+        return 1;
+    }
+
+    // pinning and placement are for the workers of a single image, and
+    // placement needs pinned workers
+    if ((pinning.policy != AFFINITY_NONE || place) && !single_image)
+    {
+        print_error_arguments();
+        return 1;
+    }
+    if (place && pinning.policy == AFFINITY_NONE)
+    {
+        print_error_arguments();
+        return 1;
     }
 
-    if (method == WORK_QUEUE_METHOD)
+    // the images of a batch or a stream are not known up front, so auto
+    // only fits the number of threads to the machine
+    if (method == AUTO_METHOD && (batch_source != NULL || band_height > 0))
     {
-        if (chunk_size == 0)
+        nthreads = auto_thread_limit(nthreads);
+        method = nthreads > 1 ? SHARDED_ROWS_METHOD : SEQUENTIAL_METHOD;
+    }
+
+    if (batch_source != NULL)
+    {
+        if (target_file == NULL)
         {
             print_error_arguments();
             return 1;
         }
+        if (counters_file != NULL)
+        {
+            start_counters();
+        }
+        int failed = run_batch_mode(get_filter(filter), batch_source,
+                target_file, method == SEQUENTIAL_METHOD ? 1 : nthreads,
+                method_of(method), chunk_size, print_time);
+        failed = save_counters(counters_file) || failed;
+        return save_trace(trace_file) || failed;
     }
 
     if (source_file == NULL && hardcoded_source == 0)
@@ -132,21 +624,56 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (band_height > 0)
+    {
+        if (source_file == NULL || target_file == NULL)
+        {
+            print_error_arguments();
+            return 1;
+        }
+        double time = run_streaming(get_filter(filter), source_file,
+                target_file, band_height,
+                method == SEQUENTIAL_METHOD ? 0 : nthreads);
+        if (time < 0)
+        {
+            return 1;
+        }
+        if (print_time)
+        {
+            printf("time=%.2lf\n", time);
+        }
+        return 0;
+    }
+
     pgm_image source, target;
 
     //code for the hardcoded images
     if (hardcoded_source == HARDCODED_BIG_IMAGE)
     {
         source = very_big_sample;
+        if (use_8bit) narrow_pgm_image(&source);
     }
     else if(hardcoded_source == HARDCODED_TALL_IMAGE)
     {
         source = very_tall_sample;
+        if (use_8bit) narrow_pgm_image(&source);
     }
     else
     {
         init_pgm_image(&source);
-        int err = load_pgm_from_file(source_file, &source);
+        int err;
+        if (use_8bit == 2)
+        {
+            err = map_pgm_from_file(source_file, &source);
+        }
+        else if (use_8bit)
+        {
+            err = load_pgm8_from_file(source_file, &source);
+        }
+        else
+        {
+            err = load_pgm_from_file(source_file, &source);
+        }
 
         if (err != NO_ERR)
         {
@@ -155,7 +682,96 @@ int main(int argc, char **argv)
         }
     }
     
-    copy_pgm_image_size(&source, &target);
+    if (use_8bit)
+    {
+        copy_pgm8_image_size(&source, &target);
+    }
+    else
+    {
+        copy_pgm_image_size(&source, &target);
+    }
+
+    // whether -n and -c were given, rather than picked for the image
+    int32_t settings_given = 1;
+    int32_t max_threads = auto_thread_limit(nthreads);
+    if (method == AUTO_METHOD)
+    {
+        settings_given = 0;
+        method_choice choice = choose_method(get_filter(filter), source.width,
+                source.height, use_8bit ? NORMALIZE_RECOMPUTE : normalization,
+                max_threads);
+        method = choice.sequential ? SEQUENTIAL_METHOD
+                                   : method_number(choice.method);
+        nthreads = choice.num_threads;
+        chunk_size = choice.work_chunk;
+        // on stderr: drivers read time= as the first line of stdout
+        if (print_time)
+        {
+            fprintf(stderr, "method=%d threads=%d chunk=%d\n", method,
+                    nthreads, chunk_size);
+        }
+    }
+
+    // tuned settings: searched now with -a, or from the profile, where they
+    // fill in what the command line leaves out; a run with every setting
+    // given never reads the profile, so that sweeps stay reproducible
+    int32_t takes_chunk = method == WORK_QUEUE_METHOD
+        || method == WORK_STEALING_METHOD;
+    if (method != SEQUENTIAL_METHOD && (tune || !settings_given
+                || nthreads == 0 || (takes_chunk && chunk_size == 0)))
+    {
+        tuned_settings tuned;
+        int32_t have_tuned;
+        if (tune)
+        {
+            tuned = autotune(get_filter(filter), &source, &target,
+                    method_of(method), normalization, max_threads);
+            settings_given = 0;
+            have_tuned = 1;
+        }
+        else
+        {
+            have_tuned = find_tuned(get_filter(filter), source.width,
+                    source.height, use_8bit, method_of(method),
+                    normalization, &tuned) == 0;
+        }
+        if (have_tuned)
+        {
+            if (!settings_given || nthreads == 0)
+            {
+                nthreads = tuned.num_threads < max_threads
+                    ? tuned.num_threads : max_threads;
+            }
+            if (!settings_given || chunk_size == 0)
+            {
+                chunk_size = tuned.work_chunk;
+            }
+            tile_aspect = tuned.tile_aspect;
+            // on stderr: drivers read time= as the first line of stdout
+            if (print_time)
+            {
+                fprintf(stderr, "tuned threads=%d chunk=%d aspect=%d\n",
+                        nthreads, chunk_size, tile_aspect);
+            }
+        }
+    }
+    if (missing_settings(method, nthreads, chunk_size))
+    {
+        print_error_arguments();
+        return 1;
+    }
+
+    // outside the timed region, like loading the images
+    if (place && method != SEQUENTIAL_METHOD)
+    {
+        place_images(&source, &target, nthreads, &pinning, how,
+                use_8bit != 2 && (hardcoded_source == 0 || use_8bit));
+    }
+
+    if (counters_file != NULL)
+    {
+        start_counters();
+    }
 
     struct timespec start, stop;
     clock_gettime(CLOCK_MONOTONIC, &start);
@@ -163,28 +779,44 @@ int main(int argc, char **argv)
     switch (method)
     {
         case SEQUENTIAL_METHOD:
-            apply_filter2d(get_filter(filter), source.matrix,
-                    target.matrix, source.width, source.height);
+            if (num_chained > 1)
+            {
+                run_chain(chain, num_chained, &source, &target);
+                break;
+            }
+            if (use_8bit)
+            {
+                apply_filter2d_u8(get_filter(filter), source.pixels,
+                        target.pixels, source.width, source.height);
+                break;
+            }
+            apply_filter2d_mode(get_filter(filter), source.matrix,
+                    target.matrix, source.width, source.height, normalization);
             break;
         case SHARDED_ROWS_METHOD:
-            apply_filter2d_threaded(get_filter(filter),
-                    source.matrix, target.matrix, source.width, source.height,
-                    nthreads, SHARDED_ROWS, 0);
+            run_threaded(get_filter(filter), &source, &target, nthreads,
+                    SHARDED_ROWS, 0, normalization, claim_batch,
+                    tile_aspect, &pinning);
             break;
         case SHARDED_COLUMNS_COLUMN_MAJOR_METHOD:
-            apply_filter2d_threaded(get_filter(filter),
-                    source.matrix, target.matrix, source.width, source.height,
-                    nthreads, SHARDED_COLUMNS_COLUMN_MAJOR, 0);
+            run_threaded(get_filter(filter), &source, &target, nthreads,
+                    SHARDED_COLUMNS_COLUMN_MAJOR, 0, normalization, claim_batch,
+                    tile_aspect, &pinning);
             break;
         case SHARDED_COLUMNS_ROW_MAJOR_METHOD:
-            apply_filter2d_threaded(get_filter(filter),
-                    source.matrix, target.matrix, source.width, source.height,
-                    nthreads, SHARDED_COLUMNS_ROW_MAJOR, 0);
+            run_threaded(get_filter(filter), &source, &target, nthreads,
+                    SHARDED_COLUMNS_ROW_MAJOR, 0, normalization, claim_batch,
+                    tile_aspect, &pinning);
             break;
         case WORK_QUEUE_METHOD:
-            apply_filter2d_threaded(get_filter(filter),
-                    source.matrix, target.matrix, source.width, source.height,
-                    nthreads, WORK_QUEUE, chunk_size);
+            run_threaded(get_filter(filter), &source, &target, nthreads,
+                    WORK_QUEUE, chunk_size, normalization, claim_batch,
+                    tile_aspect, &pinning);
+            break;
+        case WORK_STEALING_METHOD:
+            run_threaded(get_filter(filter), &source, &target, nthreads,
+                    WORK_STEALING, chunk_size, normalization, claim_batch,
+                    tile_aspect, &pinning);
             break;
         default:
             print_error_arguments();
@@ -193,6 +825,11 @@ int main(int argc, char **argv)
     
     clock_gettime(CLOCK_MONOTONIC, &stop);
 
+    if (save_counters(counters_file) || save_trace(trace_file))
+    {
+        return 1;
+    }
+
     if (print_time)
     {
         printf("time=%.2lf\n",
@@ -203,7 +840,14 @@ int main(int argc, char **argv)
     
     if (target_file != NULL)
     {
-        save_pgm_to_file(target_file, &target);
+        if (use_8bit)
+        {
+            save_pgm8_to_file(target_file, &target);
+        }
+        else
+        {
+            save_pgm_to_file(target_file, &target);
+        }
     }
 
     return 0;
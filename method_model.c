@@ -0,0 +1,311 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "method_model.h"
+#include "fft.h"
+#include "kernels.h"
+#include "machine.h"
+#include "tiles.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* The microbenchmark: a square image for the per tap and per pixel costs,
+ * a one pixel wide one (one span per pixel) for the per span cost, small
+ * chunks for the per chunk cost, and a tiny image on a few threads for the
+ * per thread cost. Each run is repeated and the fastest one kept.
+ */
+#define CALIBRATION_SIDE 512
+#define CALIBRATION_TALL 65536
+#define CALIBRATION_CHUNK 8
+#define CALIBRATION_TINY 16
+#define CALIBRATION_THREADS 4
+#define CALIBRATION_REPEATS 3
+
+/* Fastest of a few runs of method on pool, or on a pool of num_threads
+ * created and destroyed inside the timed region if pool is NULL.
+ */
+static double best_time(filter_pool *pool, int32_t num_threads,
+        const filter *f, const int32_t *source, int32_t *target,
+        int32_t width, int32_t height, parallel_method method,
+        int32_t work_chunk)
+{
+    double best = 0;
+    for (int32_t i = 0; i < CALIBRATION_REPEATS; i ++) {
+        double start = now_ns();
+        filter_pool *run_pool = pool != NULL ? pool
+                                             : create_filter_pool(num_threads);
+        if (run_pool == NULL) exit(-1);
+        apply_filter2d_pool(run_pool, f, source, target, width, height,
+                method, work_chunk, NORMALIZE_IN_PLACE);
+        if (pool == NULL) destroy_filter_pool(run_pool);
+        double time = now_ns() - start;
+        if (i == 0 || time < best) best = time;
+    }
+    return best;
+}
+
+/* A registered filter with dimension^2 taps, none of them 0 and not
+ * separable, so no plan makes it much cheaper.
+ */
+static void init_dense_filter(filter *f, int8_t *matrix, int32_t dimension)
+{
+    for (int32_t i = 0; i < dimension * dimension; i ++) {
+        matrix[i] = (i * 37 + i / dimension) % 7 - 3;
+        if (matrix[i] == 0) matrix[i] = 1;
+    }
+    f->dimension = dimension;
+    f->matrix = matrix;
+    f->plan = NULL;
+    register_filter(f);
+}
+
+void calibrate_cost_model(cost_model *model)
+{
+    int32_t side = CALIBRATION_SIDE;
+    size_t size = (size_t) side * side > CALIBRATION_TALL
+        ? (size_t) side * side : CALIBRATION_TALL;
+    int32_t *source = (int32_t *) malloc(size * sizeof(int32_t));
+    int32_t *target = (int32_t *) malloc(size * sizeof(int32_t));
+    if (source == NULL || target == NULL) exit(-1);
+    for (size_t i = 0; i < size; i ++) {
+        source[i] = (i * 2654435761u) >> 24;
+    }
+
+    int8_t small_matrix[3 * 3], large_matrix[7 * 7];
+    filter small, large;
+    init_dense_filter(&small, small_matrix, 3);
+    init_dense_filter(&large, large_matrix, 7);
+    double small_taps = row_kernel_cost(&small);
+    double large_taps = row_kernel_cost(&large);
+    double pixels = (double) side * side;
+
+    // per tap and per pixel, from the two filters on the square image
+    filter_pool *pool = create_filter_pool(1);
+    if (pool == NULL) exit(-1);
+    double small_time = best_time(pool, 1, &small, source, target,
+            side, side, SHARDED_ROWS, 0);
+    double large_time = best_time(pool, 1, &large, source, target,
+            side, side, SHARDED_ROWS, 0);
+    model->tap_cost = (large_time - small_time) /
+        (pixels * (large_taps - small_taps));
+    if (model->tap_cost < 0) model->tap_cost = 0;
+    model->pixel_cost = small_time / pixels - small_taps * model->tap_cost;
+    if (model->pixel_cost < 0) model->pixel_cost = 0;
+    double small_pixel = model->pixel_cost + small_taps * model->tap_cost;
+
+    // per span: every pixel of the one pixel wide image is a span
+    double tall_time = best_time(pool, 1, &small, source, target,
+            1, CALIBRATION_TALL, SHARDED_ROWS, 0);
+    model->span_cost = tall_time / CALIBRATION_TALL - small_pixel;
+    if (model->span_cost < 0) model->span_cost = 0;
+
+    // per chunk: what small chunks cost beyond their extra spans
+    int32_t chunks_per_row = side / CALIBRATION_CHUNK;
+    double queue_time = best_time(pool, 1, &small, source, target,
+            side, side, WORK_QUEUE, CALIBRATION_CHUNK);
+    model->chunk_cost = (queue_time - small_time -
+            (double) side * (chunks_per_row - 1) * model->span_cost) /
+        ((double) chunks_per_row * chunks_per_row);
+    if (model->chunk_cost < 0) model->chunk_cost = 0;
+
+    // per deque chunk, the same way: one thread takes them all, a run at a
+    // time, no steals
+    double stealing_time = best_time(pool, 1, &small, source, target,
+            side, side, WORK_STEALING, CALIBRATION_CHUNK);
+    model->steal_cost = (stealing_time - small_time -
+            (double) side * (chunks_per_row - 1) * model->span_cost) /
+        ((double) chunks_per_row * chunks_per_row);
+    if (model->steal_cost < 0) model->steal_cost = 0;
+    destroy_filter_pool(pool);
+
+    // per thread: pools of one and several threads on a tiny image
+    double one_time = best_time(NULL, 1, &small, source, target,
+            CALIBRATION_TINY, CALIBRATION_TINY, SHARDED_ROWS, 0);
+    double many_time = best_time(NULL, CALIBRATION_THREADS, &small, source,
+            target, CALIBRATION_TINY, CALIBRATION_TINY, SHARDED_ROWS, 0);
+    model->thread_cost = (many_time - one_time) / (CALIBRATION_THREADS - 1);
+    if (model->thread_cost < 0) model->thread_cost = 0;
+
+    unregister_filter(&small);
+    unregister_filter(&large);
+    free(source);
+    free(target);
+}
+
+/* Returns 0 if path holds a model made on this machine */
+static int read_cost_model(const char *path, cost_model *model)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+    int read = -1;
+    if (read_machine_header(file, MODEL_VERSION) == 0) {
+        read = fscanf(file, " tap %lf pixel %lf span %lf chunk %lf steal %lf "
+                "thread %lf", &model->tap_cost, &model->pixel_cost,
+                &model->span_cost, &model->chunk_cost, &model->steal_cost,
+                &model->thread_cost);
+    }
+    fclose(file);
+    return read == 6 ? 0 : -1;
+}
+
+/* Best effort: without a writable cache the model is measured every run */
+static void write_cost_model(const char *path, const cost_model *model)
+{
+    char temporary[4096];
+    FILE *file = begin_machine_file(path, MODEL_VERSION, temporary,
+            sizeof(temporary));
+    if (file == NULL) return;
+    fprintf(file, "tap %.6g\npixel %.6g\nspan %.6g\nchunk %.6g\nsteal %.6g\n"
+            "thread %.6g\n", model->tap_cost, model->pixel_cost,
+            model->span_cost, model->chunk_cost, model->steal_cost,
+            model->thread_cost);
+    end_machine_file(file, temporary, path);
+}
+
+static cost_model machine_model;
+static pthread_once_t machine_model_once = PTHREAD_ONCE_INIT;
+
+static void load_machine_model(void)
+{
+    char buffer[4096];
+    const char *path = machine_file_path(MODEL_CACHE_ENV, MODEL_CACHE_NAME,
+            buffer, sizeof(buffer));
+    if (path != NULL && read_cost_model(path, &machine_model) == 0) return;
+    calibrate_cost_model(&machine_model);
+    if (path != NULL) write_cost_model(path, &machine_model);
+}
+
+const cost_model *get_cost_model(void)
+{
+    pthread_once(&machine_model_once, load_machine_model);
+    return &machine_model;
+}
+
+/* Time for one thread to filter a rows x cols block, pixel ns per pixel */
+static double block_time(const cost_model *model, double pixel,
+        int32_t tile_width, int32_t rows, int32_t cols)
+{
+    int32_t spans_per_row = (cols + tile_width - 1) / tile_width;
+    return (double) rows * cols * pixel +
+        (double) rows * spans_per_row * model->span_cost;
+}
+
+/* Time of WORK_QUEUE or WORK_STEALING with work_chunk x work_chunk
+ * chunks on num_threads, chunk_cost ns each: the work and the chunks
+ * shared evenly, plus the last chunk claimed.
+ */
+static double queue_time(const cost_model *model, double pixel,
+        int32_t tile_width, int32_t width, int32_t height,
+        int32_t num_threads, int32_t work_chunk, double chunk_cost)
+{
+    int32_t chunk_rows = (height + work_chunk - 1) / work_chunk;
+    int32_t chunk_cols = (width + work_chunk - 1) / work_chunk;
+    double chunks = (double) chunk_rows * chunk_cols;
+    double total = (double) width * height * pixel +
+        (double) height * chunk_cols * model->span_cost +
+        chunks * chunk_cost;
+    double sharing = chunks < num_threads ? chunks : num_threads;
+    return total / sharing + block_time(model, pixel, tile_width,
+            work_chunk < height ? work_chunk : height,
+            work_chunk < width ? work_chunk : width);
+}
+
+/* Time of WORK_STEALING: its chunks, plus the steals that even out the
+ * end. A thread whose deque runs dry halves a victim's, so it steals about
+ * log2 of its share of chunks times, each after trying up to every other
+ * thread.
+ */
+static double stealing_time(const cost_model *model, double pixel,
+        int32_t tile_width, int32_t width, int32_t height,
+        int32_t num_threads, int32_t work_chunk)
+{
+    int32_t chunk_rows = (height + work_chunk - 1) / work_chunk;
+    int32_t chunk_cols = (width + work_chunk - 1) / work_chunk;
+    double share = (double) chunk_rows * chunk_cols / num_threads;
+    double steals = share > 1 ? log2(share) : 1;
+    return queue_time(model, pixel, tile_width, width, height, num_threads,
+            work_chunk, model->steal_cost) +
+        steals * num_threads * model->steal_cost;
+}
+
+/* Keeps candidate in best if it takes less time */
+static void consider(method_choice *best, double *best_time, double time,
+        parallel_method method, int32_t num_threads, int32_t work_chunk)
+{
+    if (time >= *best_time) return;
+    *best_time = time;
+    best->sequential = 0;
+    best->method = method;
+    best->num_threads = num_threads;
+    best->work_chunk = work_chunk;
+}
+
+method_choice choose_method(const filter *f, int32_t width, int32_t height,
+        normalization_mode normalization, int32_t max_threads)
+{
+    method_choice best = {1, SHARDED_ROWS, 1, 0};
+    if (max_threads < 2) return best;
+
+    const cost_model *model = get_cost_model();
+    double passes = normalization == NORMALIZE_RECOMPUTE ? 2 : 1;
+    double pixel = passes * row_kernel_cost(f) * model->tap_cost +
+        model->pixel_cost;
+    int32_t tile_width = choose_tile_shape(f->dimension, width, height,
+            sizeof(int32_t)).width;
+    double best_time = block_time(model, pixel, tile_width, height, width);
+    if (fft_preferred(f, width, height)) {
+        best_time /= fft_speedup(f, width, height);
+    }
+
+    // threads beyond the cores only take turns on them: they cost their
+    // thread_cost and add nothing
+    int32_t cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+    for (int32_t n = 2; n <= max_threads; n ++) {
+        double threads = n * model->thread_cost;
+        int32_t parallel = n < cores ? n : cores;
+
+        // the last shard takes the remainder, all of it when there are
+        // fewer rows or columns than threads
+        int32_t rows = height - (parallel - 1) * (height / parallel);
+        consider(&best, &best_time, threads +
+                block_time(model, pixel, tile_width, rows, width),
+                SHARDED_ROWS, n, 0);
+        // column-major visits the same tiles in another order, which the
+        // model does not see, so row-major stands for both
+        int32_t cols = width - (parallel - 1) * (width / parallel);
+        consider(&best, &best_time, threads +
+                block_time(model, pixel, tile_width, height, cols),
+                SHARDED_COLUMNS_ROW_MAJOR, n, 0);
+
+        for (int32_t i = 0; i < NUM_WORK_CHUNKS; i ++) {
+            if (i > 0 && work_chunks[i - 1] >= width &&
+                    work_chunks[i - 1] >= height) {
+                break;
+            }
+            consider(&best, &best_time, threads + queue_time(model, pixel,
+                        tile_width, width, height, parallel, work_chunks[i],
+                        model->chunk_cost),
+                    WORK_QUEUE, n, work_chunks[i]);
+            consider(&best, &best_time, threads + stealing_time(model,
+                        pixel, tile_width, width, height, parallel,
+                        work_chunks[i]),
+                    WORK_STEALING, n, work_chunks[i]);
+        }
+    }
+    return best;
+}
@@ -0,0 +1,77 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __METHOD_MODEL__H
+#define __METHOD_MODEL__H
+
+#include "filters.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**************AUTOMATIC METHOD SELECTION*****************/
+/* choose_method picks the method, number of threads and chunk size for an
+ * image from a cost model of each method: the time per tap and per pixel
+ * of the row kernels, per row span handed to them, per WORK_QUEUE and
+ * WORK_STEALING chunk, per steal and per pool thread. Only as many threads
+ * as there are online cores run at once. The constants are measured on
+ * this machine by a short microbenchmark the first time they are needed,
+ * then kept in a cache file so later runs skip it.
+ */
+
+/* The cache file is the one this environment variable names (no cache if
+ * it is empty), otherwise MODEL_CACHE_NAME in the home directory. A cache
+ * made on a cpu with another instruction set, core count or cache sizes is
+ * measured again.
+ */
+#define MODEL_CACHE_ENV "FILTER_MODEL_CACHE"
+#define MODEL_CACHE_NAME ".filter_model"
+#define MODEL_VERSION 3
+
+/* Constants of the cost model, in ns */
+typedef struct cost_model_t
+{
+    double tap_cost;    // per tap of an output pixel (see row_kernel_cost)
+    double pixel_cost;  // per output pixel besides its taps: store, normalize
+    double span_cost;   // per row span handed to a row kernel
+    double chunk_cost;  // per WORK_QUEUE chunk
+    double steal_cost;  // per WORK_STEALING chunk, and per victim tried
+    double thread_cost; // per thread of a pool created for one image
+} cost_model;
+
+typedef struct method_choice_t
+{
+    int32_t sequential;     // 1: apply_filter2d, the other fields unused
+    parallel_method method;
+    int32_t num_threads;
+    int32_t work_chunk;
+} method_choice;
+
+/* Measures the constants of the model on this machine. Takes a few tens of
+ * milliseconds.
+ */
+void calibrate_cost_model(cost_model *model);
+
+/* The model for this machine, read from the cache file, or calibrated (and
+ * written to the cache file) if there is no valid one.
+ */
+const cost_model *get_cost_model(void);
+
+/* The cheapest way to filter a width x height image with f, using at most
+ * max_threads threads. 8-bit images are always filtered as in
+ * NORMALIZE_RECOMPUTE mode. Only the sequential path uses the FFT: when
+ * fft_preferred takes it, the sequential time is scaled by fft_speedup.
+ */
+method_choice choose_method(const filter *f, int32_t width, int32_t height,
+        normalization_mode normalization, int32_t max_threads);
+#endif
@@ -77,6 +77,7 @@ methods = {
        "sharded_columns column major" : 3,
        "sharded_columns row major" : 4,
        "work queue" : 5,
+       "work stealing" : 6,
       }
 filters = {"3x3" : 1,
        "5x5" : 2,
@@ -230,11 +231,56 @@ def run_perf_exp4(filter, method, numthreads = 1, chunk_size = 1, width = 1, rep
     with open('data.pickle', 'wb') as f:
         pickle.dump(results, f, pickle.HIGHEST_PROTOCOL)
 
+# helper for experiment 5
+def run_perf_exp5(filter, method, numthreads = 1, chunk_size = 1, normalization = 0,
+    repeat = 10):
+    key = (filter, method, numthreads, chunk_size, default_file, 'r', normalization)
+    if results.get(key) != None:
+        return
+
+    main_args = './main.out -t {} -b {} -f {} -m {} -n {} -c {} -r {}'.format(
+        0, #don't print time
+        default_file,
+        filters[filter],
+        methods[method],
+        numthreads,
+        chunk_size,
+        normalization)
+
+    #cold run
+    command =  'perf stat '
+    command += main_args
+    ret = execute_command(command)
+
+    counters = [
+        'instructions:u',
+        'LLC-loads:u',
+        'LLC-load-misses:u',
+    ]
+    command =  'perf stat -r {} -e {} '.format(repeat, ",".join(counters))
+    command += main_args
+    partial_results = parse_perf(execute_command(command))
+
+    #get time
+    main_args = main_args.replace('-t 0', '-t 1', 1)
+    time = 0
+    for i in range(repeat):
+        ret = execute_command(main_args)
+        time += float(ret[5:])
+    time = time / repeat
+    partial_results['time'] = time
+
+    results[key] = partial_results
+
+    with open('data.pickle', 'wb') as f:
+        pickle.dump(results, f, pickle.HIGHEST_PROTOCOL)
+
 colours = {"sequential" : 'r',
        "sharded_rows": 'b',
        "sharded_columns column major" : 'g',
        "sharded_columns row major" : 'c',
        "work queue" : 'm',
+       "work stealing" : 'y',
        1 : 'r',
        2 : 'b',
        3 : 'g',
@@ -386,6 +432,38 @@ def graph4(mode, filter = "3x3"):
     plt.savefig(filename, bbox_inches='tight')
 
 
+# Experiment 5: Normalizing in place vs recomputing (-r 1), which writes the
+# output image once instead of writing, reading and writing it again.
+def graph5(mode, filter = "3x3"):
+    local_results = defaultdict(list)
+    normalizations = {"in place" : 0, "recompute" : 1}
+    for name, normalization in normalizations.items():
+        for nthread in threads:
+            method = "sharded_rows"
+            key = (filter, method, nthread, nthread, normalization)
+            run_perf_exp5(*key)
+            key = (filter, method, nthread, nthread, default_file, 'r',
+                normalization)
+            local_results[name] += [float(results[key][mode])]
+
+    title = ('4M pixels square image, filter = {}, method = sharded_rows, normalization in place vs recompute. Average over 10 runs.'.format(filter))
+    ylabel = mode
+    if mode == 'time':
+        ylabel += "(s)"
+
+    names = list(normalizations.keys())
+    plotter.graph(
+        threads, # x axis
+        [local_results[name] for name in names], # y vals
+        names,  # names for each line
+        ['r', 'b'],
+        'graph_{}.png'.format(mode+filter+"5"), # filename
+        title,
+        "# Threads", # xlabel
+        ylabel
+    )
+
+
 graph('time')
 graph('l1d_loadmisses')
 graph2('time')
@@ -394,3 +472,5 @@ graph3('time')
 graph3('l1d_loadmisses')
 graph4('time')
 graph4('l1d_loadmisses')
+graph5('time')
+graph5('ll_loadmisses')
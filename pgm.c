@@ -17,6 +17,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Bytes narrowed per write by save_pgm_to_file */
+#define SAVE_STAGING_SIZE (1 << 20)
+/* Pixels narrowed per vectorized block */
+#define NARROW_BLOCK 16
 
 void init_pgm_image(pgm_image *image)
 {
@@ -24,11 +35,22 @@ void init_pgm_image(pgm_image *image)
     image->height = 0;
     image->max_gray = 0;
     image->matrix = NULL;
+    image->pixels = NULL;
+    image->mapping = NULL;
+    image->mapping_size = 0;
 }
 
 void destroy_pgm_image(pgm_image *image)
 {
     free(image->matrix);
+    if (image->mapping != NULL)
+    {
+        unmap_pgm_image(image);
+    }
+    else
+    {
+        free(image->pixels);
+    }
 }
 
 /* Helper function that advances the file stream past the
@@ -50,13 +72,18 @@ void remove_comments(FILE *f)
     }
 }
 
-int32_t load_pgm_from_file(const char *filename, pgm_image *image)
+/* Opens filename and reads its header into image, leaving the stream at
+ * the start of the raster. Returns NULL and sets *err on failure.
+ */
+static FILE *open_pgm_file(const char *filename, pgm_image *image,
+        int32_t *err)
 {
     FILE *file = fopen(filename, "rb");
     
     if (file == NULL)
     {
-        return ERR_NO_FILE; 
+        *err = ERR_NO_FILE;
+        return NULL;
     }
 
     char magic_number[2];
@@ -69,16 +96,23 @@ int32_t load_pgm_from_file(const char *filename, pgm_image *image)
     remove_comments(file);
     num += fscanf(file, "%u", &image->max_gray);
     char c = getc(file);
-    if (!isspace(c))
+    if (!isspace(c) || num != 5 || magic_number[0] != 'P'
+            || magic_number[1] != '5')
     {
-        return ERR_INVALID_HEADER;
+        fclose(file);
+        *err = ERR_INVALID_HEADER;
+        return NULL;
     }
+    return file;
+}
 
-
-    if (num != 5 || magic_number[0] != 'P' || magic_number[1] != '5')
+int32_t load_pgm_from_file(const char *filename, pgm_image *image)
+{
+    int32_t err;
+    FILE *file = open_pgm_file(filename, image, &err);
+    if (file == NULL)
     {
-        fclose(file);
-        return ERR_INVALID_HEADER;
+        return err;
     }
 
     uint8_t *temp = (uint8_t *) malloc(image->height * image->width * sizeof(uint8_t));
@@ -109,33 +143,354 @@ int32_t load_pgm_from_file(const char *filename, pgm_image *image)
     return NO_ERR;
 }
 
+/* Opens filename for saving and formats the header of image into header,
+ * whose length goes to *header_len. Returns -1 on failure.
+ */
+static int open_save_file(const char *filename, const pgm_image *image,
+        char *header, size_t header_size, size_t *header_len)
+{
+    *header_len = snprintf(header, header_size, "P5 %d %d %d\n",
+            image->width, image->height, image->max_gray);
+    return open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+/* Writes every buffer of iov to fd, resuming after partial writes.
+ * Returns 0 on failure.
+ */
+static int32_t write_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        // drop what was written, including buffers written whole
+        while (count > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 1;
+}
+
+/* Narrows count pixels of matrix into out, truncating each to a byte. The
+ * fixed-size inner loop lets gcc turn each block into a few vector packs.
+ */
+static void narrow_pixels(const int32_t *restrict matrix,
+        uint8_t *restrict out, size_t count)
+{
+    size_t i = 0;
+    for (; i + NARROW_BLOCK <= count; i += NARROW_BLOCK)
+    {
+        for (int j = 0; j < NARROW_BLOCK; j++)
+        {
+            out[i + j] = (uint8_t) matrix[i + j];
+        }
+    }
+    for (; i < count; i++)
+    {
+        out[i] = (uint8_t) matrix[i];
+    }
+}
+
 int32_t save_pgm_to_file(const char *filename, const pgm_image *image)
 {
-    FILE *file = fopen(filename, "wb");
+    char header[64];
+    size_t header_len;
+    int fd = open_save_file(filename, image, header, sizeof(header),
+            &header_len);
     
-    if (file == NULL)
+    if (fd < 0)
     {
         return ERR_OPEN_SAVEFILE;
     }
 
-    fprintf(file, "P5 %d %d %d\n", 
-            image->width, image->height, image->max_gray);
+    // narrow the matrix one staging buffer at a time, each going out in a
+    // single write (the first one together with the header)
+    size_t size = (size_t) image->width * image->height;
+    size_t staging_size = size < SAVE_STAGING_SIZE ? size : SAVE_STAGING_SIZE;
+    uint8_t *staging = (uint8_t *) malloc(staging_size > 0 ? staging_size : 1);
+    if (staging == NULL)
+    {
+        close(fd);
+        return ERR_MALLOC;
+    }
 
+    struct iovec iov[2] = {{header, header_len}, {staging, 0}};
+    int32_t ok = 1;
+    size_t done = 0;
+    do
+    {
+        size_t count = size - done < staging_size ? size - done : staging_size;
+        narrow_pixels(image->matrix + done, staging, count);
+        iov[1].iov_base = staging;
+        iov[1].iov_len = count;
+        ok = done == 0 ? write_all(fd, iov, 2) : write_all(fd, &iov[1], 1);
+        done += count;
+    } while (ok && done < size);
 
-    int32_t i;
-    for (i = 0; i < image->height * image->width; i++)
+    free(staging);
+    if (close(fd) != 0 || !ok)
+    {
+        return ERR_WRITING_TO_FILE;
+    }
+    return NO_ERR;
+}
+
+int32_t load_pgm8_from_file(const char *filename, pgm_image *image)
+{
+    int32_t err;
+    FILE *file = open_pgm_file(filename, image, &err);
+    if (file == NULL)
+    {
+        return err;
+    }
+
+    image->pixels = (uint8_t *) malloc(image->height * image->width);
+    if (image->pixels == NULL)
+    {
+        fclose(file);
+        return ERR_MALLOC;
+    }
+
+    int32_t count = fread(image->pixels, image->width * image->height, 1, file);
+    if (count != 1 || ferror(file) != 0)
     {
-        uint8_t temp = image->matrix[i];
-        if (fwrite(&temp, sizeof(uint8_t), 1, file) != 1)
+        fclose(file);
+        return ERR_INVALID_RASTER;
+    }
+
+    fclose(file);
+    return NO_ERR;
+}
+
+int32_t save_pgm8_to_file(const char *filename, const pgm_image *image)
+{
+    char header[64];
+    size_t header_len;
+    int fd = open_save_file(filename, image, header, sizeof(header),
+            &header_len);
+    
+    if (fd < 0)
+    {
+        return ERR_OPEN_SAVEFILE;
+    }
+
+    // the pixels are already bytes: header and raster in a single writev
+    struct iovec iov[2] = {{header, header_len},
+        {image->pixels, (size_t) image->width * image->height}};
+    int32_t ok = write_all(fd, iov, 2);
+    if (close(fd) != 0 || !ok)
+    {
+        return ERR_WRITING_TO_FILE;
+    }
+    return NO_ERR;
+}
+
+/* Skips whitespace and comments in the header at *pos */
+static void skip_header_space(const uint8_t *data, size_t size, size_t *pos)
+{
+    while (*pos < size)
+    {
+        if (data[*pos] == '#')
         {
-            return  ERR_WRITING_TO_FILE;
+            while (*pos < size && data[*pos] != '\n')
+            {
+                (*pos)++;
+            }
+        }
+        else if (isspace(data[*pos]))
+        {
+            (*pos)++;
+        }
+        else
+        {
+            return;
         }
     }
+}
 
-    fclose(file);
+/* Parses the decimal header field at *pos. Returns 0 if there is none. */
+static int32_t parse_header_field(const uint8_t *data, size_t size,
+        size_t *pos, int32_t *value)
+{
+    skip_header_space(data, size, pos);
+    if (*pos >= size || !isdigit(data[*pos]))
+    {
+        return 0;
+    }
+    int64_t v = 0;
+    while (*pos < size && isdigit(data[*pos]) && v <= INT32_MAX)
+    {
+        v = v * 10 + (data[*pos] - '0');
+        (*pos)++;
+    }
+    *value = v;
+    return v <= INT32_MAX;
+}
+
+int32_t map_pgm_from_file(const char *filename, pgm_image *image)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return ERR_NO_FILE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 2)
+    {
+        close(fd);
+        return ERR_INVALID_HEADER;
+    }
+    size_t size = st.st_size;
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // fault every page in now rather than one at a time in the filter
+    flags |= MAP_POPULATE;
+#endif
+    uint8_t *data = mmap(NULL, size, PROT_READ, flags, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (data == MAP_FAILED)
+    {
+        return ERR_MAP;
+    }
+    // the filter walks the raster front to back
+    madvise(data, size, MADV_SEQUENTIAL);
+    madvise(data, size, MADV_WILLNEED);
+
+    image->mapping = data;
+    image->mapping_size = size;
+
+    size_t pos = 2;
+    if (data[0] != 'P' || data[1] != '5'
+            || !parse_header_field(data, size, &pos, &image->width)
+            || !parse_header_field(data, size, &pos, &image->height)
+            || !parse_header_field(data, size, &pos, &image->max_gray)
+            || pos >= size || !isspace(data[pos]))
+    {
+        return ERR_INVALID_HEADER;
+    }
+    pos++; // the single whitespace before the raster
+
+    if ((uint64_t) image->width * image->height > size - pos)
+    {
+        return ERR_INVALID_RASTER;
+    }
+    image->pixels = data + pos;
     return NO_ERR;
 }
 
+void unmap_pgm_image(pgm_image *image)
+{
+    if (image->mapping != NULL)
+    {
+        munmap(image->mapping, image->mapping_size);
+    }
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    image->pixels = NULL;
+}
+
+int32_t open_pgm_rows(const char *filename, pgm_image *image, pgm_file *file)
+{
+    int32_t err;
+    FILE *stream = open_pgm_file(filename, image, &err);
+    if (stream == NULL)
+    {
+        return err;
+    }
+
+    // keep a descriptor of our own, read with pread from the raster offset
+    file->raster_offset = ftell(stream);
+    file->fd = dup(fileno(stream));
+    file->width = image->width;
+    fclose(stream);
+    return file->fd < 0 ? ERR_NO_FILE : NO_ERR;
+}
+
+int32_t create_pgm_rows(const char *filename, const pgm_image *image,
+        pgm_file *file)
+{
+    char header[64];
+    size_t header_len;
+    file->fd = open_save_file(filename, image, header, sizeof(header),
+            &header_len);
+    if (file->fd < 0)
+    {
+        return ERR_OPEN_SAVEFILE;
+    }
+    file->raster_offset = header_len;
+    file->width = image->width;
+
+    struct iovec iov = {header, header_len};
+    if (!write_all(file->fd, &iov, 1))
+    {
+        close(file->fd);
+        return ERR_WRITING_TO_FILE;
+    }
+    return NO_ERR;
+}
+
+int32_t read_pgm_rows(pgm_file *file, int32_t row, int32_t count,
+        uint8_t *rows)
+{
+    size_t size = (size_t) count * file->width;
+    off_t offset = file->raster_offset + (off_t) row * file->width;
+    while (size > 0)
+    {
+        ssize_t got = pread(file->fd, rows, size, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0)
+        {
+            return ERR_INVALID_RASTER;
+        }
+        rows += got;
+        size -= got;
+        offset += got;
+    }
+    return NO_ERR;
+}
+
+int32_t write_pgm_rows(pgm_file *file, const uint8_t *rows, int32_t count)
+{
+    struct iovec iov = {(void *) rows, (size_t) count * file->width};
+    return write_all(file->fd, &iov, 1) ? NO_ERR : ERR_WRITING_TO_FILE;
+}
+
+int32_t close_pgm_rows(pgm_file *file)
+{
+    return close(file->fd) == 0 ? NO_ERR : ERR_WRITING_TO_FILE;
+}
+
+int32_t copy_pgm8_image_size(const pgm_image *image, pgm_image *target)
+{
+    uint8_t *pixels = (uint8_t *) malloc(image->width * image->height);
+    if (pixels == NULL)
+    {
+        return ERR_MALLOC;
+    }
+
+    target->width = image->width;
+    target->height = image->height;
+    target->max_gray = image->max_gray;
+    target->matrix = NULL;
+    target->pixels = pixels;
+    target->mapping = NULL;
+
+    return NO_ERR;
+}
 
 int32_t copy_pgm_image_size(const pgm_image *image, pgm_image *target)
 {
@@ -150,6 +505,8 @@ int32_t copy_pgm_image_size(const pgm_image *image, pgm_image *target)
     target->height = image->height;
     target->max_gray = image->max_gray;
     target->matrix = matrix;
+    target->pixels = NULL;
+    target->mapping = NULL;
 
     return NO_ERR;
 }
@@ -169,6 +526,8 @@ int32_t create_random_pgm_image(pgm_image *image, int32_t width,
     }
 
     image->matrix = matrix;
+    image->pixels = NULL;
+    image->mapping = NULL;
 
     uint8_t pixel = 0;
     int32_t i,j;
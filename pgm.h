@@ -15,6 +15,7 @@
 #ifndef __PGM__H
 #define __PGM__H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define NO_ERR 0
@@ -24,6 +25,7 @@
 #define ERR_OPEN_SAVEFILE 4
 #define ERR_WRITING_TO_FILE 5
 #define ERR_MALLOC 6
+#define ERR_MAP 7
 
 typedef struct pgm_image_t
 {
@@ -31,6 +33,13 @@ typedef struct pgm_image_t
     int32_t height;
     int32_t max_gray;
     int32_t *matrix;
+    /* 8-bit storage: set instead of matrix by the pgm8 functions, one byte
+     * per pixel like the file raster. */
+    uint8_t *pixels;
+    /* Set by map_pgm_from_file: the whole file mapping, which pixels
+     * points into. */
+    void *mapping;
+    size_t mapping_size;
 } pgm_image;
 
 /* Initialization function, must be called before
@@ -56,4 +65,49 @@ int32_t create_random_pgm_image(pgm_image *image, int32_t width,
 
 int32_t load_pgm_from_file(const char *filename, pgm_image *image);
 int32_t save_pgm_to_file(const char *filename, const pgm_image *image);
+
+/* Same as copy_pgm_image_size, load_pgm_from_file and save_pgm_to_file,
+ * using the 8-bit pixels buffer instead of matrix. The raster is read and
+ * written as is, without widening each pixel to int32_t.
+ */
+int32_t copy_pgm8_image_size(const pgm_image *image, pgm_image *target);
+int32_t load_pgm8_from_file(const char *filename, pgm_image *image);
+int32_t save_pgm8_to_file(const char *filename, const pgm_image *image);
+
+/* Maps filename into memory and parses its header in place: pixels points
+ * straight at the P5 raster in the mapping, with no copy at all. The pages
+ * are prefaulted and read ahead, so the filter does not stall on them.
+ * The pixels are read-only, so the image can only be a filter source.
+ * Release it with unmap_pgm_image (destroy_pgm_image also does).
+ */
+int32_t map_pgm_from_file(const char *filename, pgm_image *image);
+void unmap_pgm_image(pgm_image *image);
+
+/* Row by row access to a P5 file, for images streamed in bands rather
+ * than held in memory whole.
+ */
+typedef struct pgm_file_t
+{
+    int fd;
+    int64_t raster_offset;
+    int32_t width;
+} pgm_file;
+
+/* Opens filename for reading rows, filling only the header fields of
+ * image (no pixel buffer is allocated).
+ */
+int32_t open_pgm_rows(const char *filename, pgm_image *image, pgm_file *file);
+
+/* Creates filename with the header of image, for writing rows */
+int32_t create_pgm_rows(const char *filename, const pgm_image *image,
+        pgm_file *file);
+
+/* Reads count rows starting at row into rows */
+int32_t read_pgm_rows(pgm_file *file, int32_t row, int32_t count,
+        uint8_t *rows);
+
+/* Appends count rows to a file made by create_pgm_rows */
+int32_t write_pgm_rows(pgm_file *file, const uint8_t *rows, int32_t count);
+
+int32_t close_pgm_rows(pgm_file *file);
 #endif
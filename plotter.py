@@ -3,9 +3,12 @@ matplotlib.use('Agg')
 import matplotlib.pyplot as plt
 import matplotlib.patches as mpatches
 from textwrap import wrap
+import csv
+import sys
 
 """ How to use this file:
 python3.7 plotter.py
+python3.7 plotter.py bench.csv -- graphs the results of bench.out
 """
 
 #Plot "mode" on the y axis and  number of threads on the x axis.
@@ -61,3 +64,68 @@ def graph(xvals, list_of_yvals, list_of_names, list_of_colors,
   plt.savefig(filename, bbox_inches='tight')
 
 
+def read_bench(filename):
+  """ Reads the CSV written by bench.out.
+  Returns a list with one dict per configuration, keyed by the columns of
+  the CSV (filter, method, threads, chunk, width, height, repetitions,
+  median_ms, p99_ms, median_low_ms, median_high_ms, mpix_s, mpix_s_low,
+  mpix_s_high), with the values converted to numbers.
+  """
+  rows = []
+  with open(filename) as f:
+    for row in csv.DictReader(f):
+      rows += [{key: float(value) if '.' in value else int(value)
+        for key, value in row.items()}]
+  return rows
+
+
+bench_methods = {1 : "sequential",
+       2 : "sharded_rows",
+       3 : "sharded_columns column major",
+       4 : "sharded_columns row major",
+       5 : "work queue",
+       6 : "work stealing"}
+bench_colours = {1 : "black", 2 : "red", 3 : "green", 4 : "blue",
+       5 : "orange", 6 : "purple"}
+
+
+def graph_bench(rows, filter, width, filename, value = 'mpix_s'):
+  """ Graphs value against the number of threads, one line per method, for
+  one filter and image width of the rows read_bench returns. Work queue and
+  work stealing take their best chunk size for each number of threads; the
+  sequential time is the same for every number of threads.
+  """
+  rows = [row for row in rows if row['filter'] == filter and
+      row['width'] == width]
+  threads = sorted(set(row['threads'] for row in rows if row['method'] != 1))
+  if not threads:
+    threads = [1]
+  best = max if value.startswith('mpix') else min
+
+  names, yvals, colours = [], [], []
+  for method, name in bench_methods.items():
+    values = []
+    for nthread in threads:
+      matching = [row[value] for row in rows if row['method'] == method and
+          (method == 1 or row['threads'] == nthread)]
+      if matching:
+        values += [best(matching)]
+    if len(values) == len(threads):
+      names += [name]
+      yvals += [values]
+      colours += [bench_colours[method]]
+
+  height = rows[0]['height'] if rows else 0
+  graph(threads, yvals, names, colours, filename,
+      '{}x{} image, filter = {}. Median over {} runs.'.format(width, height,
+        filter, rows[0]['repetitions'] if rows else 0),
+      "# Threads", value)
+
+
+if __name__ == '__main__':
+  if len(sys.argv) > 1:
+    bench_rows = read_bench(sys.argv[1])
+    for filter, width in sorted(set((row['filter'], row['width'])
+        for row in bench_rows)):
+      graph_bench(bench_rows, filter, width,
+          'graph_bench_f{}_w{}.png'.format(filter, width))
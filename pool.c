@@ -0,0 +1,168 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct pool_worker_t
+{
+    filter_pool *pool;
+    int32_t id;
+} pool_worker;
+
+struct filter_pool_t
+{
+    int32_t num_threads;
+    pthread_t *threads;
+    pool_worker *workers;
+
+    pthread_mutex_t submit_mutex; // held for the whole duration of a job
+
+    // everything below is protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready; // a new generation was posted, or shutdown
+    pthread_cond_t job_done;  // the last worker finished the job
+    uint64_t generation;      // bumped once per job
+    int32_t pending;          // workers still running the current job
+    int32_t shutdown;
+    pool_job job;
+    void **params;
+
+    // filter settings, see filters.h
+    int32_t claim_batch;
+    int32_t tile_aspect;
+};
+
+/* Workers sleep on job_ready between jobs, and run each generation once */
+static void *pool_worker_main(void *param)
+{
+    pool_worker *self = (pool_worker *) param;
+    filter_pool *pool = self->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pool_job job = pool->job;
+        void *job_param = pool->params[self->id];
+        pthread_mutex_unlock(&pool->lock);
+
+        job(job_param);
+
+        pthread_mutex_lock(&pool->lock);
+        if (-- pool->pending == 0) pthread_cond_signal(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+filter_pool *create_filter_pool(int32_t num_threads)
+{
+    filter_pool *pool = (filter_pool *) calloc(1, sizeof(filter_pool));
+    if (pool == NULL) return NULL;
+    pool->num_threads = num_threads;
+    pool->claim_batch = 1;
+    pool->threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    pool->workers = (pool_worker *) malloc(num_threads * sizeof(pool_worker));
+    if (pool->threads == NULL || pool->workers == NULL) {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->submit_mutex, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    for (int32_t i = 0; i < num_threads; i ++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker_main,
+                    &pool->workers[i])) {
+            // keep the workers that did start, so that destroy can join them
+            pool->num_threads = i;
+            destroy_filter_pool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void destroy_filter_pool(filter_pool *pool)
+{
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int32_t i = 0; i < pool->num_threads; i ++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->job_done);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit_mutex);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+int32_t filter_pool_size(const filter_pool *pool)
+{
+    return pool->num_threads;
+}
+
+void filter_pool_set_claim_batch(filter_pool *pool, int32_t batch)
+{
+    pool->claim_batch = batch > 0 ? batch : 1;
+}
+
+int32_t filter_pool_claim_batch(const filter_pool *pool)
+{
+    return pool->claim_batch;
+}
+
+void filter_pool_set_tile_aspect(filter_pool *pool, int32_t aspect)
+{
+    pool->tile_aspect = aspect;
+}
+
+int32_t filter_pool_tile_aspect(const filter_pool *pool)
+{
+    return pool->tile_aspect;
+}
+
+void filter_pool_run(filter_pool *pool, pool_job job, void **params)
+{
+    pthread_mutex_lock(&pool->submit_mutex);
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->params = params;
+    pool->pending = pool->num_threads;
+    pool->generation ++;
+    pthread_cond_broadcast(&pool->job_ready);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit_mutex);
+}
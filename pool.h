@@ -0,0 +1,40 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __POOL__H
+#define __POOL__H
+
+#include "filters.h"
+#include <stdint.h>
+
+/**************POOL INTERNALS*****************/
+/* A job has the signature of a pthread start routine, so the threaded
+ * methods run unchanged whether they get a thread of their own or a pool
+ * worker. The return value is ignored.
+ */
+typedef void *(*pool_job)(void *param);
+
+/* Number of workers in the pool */
+int32_t filter_pool_size(const filter_pool *pool);
+
+/* Settings of the pool, see the matching setters in filters.h */
+int32_t filter_pool_claim_batch(const filter_pool *pool);
+int32_t filter_pool_tile_aspect(const filter_pool *pool);
+
+/* Runs job(params[i]) on worker i, for every worker of the pool, and waits
+ * for all of them to return. Jobs submitted to the same pool from several
+ * threads run one after the other.
+ */
+void filter_pool_run(filter_pool *pool, pool_job job, void **params);
+#endif
@@ -0,0 +1,94 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+/* Measures the per-call overhead of apply_filter2d_threaded (threads created
+ * and joined on every call) against apply_filter2d_pool (one pool reused),
+ * with the 1x1 identity filter so that the filtering itself costs almost
+ * nothing.
+ *
+ * usage: ./pool_bench.out [num_threads] [iterations]
+ */
+
+#include "pgm.h"
+#include "filters.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (double) t.tv_nsec / 1000000000;
+}
+
+static void bench_size(int32_t width, int32_t height, int32_t nthreads,
+        int32_t iterations)
+{
+    pgm_image source, target;
+    if (create_random_pgm_image(&source, width, height) != NO_ERR ||
+            copy_pgm_image_size(&source, &target) != NO_ERR)
+    {
+        printf("error allocating %dx%d image\n", width, height);
+        exit(1);
+    }
+    const filter *f = builtin_filters[IDENTITY_FILTER];
+
+    double start = now();
+    for (int32_t i = 0; i < iterations; i++)
+    {
+        apply_filter2d_threaded(f, source.matrix, target.matrix,
+                width, height, nthreads, SHARDED_ROWS, 0);
+    }
+    double threaded = (now() - start) / iterations;
+
+    filter_pool *pool = create_filter_pool(nthreads);
+    if (pool == NULL)
+    {
+        printf("error creating pool\n");
+        exit(1);
+    }
+    start = now();
+    for (int32_t i = 0; i < iterations; i++)
+    {
+        apply_filter2d_pool(pool, f, source.matrix, target.matrix,
+                width, height, SHARDED_ROWS, 0, NORMALIZE_IN_PLACE);
+    }
+    double pooled = (now() - start) / iterations;
+    destroy_filter_pool(pool);
+
+    printf("%dx%d threads=%d threaded=%.2lfus pool=%.2lfus saved=%.2lfus\n",
+            width, height, nthreads, threaded * 1e6, pooled * 1e6,
+            (threaded - pooled) * 1e6);
+
+    destroy_pgm_image(&source);
+    destroy_pgm_image(&target);
+}
+
+int main(int argc, char **argv)
+{
+    int32_t nthreads = argc > 1 ? atoi(argv[1]) : 8;
+    int32_t iterations = argc > 2 ? atoi(argv[2]) : 1000;
+    if (nthreads <= 0 || iterations <= 0)
+    {
+        printf("usage: %s [num_threads] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    bench_size(1, 1, nthreads, iterations);
+    bench_size(64, 64, nthreads, iterations);
+    bench_size(1024, 1024, nthreads, iterations / 100 + 1);
+    return 0;
+}
@@ -0,0 +1,115 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "tiles.h"
+#include <stdio.h>
+#include <string.h>
+
+#define CACHE_DIR "/sys/devices/system/cpu/cpu0/cache"
+
+static size_t l1_size = DEFAULT_L1_SIZE;
+static size_t l2_size = DEFAULT_L2_SIZE;
+
+/* Reads the first line of CACHE_DIR/index<index>/<name> into line.
+ * Returns 0 on success.
+ */
+static int read_cache_file(int index, const char *name, char *line,
+        int size)
+{
+    char path[128];
+    snprintf(path, sizeof(path), CACHE_DIR "/index%d/%s", index, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+    int ok = fgets(line, size, file) != NULL;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+/* Runs before main: looks for the level 1 data cache and the level 2
+ * data or unified cache among the caches of cpu 0.
+ */
+__attribute__((constructor))
+static void read_cache_sizes(void)
+{
+    char level[16], type[32], size[32];
+    for (int index = 0; read_cache_file(index, "level", level,
+                sizeof(level)) == 0; index ++) {
+        if (read_cache_file(index, "type", type, sizeof(type)) != 0 ||
+                read_cache_file(index, "size", size, sizeof(size)) != 0 ||
+                strncmp(type, "Instruction", 11) == 0) {
+            continue;
+        }
+        unsigned long value;
+        char unit = 0;
+        if (sscanf(size, "%lu%c", &value, &unit) < 1) continue;
+        if (unit == 'K') value *= 1024;
+        else if (unit == 'M') value *= 1024 * 1024;
+        if (level[0] == '1') l1_size = value;
+        else if (level[0] == '2') l2_size = value;
+    }
+}
+
+size_t data_cache_size(int32_t level)
+{
+    return level == 1 ? l1_size : l2_size;
+}
+
+tile_shape choose_tile_shape(int32_t dimension, int32_t width, int32_t height,
+        int32_t pixel_size)
+{
+    int32_t halo = dimension - 1;
+    tile_shape tile;
+
+    // the source rows of an output row within half of L1
+    int64_t tile_width = (int64_t) l1_size / 2 / (dimension * pixel_size)
+        - halo;
+    tile_width -= tile_width % TILE_WIDTH_STEP;
+    if (tile_width < 4 * TILE_WIDTH_STEP) tile_width = 4 * TILE_WIDTH_STEP;
+    if (tile_width > width) tile_width = width;
+
+    // the tile's source rows, halo included, and output within half of L2
+    int64_t source_row = (tile_width + halo) * pixel_size;
+    int64_t budget = (int64_t) l2_size / 2 - halo * source_row;
+    int64_t tile_height = budget / (source_row + 4 * tile_width);
+    if (tile_height < dimension) tile_height = dimension;
+    if (tile_height > height) tile_height = height;
+
+    tile.width = tile_width > 0 ? tile_width : 1;
+    tile.height = tile_height > 0 ? tile_height : 1;
+    return tile;
+}
+
+tile_shape reshape_tile(tile_shape tile, int32_t aspect, int32_t width,
+        int32_t height)
+{
+    if (aspect > MAX_TILE_ASPECT) aspect = MAX_TILE_ASPECT;
+    if (aspect < -MAX_TILE_ASPECT) aspect = -MAX_TILE_ASPECT;
+    int64_t tile_width = tile.width;
+    int64_t tile_height = tile.height;
+    if (aspect > 0) {
+        tile_width <<= aspect;
+        tile_height >>= aspect;
+    } else if (aspect < 0) {
+        tile_width >>= -aspect;
+        tile_width -= tile_width % TILE_WIDTH_STEP;
+        if (tile_width < TILE_WIDTH_STEP) tile_width = TILE_WIDTH_STEP;
+        tile_height <<= -aspect;
+    }
+    if (tile_width > width) tile_width = width;
+    if (tile_height > height) tile_height = height;
+
+    tile.width = tile_width > 0 ? tile_width : 1;
+    tile.height = tile_height > 0 ? tile_height : 1;
+    return tile;
+}
@@ -0,0 +1,67 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __TILES__H
+#define __TILES__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**************CACHE-BLOCKED TILES*****************/
+/* Every method walks its part of the image tile by tile, each tile row by
+ * row through the row kernels. A tile is sized from the data caches:
+ * - its width keeps the dimension source rows a row of output reads, which
+ *   the next dimension - 1 rows read again, within half of L1;
+ * - its height keeps the whole tile, its halo and its output within half
+ *   of L2, so the halo a neighbouring tile shares is still there.
+ * Narrow images get taller tiles, so that a tile still covers about the
+ * same area, and flat images get all their rows in one row of tiles.
+ */
+
+/* Defaults when sysfs does not say */
+#define DEFAULT_L1_SIZE (32 * 1024)
+#define DEFAULT_L2_SIZE (1024 * 1024)
+
+/* Tile widths are multiples of this, for the vector kernels */
+#define TILE_WIDTH_STEP 16
+
+typedef struct tile_shape_t
+{
+    int32_t height;
+    int32_t width;
+} tile_shape;
+
+/* Size in bytes of the level 1 or 2 data cache of the cpu, read from sysfs
+ * once at startup.
+ */
+size_t data_cache_size(int32_t level);
+
+/* The tile shape for filtering a width x height image with a filter of the
+ * given dimension, whose source pixels take pixel_size bytes (the output
+ * pixels always take 4). The shape never exceeds the image.
+ */
+tile_shape choose_tile_shape(int32_t dimension, int32_t width, int32_t height,
+        int32_t pixel_size);
+
+/* Most tile aspect reshape_tile takes, either way */
+#define MAX_TILE_ASPECT 3
+
+/* tile made 2^aspect times wider and as many times shorter (narrower and
+ * taller for a negative aspect), so it covers about the same area. The
+ * width stays a multiple of TILE_WIDTH_STEP, and the shape never exceeds
+ * the width x height image.
+ */
+tile_shape reshape_tile(tile_shape tile, int32_t aspect, int32_t width,
+        int32_t height);
+#endif
@@ -0,0 +1,201 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#include "trace.h"
+
+#ifdef FILTER_TRACE
+#include "machine.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const char *event_names[NUM_TRACE_EVENTS] = {
+    "convolve", "reduce", "barrier", "normalize",
+    "chunk", "tile", "claim", "steal"
+};
+
+/* A finished event, in ticks */
+typedef struct trace_record_t
+{
+    uint64_t start;
+    uint64_t end;
+    int32_t event;
+    int32_t arg;
+} trace_record;
+
+/* The timeline of one thread. Only that thread touches it until
+ * write_trace.
+ */
+typedef struct thread_trace_t
+{
+    int32_t worker;
+    int32_t in_phase;
+    int32_t depth;                    // events open, may exceed TRACE_DEPTH
+    trace_record open[TRACE_DEPTH];   // the ones that are recorded
+    uint64_t count;                   // events finished
+    trace_record *records;            // the last TRACE_EVENTS_PER_THREAD
+    struct thread_trace_t *next;
+} thread_trace;
+
+// every thread's timeline, under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_trace *threads = NULL;
+static int32_t num_threads = 0;
+
+// when the first timeline started, to turn ticks into time
+static uint64_t first_tick;
+static double first_ns;
+
+static __thread thread_trace *own = NULL;
+
+/* The time stamp counter where there is one: a few cycles, no syscall */
+static inline uint64_t now_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* The calling thread's timeline, NULL if out of memory */
+static thread_trace *own_trace(void)
+{
+    if (own != NULL) return own;
+    thread_trace *tt = (thread_trace *) calloc(1, sizeof(*tt));
+    if (tt == NULL) return NULL;
+    tt->records = (trace_record *) malloc(
+            TRACE_EVENTS_PER_THREAD * sizeof(trace_record));
+    if (tt->records == NULL) {
+        free(tt);
+        return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    if (threads == NULL) {
+        first_tick = now_ticks();
+        first_ns = now_ns();
+    }
+    tt->next = threads;
+    threads = tt;
+    num_threads ++;
+    pthread_mutex_unlock(&lock);
+    own = tt;
+    return tt;
+}
+
+void trace_begin(int32_t event, int32_t arg)
+{
+    thread_trace *tt = own_trace();
+    if (tt == NULL) return;
+    if (tt->depth < TRACE_DEPTH) {
+        tt->open[tt->depth].event = event;
+        tt->open[tt->depth].arg = arg;
+        tt->open[tt->depth].start = now_ticks();
+    }
+    tt->depth ++;
+}
+
+void trace_end(void)
+{
+    thread_trace *tt = own;
+    if (tt == NULL || tt->depth == 0) return;
+    tt->depth --;
+    if (tt->depth >= TRACE_DEPTH) return;
+    trace_record *record = &tt->records[tt->count % TRACE_EVENTS_PER_THREAD];
+    *record = tt->open[tt->depth];
+    record->end = now_ticks();
+    tt->count ++;
+}
+
+void trace_work_begin(int32_t worker)
+{
+    thread_trace *tt = own_trace();
+    if (tt == NULL) return;
+    tt->worker = worker;
+    trace_phase(PHASE_CONVOLVE);
+}
+
+void trace_phase(counter_phase phase)
+{
+    thread_trace *tt = own;
+    if (tt == NULL) return;
+    if (tt->in_phase) trace_end();
+    trace_begin(phase, 0);
+    tt->in_phase = 1;
+}
+
+void trace_work_end(void)
+{
+    thread_trace *tt = own;
+    if (tt == NULL || !tt->in_phase) return;
+    trace_end();
+    tt->in_phase = 0;
+}
+
+int32_t write_trace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return -1;
+
+    pthread_mutex_lock(&lock);
+    double ns_per_tick = 1;
+    if (threads != NULL) {
+        uint64_t ticks = now_ticks() - first_tick;
+        if (ticks > 0) ns_per_tick = (now_ns() - first_ns) / ticks;
+    }
+
+    // threads are numbered in the order they started tracing
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    int32_t tid = num_threads;
+    int first = 1;
+    for (thread_trace *tt = threads; tt != NULL; tt = tt->next) {
+        tid --;
+        fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": "
+                "\"worker %d\"}}", first ? "" : ",", tid, tt->worker);
+        first = 0;
+        uint64_t oldest = tt->count > TRACE_EVENTS_PER_THREAD
+            ? tt->count - TRACE_EVENTS_PER_THREAD : 0;
+        for (uint64_t i = oldest; i < tt->count; i ++) {
+            const trace_record *record =
+                &tt->records[i % TRACE_EVENTS_PER_THREAD];
+            // complete events, in microseconds since the first timeline
+            double start = (int64_t) (record->start - first_tick) *
+                ns_per_tick / 1000;
+            double duration = (record->end - record->start) *
+                ns_per_tick / 1000;
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    event_names[record->event], tid, start, duration);
+            if (record->event == TRACE_CHUNK || record->event == TRACE_TILE) {
+                fprintf(file, ", \"args\": {\"%s\": %d}",
+                        event_names[record->event], record->arg);
+            }
+            fprintf(file, "}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    pthread_mutex_unlock(&lock);
+    return fclose(file) == 0 ? 0 : -1;
+}
+#else
+int32_t write_trace(const char *path)
+{
+    (void) path;
+    return -1;
+}
+#endif
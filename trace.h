@@ -0,0 +1,73 @@
+/* ------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC367 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Bogdan Simion, Maryam Dehnavi, Felipe de Azevedo Piovezan
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2020 Bogdan Simion and Maryam Dehnavi
+ * -------------
+*/
+
+#ifndef __TRACE__H
+#define __TRACE__H
+
+#include "counters.h"
+#include <stdint.h>
+
+/**************PHASE TRACING*****************/
+/* Built with FILTER_TRACE defined (make main TRACE=1), the workers record
+ * a timeline of what each thread does: its phases (see counter_phase),
+ * the chunks and tiles it filters, and the time it spends claiming or
+ * stealing chunks. Each thread writes to a ring buffer of its own, with no
+ * locking, keeping its last TRACE_EVENTS_PER_THREAD events. write_trace
+ * dumps them in the Chrome trace event format, which Perfetto and
+ * chrome://tracing open.
+ * Without FILTER_TRACE the TRACE_ macros expand to nothing.
+ */
+#define TRACE_EVENTS_PER_THREAD 65536
+
+/* Most events open at once on a thread: phase, chunk, tile */
+#define TRACE_DEPTH 8
+
+/* What the events mark, after the phases */
+typedef enum
+{
+    TRACE_CHUNK = NUM_PHASES, // arg: chunk number
+    TRACE_TILE,               // arg: tile number within its block
+    TRACE_CLAIM,              // claiming WORK_QUEUE chunks
+    TRACE_STEAL,              // stealing WORK_STEALING chunks
+    NUM_TRACE_EVENTS
+} trace_event;
+
+/* Writes the events recorded so far to path. Returns 0 on success, -1 on
+ * error or if tracing is compiled out.
+ */
+int32_t write_trace(const char *path);
+
+#ifdef FILTER_TRACE
+void trace_begin(int32_t event, int32_t arg);
+void trace_end(void);
+void trace_work_begin(int32_t worker);
+void trace_phase(counter_phase phase);
+void trace_work_end(void);
+
+/* Starts an event of the calling thread, nested in the ones it has open */
+#define TRACE_BEGIN(event, arg) trace_begin(event, arg)
+/* Ends the last event the calling thread started */
+#define TRACE_END() trace_end()
+/* Like counters_begin, counters_phase and counters_end */
+#define TRACE_WORK_BEGIN(worker) trace_work_begin(worker)
+#define TRACE_PHASE(phase) trace_phase(phase)
+#define TRACE_WORK_END() trace_work_end()
+#else
+#define TRACE_BEGIN(event, arg) ((void) 0)
+#define TRACE_END() ((void) 0)
+#define TRACE_WORK_BEGIN(worker) ((void) 0)
+#define TRACE_PHASE(phase) ((void) 0)
+#define TRACE_WORK_END() ((void) 0)
+#endif
+#endif